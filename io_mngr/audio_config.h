@@ -32,6 +32,9 @@
 
 #define CIRCULAR_QUEUE_SIZE 16
 
+// Max time a worker sleeps on an idle queue before checking its run flag (us)
+#define AUDIO_WAIT_TIMEOUT 20000
+
 #define AUDIO_INTERNAL_SIZE 300
 
 #define AUDIO_INTERNAL_BPS 2
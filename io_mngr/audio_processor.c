@@ -53,45 +53,47 @@ static void *decoder_thread(void* arg)
     audio_processor_t *ap = (audio_processor_t *) arg;
 
     audio_frame2 *frame, *output_frame, *normal;
+    struct timespec deadline;
 
     normal = audio_frame2_init();
     bool normalized;
 
     while(ap->run) {
-        if(ap->coded_cq->level != CIRCULAR_QUEUE_EMPTY) {
-            // TODO: Channel muxing
-
-            // Get the frame to process
-            if ((frame = (audio_frame2 *)cq_get_front(ap->coded_cq)) != NULL) {
-
-                // Get the place to save the resampled frame (last step).
-                if ((output_frame = (audio_frame2 *)cq_get_rear(ap->decoded_cq)) != NULL) {
-                    resampler_set_resampled(ap->resampler, output_frame);
-
-                    // TODO: always get the same size, not only when the frame is too big.
-                    normalized = false;
-                    if (frame->data_len[0] > ap->internal_frame_size) {
-                        normalize_extract(frame, normal, ap->internal_frame_size);
-                        normalized = true;
-                    }
-
-                    // Decompress audio_frame2
-                    if (normalized) {
-                        frame = audio_codec_decompress(ap->compression_config, normal);
-                    }
-                    else {
-                        frame = audio_codec_decompress(ap->compression_config, frame);
-                        cq_remove_bag(ap->coded_cq);
-                    }
-
-                    // Resample audio_frame2
-                    frame = resampler_resample(ap->resampler, frame);
-
-                    // Commit the cq changes.
-                    cq_add_bag(ap->decoded_cq);
-                }
-            }
+        // TODO: Channel muxing
+        cq_deadline(&deadline, AUDIO_WAIT_TIMEOUT);
+
+        // Get the frame to process
+        if ((frame = (audio_frame2 *)cq_wait_front(ap->coded_cq, &deadline)) == NULL) {
+            continue;
+        }
+
+        // Get the place to save the resampled frame (last step).
+        if ((output_frame = (audio_frame2 *)cq_wait_rear(ap->decoded_cq, &deadline)) == NULL) {
+            continue;
+        }
+        resampler_set_resampled(ap->resampler, output_frame);
+
+        // TODO: always get the same size, not only when the frame is too big.
+        normalized = false;
+        if (frame->data_len[0] > ap->internal_frame_size) {
+            normalize_extract(frame, normal, ap->internal_frame_size);
+            normalized = true;
         }
+
+        // Decompress audio_frame2
+        if (normalized) {
+            frame = audio_codec_decompress(ap->compression_config, normal);
+        }
+        else {
+            frame = audio_codec_decompress(ap->compression_config, frame);
+            cq_remove_bag(ap->coded_cq);
+        }
+
+        // Resample audio_frame2
+        frame = resampler_resample(ap->resampler, frame);
+
+        // Commit the cq changes.
+        cq_add_bag(ap->decoded_cq);
     }
     audio_frame2_free(normal);
 
@@ -103,6 +105,7 @@ static void *encoder_thread(void *arg)
     audio_processor_t *ap = (audio_processor_t *)arg;
 
     audio_frame2 *frame, *output_frame, *uncompressed, *tmp_frame;
+    struct timespec deadline;
 
     tmp_frame = audio_frame2_init();
     audio_frame2_allocate(tmp_frame, ap->external_config->ch_count, AUDIO_DEFAULT_SIZE);
@@ -110,31 +113,32 @@ static void *encoder_thread(void *arg)
     resampler_set_resampled(ap->resampler, tmp_frame);
 
     while (ap->run) {
-        if(ap->decoded_cq->level != CIRCULAR_QUEUE_EMPTY) {
-            // TODO: Channel muxing
-
-            // Get the frame to process
-            if ((frame = (audio_frame2 *)cq_get_front(ap->decoded_cq)) != NULL) {
-
-                // Get the place to save the resampled frame (last step).
-                if ((output_frame = (audio_frame2 *)cq_get_rear(ap->coded_cq)) != NULL) {
-
-                    // Resample audio_frame2
-                    uncompressed = resampler_resample(ap->resampler, frame);
-
-                    // Compress audio_frame2 and append it to ap->coded_cq
-                    audio_frame_format(output_frame, ap->external_config);
-                    while ((frame = audio_codec_compress(ap->compression_config, uncompressed)) != NULL) {
-                        audio_frame_append(frame, output_frame);
-                        uncompressed = NULL;
-                    }
-                }
-
-                // Commit the cq changes.
-                cq_remove_bag(ap->decoded_cq);
-                cq_add_bag(ap->coded_cq);
-            }
+        // TODO: Channel muxing
+        cq_deadline(&deadline, AUDIO_WAIT_TIMEOUT);
+
+        // Get the frame to process
+        if ((frame = (audio_frame2 *)cq_wait_front(ap->decoded_cq, &deadline)) == NULL) {
+            continue;
+        }
+
+        // Get the place to save the resampled frame (last step).
+        if ((output_frame = (audio_frame2 *)cq_wait_rear(ap->coded_cq, &deadline)) == NULL) {
+            continue;
         }
+
+        // Resample audio_frame2
+        uncompressed = resampler_resample(ap->resampler, frame);
+
+        // Compress audio_frame2 and append it to ap->coded_cq
+        audio_frame_format(output_frame, ap->external_config);
+        while ((frame = audio_codec_compress(ap->compression_config, uncompressed)) != NULL) {
+            audio_frame_append(frame, output_frame);
+            uncompressed = NULL;
+        }
+
+        // Commit the cq changes.
+        cq_remove_bag(ap->decoded_cq);
+        cq_add_bag(ap->coded_cq);
     }
     audio_frame2_free(tmp_frame);
 
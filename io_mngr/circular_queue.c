@@ -23,11 +23,60 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include "debug.h"
 #include "circular_queue.h"
 
+static inline int cq_next(circular_queue_t *cq, int pos);
+static inline int cq_count(circular_queue_t *cq, int rear, int front);
+static void cq_notify(circular_queue_t *cq);
+static void *cq_wait(circular_queue_t *cq, void *(*get_bag)(circular_queue_t *), const struct timespec *deadline);
+
+static inline int cq_next(circular_queue_t *cq, int pos) {
+    return (pos + 1) % (2 * cq->max);
+}
+
+static inline int cq_count(circular_queue_t *cq, int rear, int front) {
+    return (rear + 2 * cq->max - (front >> 1)) % (2 * cq->max);
+}
+
+static void cq_notify(circular_queue_t *cq) {
+
+    // Sleepers announce themselves in waiters, skip the mutex otherwise
+    if (__atomic_load_n(&cq->waiters, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cq->lock);
+    pthread_cond_broadcast(&cq->cond);
+    pthread_mutex_unlock(&cq->lock);
+}
+
+static void *cq_wait(circular_queue_t *cq, void *(*get_bag)(circular_queue_t *), const struct timespec *deadline) {
+
+    void *bag;
+
+    if ((bag = get_bag(cq)) != NULL) {
+        return bag;
+    }
+
+    __atomic_add_fetch(&cq->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&cq->lock);
+    while ((bag = get_bag(cq)) == NULL) {
+        if (pthread_cond_timedwait(&cq->cond, &cq->lock, deadline) == ETIMEDOUT) {
+            bag = get_bag(cq);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cq->lock);
+    __atomic_sub_fetch(&cq->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return bag;
+}
+
 circular_queue_t *cq_init(int max, void *(*init_object)(void *), void (*destroy_object)(void *), void *init_data) {
 
+    pthread_condattr_t attr;
+
     if (max <= 1){
         error_msg("video frame queue must have at least 2 positions");
         return NULL;
@@ -41,7 +90,14 @@ circular_queue_t *cq_init(int max, void *(*init_object)(void *), void (*destroy_
     cq->rear = 0;
     cq->front = 0;
     cq->max = max;
-    cq->level = CIRCULAR_QUEUE_EMPTY;
+    cq->waiters = 0;
+    cq->ready_cb = NULL;
+    cq->ready_arg = NULL;
+    pthread_mutex_init(&cq->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cq->cond, &attr);
+    pthread_condattr_destroy(&attr);
     cq->init_object = init_object;
     cq->destroy_object = destroy_object;
     cq->bags = malloc(sizeof(void *) * max);
@@ -57,57 +113,117 @@ void cq_destroy(circular_queue_t* cq) {
     for(int i = 0; i < cq->max; i++) {
         cq->destroy_object(cq->bags[i]);
     }
+    pthread_cond_destroy(&cq->cond);
+    pthread_mutex_destroy(&cq->lock);
     free(cq->bags);
     free(cq);
 }
 
+cq_level_t cq_get_level(circular_queue_t *cq) {
+
+    int count = cq_count(cq, __atomic_load_n(&cq->rear, __ATOMIC_ACQUIRE),
+            __atomic_load_n(&cq->front, __ATOMIC_ACQUIRE));
+
+    if (count == 0) {
+        return CIRCULAR_QUEUE_EMPTY;
+    } else if (count == cq->max) {
+        return CIRCULAR_QUEUE_FULL;
+    }
+    return CIRCULAR_QUEUE_MID;
+}
+
+void cq_deadline(struct timespec *deadline, long timeout_us) {
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_us / 1000000;
+    deadline->tv_nsec += (timeout_us % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
 void *cq_get_rear(circular_queue_t *cq) {
 
-    if (cq->level == CIRCULAR_QUEUE_FULL) {
+    // Acquire pairs with cq_remove_bag: the consumer is done with this bag
+    int front = __atomic_load_n(&cq->front, __ATOMIC_ACQUIRE);
+    if (cq_count(cq, cq->rear, front) == cq->max) {
         return NULL;
     }
-    return cq->bags[cq->rear];
+    return cq->bags[cq->rear % cq->max];
+}
+
+void *cq_wait_rear(circular_queue_t *cq, const struct timespec *deadline) {
+
+    return cq_wait(cq, cq_get_rear, deadline);
+}
+
+void cq_set_ready_cb(circular_queue_t *cq, void (*ready_cb)(void *), void *ready_arg) {
+
+    __atomic_store_n(&cq->ready_cb, NULL, __ATOMIC_RELEASE);
+    cq->ready_arg = ready_arg;
+    __atomic_store_n(&cq->ready_cb, ready_cb, __ATOMIC_RELEASE);
 }
 
 void cq_add_bag(circular_queue_t *cq) {
+    void (*ready_cb)(void *);
+
+    __atomic_store_n(&cq->rear, cq_next(cq, cq->rear), __ATOMIC_SEQ_CST);
+    cq_notify(cq);
 
-    int r =  (cq->rear + 1) % cq->max;
-    if (r == cq->front) {
-        cq->level = CIRCULAR_QUEUE_FULL;
-    } else {
-        cq->level = CIRCULAR_QUEUE_MID;
+    ready_cb = __atomic_load_n(&cq->ready_cb, __ATOMIC_ACQUIRE);
+    if (ready_cb != NULL) {
+        ready_cb(cq->ready_arg);
     }
-    cq->rear = r;
 }
 
 void* cq_get_front(circular_queue_t *cq) {
 
-    if (cq->level == CIRCULAR_QUEUE_EMPTY) {
-        return NULL;
-    }
+    int front = __atomic_load_n(&cq->front, __ATOMIC_ACQUIRE);
+
+    do {
+        if (front & 1) {
+            break;
+        }
+        if (cq_count(cq, __atomic_load_n(&cq->rear, __ATOMIC_ACQUIRE), front) == 0) {
+            return NULL;
+        }
+        // Mark the bag as being read, fails if cq_flush dropped it meanwhile
+    } while (!__atomic_compare_exchange_n(&cq->front, &front, front | 1,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-    return cq->bags[cq->front];
+    return cq->bags[(front >> 1) % cq->max];
+}
+
+void* cq_wait_front(circular_queue_t *cq, const struct timespec *deadline) {
+
+    return cq_wait(cq, cq_get_front, deadline);
 }
 
 void cq_remove_bag(circular_queue_t *cq) {
 
-    int f = (cq->front + 1) % cq->max;
-    if (f == cq->rear) {
-        cq->level = CIRCULAR_QUEUE_EMPTY;
-    } else {
-        cq->level = CIRCULAR_QUEUE_MID;
+    int front = __atomic_load_n(&cq->front, __ATOMIC_RELAXED);
+
+    if (!(front & 1) && cq_get_front(cq) == NULL) {
+        return;
     }
-    cq->front = f;
+    front = __atomic_load_n(&cq->front, __ATOMIC_RELAXED) >> 1;
+    __atomic_store_n(&cq->front, cq_next(cq, front) << 1, __ATOMIC_SEQ_CST);
+    cq_notify(cq);
 }
 
-void cq_flush(circular_queue_t *cq) {
+int cq_flush(circular_queue_t *cq) {
+
+    int front = __atomic_load_n(&cq->front, __ATOMIC_ACQUIRE);
 
-    if (cq->level == CIRCULAR_QUEUE_FULL){
-        int r = (cq->rear + 1) % cq->max;
-        if (r != cq->rear){
-            cq->level = CIRCULAR_QUEUE_MID;
-            cq->rear = r;
+    while (cq_count(cq, cq->rear, front) == cq->max) {
+        if (front & 1) {
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(&cq->front, &front, cq_next(cq, front >> 1) << 1,
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
         }
     }
+    return 1;
 }
-
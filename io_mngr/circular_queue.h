@@ -29,17 +29,31 @@
 #ifndef __CIRCULAR_QUEUE_H__
 #define __CIRCULAR_QUEUE_H__
 
+#include <pthread.h>
+#include <time.h>
+
 typedef enum {
     CIRCULAR_QUEUE_MID,
     CIRCULAR_QUEUE_EMPTY,
     CIRCULAR_QUEUE_FULL
 } cq_level_t;
 
+/**
+ * One producer thread fills 'bags' at rear and one consumer thread empties
+ * them from front. Both positions run in [0, 2*max) so full and empty can be
+ * told apart, and they are published with release/acquire ordering. The
+ * lowest bit of front marks the front 'bag' as being read (cq_get_front), so
+ * cq_flush never drops a 'bag' in use.
+ */
 typedef struct circular_queue {
     int rear;
     int front;
     int max;
-    cq_level_t level;
+    int waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*ready_cb)(void *);
+    void *ready_arg;
     void *(*init_object)(void *);
     void (*destroy_object)(void *);
     void **bags;
@@ -61,6 +75,29 @@ circular_queue_t *cq_init(int max, void *(*init_object)(void *), void (*destroy_
  */
 void cq_destroy(circular_queue_t* cq);
 
+/**
+ * Registers a callback run by the producer after every cq_add_bag. It must
+ * be cheap and must not block.
+ * @param cq Target circular_queue_t.
+ * @param ready_cb Callback, NULL to unregister.
+ * @param ready_arg Argument passed to ready_cb.
+ */
+void cq_set_ready_cb(circular_queue_t *cq, void (*ready_cb)(void *), void *ready_arg);
+
+/**
+ * Returns the current filling level of the queue.
+ * @param cq Target circular_queue_t.
+ * @return The cq_level_t seen at the moment of the call.
+ */
+cq_level_t cq_get_level(circular_queue_t *cq);
+
+/**
+ * Fills a deadline for the cq_wait_* functions.
+ * @param deadline The struct timespec to fill.
+ * @param timeout_us Microseconds from now.
+ */
+void cq_deadline(struct timespec *deadline, long timeout_us);
+
 /**
  * Returns the pointer from the front 'bag', useful to get the element from the 'bag'.
  * @param max Target circular_queue_t.
@@ -68,6 +105,14 @@ void cq_destroy(circular_queue_t* cq);
  */
 void* cq_get_front(circular_queue_t *cq);
 
+/**
+ * Like cq_get_front, but sleeps until a 'bag' is filled or the deadline expires.
+ * @param cq Target circular_queue_t.
+ * @param deadline Absolute CLOCK_MONOTONIC time, see cq_deadline.
+ * @return A pointer to the front element or NULL if the queue is still empty.
+ */
+void* cq_wait_front(circular_queue_t *cq, const struct timespec *deadline);
+
 /**
  * Advances the front one position removing the latter front 'bag' from filled 'bags' set.
  * @param max Target circular_queue_t.
@@ -81,6 +126,14 @@ void cq_remove_bag(circular_queue_t *cq);
  */
 void *cq_get_rear(circular_queue_t *cq);
 
+/**
+ * Like cq_get_rear, but sleeps until a 'bag' is freed or the deadline expires.
+ * @param cq Target circular_queue_t.
+ * @param deadline Absolute CLOCK_MONOTONIC time, see cq_deadline.
+ * @return A pointer to the free rear 'bag' or NULL if the queue is still full.
+ */
+void *cq_wait_rear(circular_queue_t *cq, const struct timespec *deadline);
+
 /**
  * Advances the rear one position adding the latter rear element to the filled 'bags' set.
  * @param max Target circular_queue_t.
@@ -89,10 +142,12 @@ void cq_add_bag(circular_queue_t *cq);
 
 
 /**
- * Mercilessly forgets the rear element only if the queue is full.
+ * Mercilessly forgets the front element only if the queue is full and the
+ * consumer is not reading it. Only the producer may call it.
  * @param max Target circular_queue_t.
+ * @return 1 if there is a free 'bag' at rear, 0 otherwise.
  */
-void cq_flush(circular_queue_t *cq);
+int cq_flush(circular_queue_t *cq);
 
 #endif //__CIRCULAR_QUEUE_H__
 
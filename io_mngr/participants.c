@@ -34,6 +34,7 @@ rtp_session_t * init_rtp_session(uint32_t port, char *addr){
 
     rtp->port = port;
     rtp->addr = addr;
+    rtp->keyframe_requests = 0;
 
     module_init_default(&tmod);
 
@@ -49,6 +50,10 @@ rtp_session_t * init_rtp_session(uint32_t port, char *addr){
     rtp_set_option(rtp_conn, RTP_OPT_WEAK_VALIDATION, 1);
     rtp_set_sdes(rtp_conn, rtp_my_ssrc(rtp_conn), RTCP_SDES_TOOL, PACKAGE_STRING, strlen(PACKAGE_STRING));
     rtp_set_send_buf(rtp_conn, DEFAULT_SEND_BUFFER_SIZE);
+    if (!rtp_set_retransmission(rtp_conn, RETRANSMISSION_HISTORY, RETRANSMISSION_BUDGET)){
+        error_msg("rtp_session: cannot keep packets for retransmission");
+    }
+    rtp_set_rate_control(rtp_conn, VIDEO_MIN_BITRATE, VIDEO_MAX_BITRATE);
 
     tx_session = tx_init_h264(&tmod, MTU, TX_MEDIA_VIDEO, NULL, NULL);
     if (tx_session == NULL){
@@ -89,6 +94,7 @@ participant_data_t *init_participant(uint32_t id, io_type_t type, char *addr, ui
     participant->id = id;
     participant->ssrc = 0;
     participant->next = participant->previous = NULL;
+    participant->index_next = NULL;
     participant->type = type;
 
     if (type == OUTPUT){
@@ -198,6 +204,16 @@ int set_participant_ssrc(participant_data_t *participant, uint32_t ssrc){
     return TRUE;
 }
 
+int set_participant_pacing(participant_data_t *participant, uint64_t rate, uint32_t burst){
+    if (participant->rtp == NULL){
+        return FALSE;
+    }
+    if (burst == 0){
+        burst = PACING_DEFAULT_BURST;
+    }
+    return rtp_set_pacing(participant->rtp->rtp, rate, burst);
+}
+
 int remove_participant(participant_list_t *list, uint32_t id){
     participant_data_t *participant;
 
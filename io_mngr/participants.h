@@ -25,6 +25,7 @@ typedef struct rtp_session {
     char *addr;
     struct rtp *rtp;
     struct tx *tx_session;
+    uint32_t keyframe_requests; // rtp_get_keyframe_requests already served
 } rtp_session_t;
 
 typedef struct participant_list {
@@ -41,6 +42,7 @@ struct participant_data {
     uint8_t active;
     participant_data_t *next;
     participant_data_t *previous;
+    participant_data_t *index_next;     // in the SSRC index of the stream list
     io_type_t type;
     rtp_session_t *rtp;
     stream_data_t *stream;
@@ -58,6 +60,8 @@ participant_data_t *get_participant_non_init(participant_list_t *list);
 
 
 int set_participant_ssrc(participant_data_t *participant, uint32_t ssrc);
+// rate in bits per second, 0 for no limit; burst in bytes, 0 for PACING_DEFAULT_BURST
+int set_participant_pacing(participant_data_t *participant, uint64_t rate, uint32_t burst);
 
 participant_data_t *init_participant(uint32_t id, io_type_t type, char *addr, uint32_t port);
 void set_active_participant(participant_data_t *participant, uint8_t active);
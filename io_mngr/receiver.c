@@ -27,6 +27,7 @@
 #include "receiver.h"
 #include "rtp/rtp_callback.h"
 #include "rtp/rtp.h"
+#include "rtp/rtp_reactor.h"
 #include "rtp/audio_decoders.h"
 #include "pdb.h"
 #include "tv.h"
@@ -34,192 +35,320 @@
 
 #define INITIAL_VIDEO_RECV_BUFFER_SIZE  ((4*1920*1080)*110/100) //command line net.core setup: sysctl -w net.core.rmem_max=9123840
 
-static void *video_receiver_thread(receiver_t *receiver);
-static void *audio_receiver_thread(receiver_t *receiver);
+/* Per participant state of the video receiver, kept in pdb_e decoder_state */
+struct video_rx_state {
+    struct h264_rx_state h264;
+    uint32_t incomplete_frames;         // pbuf_stats value already seen
+    int keyframe_wanted;                // frames were lost since the last INTRA
+    struct timeval keyframe_request_time;
+};
 
+static void video_receiver_keyframe(receiver_shard_t *shard, struct pdb_e *cp,
+        participant_data_t *participant, int got_intra, struct timeval curr_time);
+static int video_receiver_frame(receiver_shard_t *shard, struct pdb_e *cp, struct timeval curr_time);
+static void video_receiver_batch(struct rtp *session, struct timeval curr_time, void *arg);
+static void audio_receiver_batch(struct rtp *session, struct timeval curr_time, void *arg);
+
+/*
+ * Asks the sender of a participant for a keyframe while its stream cannot
+ * be decoded: a FIR until the stream gets its first INTRA frame, a PLI once
+ * a frame was given up incomplete, since the frames depending on it are
+ * broken too. The request is repeated every
+ * RECEIVER_KEYFRAME_REQUEST_INTERVAL until an INTRA frame arrives, in case
+ * it or the answer got lost. rtp_send_ctrl sends it.
+ */
+static void video_receiver_keyframe(receiver_shard_t *shard, struct pdb_e *cp,
+        participant_data_t *participant, int got_intra, struct timeval curr_time)
+{
+    struct video_rx_state *state = (struct video_rx_state *) cp->decoder_state;
+    struct pbuf_stats stats;
+    int fir;
+
+    if (state == NULL){
+        return;
+    }
+
+    pbuf_get_stats(cp->playout_buffer, &stats);
+    if (stats.incomplete_frames != state->incomplete_frames){
+        state->incomplete_frames = stats.incomplete_frames;
+        state->keyframe_wanted = TRUE;
+    }
+    if (got_intra){
+        state->keyframe_wanted = FALSE;
+    }
+
+    fir = participant->stream->state == I_AWAIT;
+    if (!fir && !state->keyframe_wanted){
+        return;
+    }
+    if (tv_diff(curr_time, state->keyframe_request_time) < RECEIVER_KEYFRAME_REQUEST_INTERVAL){
+        return;
+    }
+    if (rtp_queue_keyframe_request(shard->session, cp->ssrc, fir)){
+        state->keyframe_request_time = curr_time;
+    }
+}
+
+/*
+ * Moves at most one frame of a participant from its playout buffer to its
+ * coded frame queue.
+ * @return FALSE if the SSRC has no participant, so nobody takes its frames.
+ */
 //TODO: refactor de la funció per evitar tants IF anidats
-void *video_receiver_thread(receiver_t *receiver)
+static int video_receiver_frame(receiver_shard_t *shard, struct pdb_e *cp, struct timeval curr_time)
 {
-    struct pdb_e *cp;
+    receiver_t *receiver = shard->receiver;
     participant_data_t *participant;
     video_data_frame_t* coded_frame;
+    struct video_rx_state *state;
+    struct h264_rx_data rx_data;
+    frame_type_t frame_type;
+    int got_intra = FALSE;
+
+    participant = get_participant_stream_ssrc(receiver->video_stream_list, cp->ssrc);
+    // Other shards may learn this SSRC from RTCP only, never claim for them
+    if (participant == NULL && !pbuf_is_empty(cp->playout_buffer)){
+        participant = claim_participant_stream_ssrc(receiver->video_stream_list, cp->ssrc);
+    }
+
+    if (participant == NULL){
+        return FALSE;
+    }
+    participant->stream->video->playout_delay =
+        pbuf_get_playout_delay(cp->playout_buffer);
+    // Frames still held past their deletion delay are too late to be shown
+    pbuf_remove(cp->playout_buffer, curr_time);
+
+    coded_frame = curr_in_frame(participant->stream->video->coded_frames);
+    if (coded_frame == NULL 
+            && pbuf_check_if_complete_frame(cp->playout_buffer, curr_time)){
+        // The queue policy decides on the type of the frame to depacketize
+        if (!pbuf_peek(cp->playout_buffer, curr_time, frame_type_h264, &frame_type)){
+            frame_type = OTHER;
+        }
+        coded_frame = get_in_frame(participant->stream->video->coded_frames, frame_type, 0);
+        if (coded_frame == NULL){
+            pbuf_discard_frame(cp->playout_buffer);
+            error_msg("Warning! Coded frame discarded in reception\n");
+            participant->stream->video->lost_coded_frames++;
+        }
+    }
+    if (coded_frame == NULL){
+        video_receiver_keyframe(shard, cp, participant, FALSE, curr_time);
+        return TRUE;
+    }
 
-    struct timeval curr_time;
-    struct timeval timeout;
-    struct timeval start_time;
-    gettimeofday(&start_time, NULL);
-
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 10000;
-    uint32_t timestamp; //TODO: why is this used
-
-    while(receiver->video_run){
-        gettimeofday(&curr_time, NULL);
-        timestamp = tv_diff(curr_time, start_time) * 90000;
-        rtp_update(receiver->video_session, curr_time);
-        //rtp_send_ctrl(receiver->session, timestamp, 0, curr_time); //TODO: why is this used?
-
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 10000;
-
-        //TODO: repàs dels locks en accedir a src
-        if (!rtp_recv_r(receiver->video_session, &timeout, timestamp)){
-            pdb_iter_t it;
-            cp = pdb_iter_init(receiver->video_part_db, &it);
-
-            while (cp != NULL) {
-
-                participant = get_participant_stream_ssrc(receiver->video_stream_list, cp->ssrc);
-                if (participant == NULL){
-                    participant = get_participant_stream_non_init(receiver->video_stream_list);
-                    if (participant != NULL){
-                        set_participant_ssrc(participant, cp->ssrc);
-                    }
-                }
-
-                if (participant == NULL){
-                    cp = pdb_iter_next(&it);
-                    continue;
-                }
-
-                coded_frame = curr_in_frame(participant->stream->video->coded_frames);
-                if (coded_frame == NULL){
-                    if(pbuf_check_if_complete_frame(cp->playout_buffer, curr_time)){
-                        pbuf_remove_first(cp->playout_buffer);
-                        error_msg("Warning! Coded frame discarded in reception\n");
-                        participant->stream->video->lost_coded_frames++;
-                    }
-                    cp = pdb_iter_next(&it);
-                    continue;
-                }
-
-                if (pbuf_decode(cp->playout_buffer, curr_time, decode_frame_h264, coded_frame)) {
-                    if (participant->stream->state == I_AWAIT && 
-                            coded_frame->frame_type == INTRA && 
-                            coded_frame->width != 0 && 
-                            coded_frame->height != 0){
-
-                        if(participant->stream->video->decoder == NULL){
-                            set_video_frame_cq(participant->stream->video->decoded_frames, 
-                                    RGB, 
-                                    coded_frame->width, 
-                                    coded_frame->height);
-                            start_decoder(participant->stream->video); 
-                        }
-                        participant->stream->state = ACTIVE;
-                    }
-
-                    if (participant->stream->state == ACTIVE && coded_frame->frame_type != BFRAME) {
-                        participant->stream->video->seqno++;
-                        coded_frame->seqno = participant->stream->video->seqno;
-                        coded_frame->media_time = get_local_mediatime_us();
-                        put_frame(participant->stream->video->coded_frames);
-                    } else {
-                        debug_msg("No support for Bframes\n");
-                    }
-                    //TODO: should be at the beginning of the loop
-                    pbuf_remove_first(cp->playout_buffer);
-
-                }
-                cp = pdb_iter_next(&it);
-            } 
-            pdb_iter_done(&it);
+    if (cp->decoder_state == NULL){
+        cp->decoder_state = calloc(1, sizeof(struct video_rx_state));
+        if (cp->decoder_state == NULL){
+            error_msg("video_receiver_frame: malloc error\n");
+            return TRUE;
         }
+        cp->decoder_state_deleter = free;
     }
+    state = (struct video_rx_state *) cp->decoder_state;
+    rx_data.frame = coded_frame;
+    rx_data.state = &state->h264;
+
+    if (pbuf_decode(cp->playout_buffer, curr_time, decode_frame_h264, &rx_data)) {
+        got_intra = coded_frame->frame_type == INTRA;
+        if (participant->stream->state == I_AWAIT && 
+                coded_frame->frame_type == INTRA && 
+                coded_frame->width != 0 && 
+                coded_frame->height != 0){
+
+            if(participant->stream->video->decoder == NULL){
+                set_video_frame_cq(participant->stream->video->decoded_frames, 
+                        RGB, 
+                        coded_frame->width, 
+                        coded_frame->height);
+                start_decoder(participant->stream->video); 
+            }
+            participant->stream->state = ACTIVE;
+        }
+
+        if (participant->stream->state == ACTIVE && coded_frame->frame_type != BFRAME) {
+            participant->stream->video->seqno++;
+            coded_frame->seqno = participant->stream->video->seqno;
+            coded_frame->media_time = get_local_mediatime_us();
+            put_frame(participant->stream->video->coded_frames);
+        } else {
+            debug_msg("No support for Bframes\n");
+        }
+        //TODO: should be at the beginning of the loop
+        pbuf_remove_first(cp->playout_buffer);
 
-    pthread_exit((void *)NULL);   
+    }
+    video_receiver_keyframe(shard, cp, participant, got_intra, curr_time);
+    return TRUE;
 }
 
-static void *audio_receiver_thread(receiver_t *receiver)
+/*
+ * Runs on the reactor thread of a video shard after every batch of packets
+ * and on every reactor tick. Only the participants that completed a frame
+ * since (see pdb_push_ready) are visited; the ones that still hold complete
+ * frames, not due yet or not fitting in their queue, are visited again on
+ * the next call.
+ */
+static void video_receiver_batch(struct rtp *session, struct timeval curr_time, void *arg)
 {
+    receiver_shard_t *shard = (receiver_shard_t *) arg;
+    struct pdb_e *cp;
+    int ready;
+
+    //TODO: repàs dels locks en accedir a src
+    ready = pdb_ready_count(shard->part_db);
+    while (ready-- > 0 && (cp = pdb_pop_ready(shard->part_db)) != NULL) {
+        if (video_receiver_frame(shard, cp, curr_time)
+                && pbuf_has_complete_frame(cp->playout_buffer)) {
+            pdb_push_ready(shard->part_db, cp);
+        }
+    }
+
+    // Sends the retransmission and keyframe requests of the packets just received
+    rtp_send_ctrl(session, get_local_mediatime(), NULL, curr_time);
+}
+
+/*
+ * Audio counterpart of video_receiver_batch.
+ */
+static void audio_receiver_batch(struct rtp *session, struct timeval curr_time, void *arg)
+{
+    receiver_t *receiver = (receiver_t *) arg;
+    struct state_audio_decoder *decode_object = &receiver->audio_decoder;
     struct pdb_e *cp;
     participant_data_t *participant;
-    struct state_audio_decoder decode_object;
-
-    struct timeval curr_time;
-    struct timeval timeout;
-    struct timeval start_time;
-    gettimeofday(&start_time, NULL);
-
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 999999 / 59.94;
-    uint32_t timestamp;
-
-    decode_object.resampler = NULL;
-
-    while(receiver->video_run) {
-        gettimeofday(&curr_time, NULL);
-        timestamp = tv_diff(curr_time, start_time) * 90000;
-        rtp_update(receiver->audio_session, curr_time);
-        //rtp_send_ctrl(receiver->audio_session, timestamp, 0, curr_time); //TODO: use this.
-
-        //TODO: repàs dels locks en accedir a src
-        if (!rtp_recv_r(receiver->audio_session, &timeout, timestamp)){
-            pdb_iter_t it;
-            cp = pdb_iter_init(receiver->audio_part_db, &it);
-
-            while (cp != NULL) {
-
-                //TODO: Possible optimization using participant hash
-                if ((participant = get_participant_stream_ssrc(receiver->audio_stream_list, cp->ssrc)) == NULL) {
-                    if ((participant = get_participant_stream_non_init(receiver->audio_stream_list)) == NULL) {
-                        debug_msg("audio_receiver_thread: Can't find configured streams, dropping data");
-                        cp = pdb_iter_next(&it);
-                        continue;
-                    }
-                    else {
-                        set_participant_ssrc(participant, cp->ssrc);
-                    }
-                }
-
-                if ((decode_object.frame = cq_get_rear(participant->stream->audio->coded_cq)) == NULL) {
-                    debug_msg("receiver thread: coded circular queue is full");
-                    cp = pdb_iter_next(&it);
-                    continue;
-                }
-
-                decode_object.desc = ap_get_config(participant->stream->audio);
-
-                // TODO: Generate tools to get the correct decoder callback from audio_processor_t audio configuration.
-                // Maybe a codec_t table and its decoding callbacks paired with a getter function.
-                if (rtp_audio_pbuf_decode(cp->playout_buffer, curr_time, decode_audio_frame_mulaw, &decode_object)) {
-                    cq_add_bag(participant->stream->audio->coded_cq);
-                }
-                cp = pdb_iter_next(&it);
-            } 
-            pdb_iter_done(&it);
+
+    UNUSED(session);
+
+    //TODO: repàs dels locks en accedir a src
+    pdb_iter_t it;
+    cp = pdb_iter_init(receiver->audio_part_db, &it);
+
+    while (cp != NULL) {
+
+        if ((participant = claim_participant_stream_ssrc(receiver->audio_stream_list, cp->ssrc)) == NULL) {
+            debug_msg("audio_receiver_batch: Can't find configured streams, dropping data");
+            cp = pdb_iter_next(&it);
+            continue;
+        }
+
+        if ((decode_object->frame = cq_get_rear(participant->stream->audio->coded_cq)) == NULL) {
+            debug_msg("receiver thread: coded circular queue is full");
+            cp = pdb_iter_next(&it);
+            continue;
+        }
+
+        decode_object->desc = ap_get_config(participant->stream->audio);
+
+        // TODO: Generate tools to get the correct decoder callback from audio_processor_t audio configuration.
+        // Maybe a codec_t table and its decoding callbacks paired with a getter function.
+        if (rtp_audio_pbuf_decode(cp->playout_buffer, curr_time, decode_audio_frame_mulaw, decode_object)) {
+            cq_add_bag(participant->stream->audio->coded_cq);
         }
+        cp = pdb_iter_next(&it);
+    } 
+    pdb_iter_done(&it);
+}
+
+static int init_video_shard(receiver_t *receiver, receiver_shard_t *shard, int ttl, double rtcp_bw)
+{
+    shard->receiver = receiver;
+    shard->part_db = pdb_init();
+    if (shard->part_db == NULL) {
+        return FALSE;
+    }
+    pdb_set_playout_delay(shard->part_db, RECEIVER_MIN_PLAYOUT_DELAY,
+            RECEIVER_MAX_PLAYOUT_DELAY);
+    shard->session = rtp_init_if(NULL, NULL, receiver->video_port, 0, ttl,
+            rtcp_bw, 0, rtp_recv_callback, (void *)shard->part_db, 0);
+    if (shard->session == NULL) {
+        return FALSE;
     }
 
-    pthread_exit((void *)NULL);   
+    // The SRs of a participant may reach any shard, its reports need them
+    rtp_set_sr_table(shard->session, receiver->video_sr_table);
+
+    if (!rtp_set_option(shard->session, RTP_OPT_WEAK_VALIDATION, 1)) {
+        return FALSE;
+    }
+    if (!rtp_set_option(shard->session, RTP_OPT_NACK, 1)) {
+        return FALSE;
+    }
+    if (!rtp_set_sdes(shard->session, rtp_my_ssrc(shard->session),
+                RTCP_SDES_TOOL, PACKAGE_STRING, strlen(PACKAGE_STRING))) { //TODO: is this needed?
+        return FALSE;
+    }
+    if (!rtp_set_recv_buf(shard->session, INITIAL_VIDEO_RECV_BUFFER_SIZE)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void destroy_video_shards(receiver_t *receiver)
+{
+    int i;
+
+    for (i = 0; i < receiver->video_shard_count; i++) {
+        if (receiver->video_shards[i].session != NULL) {
+            rtp_done(receiver->video_shards[i].session);
+        }
+        if (receiver->video_shards[i].part_db != NULL) {
+            pdb_destroy(&receiver->video_shards[i].part_db);
+        }
+    }
+    free(receiver->video_shards);
+    receiver->video_shards = NULL;
+    receiver->video_shard_count = 0;
+    rtp_sr_table_done(receiver->video_sr_table);
+    receiver->video_sr_table = NULL;
 }
 
-receiver_t *init_receiver(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, uint32_t video_port, uint32_t audio_port)
+receiver_t *init_receiver(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, uint32_t video_port, uint32_t audio_port, int video_shards)
 {
     receiver_t *receiver;
     double rtcp_bw = 5 * 1024 * 1024; /* FIXME */
     int ttl = 255; //TODO: get rid of magic numbers!
+    int i;
+
+    if (video_shards < 1 || video_shards > RECEIVER_MAX_VIDEO_SHARDS) {
+        error_msg("init_receiver: invalid number of video shards %d\n", video_shards);
+        return NULL;
+    }
 
     receiver = malloc(sizeof(receiver_t));
+    receiver->reactor = NULL;
+    receiver->audio_decoder.resampler = NULL;
 
     // Video initialization
-    receiver->video_session = (struct rtp *) malloc(sizeof(struct rtp *));
-    receiver->video_part_db = pdb_init();
     receiver->video_run = FALSE;
     receiver->video_port = video_port;
     receiver->video_stream_list = video_stream_list;
-    receiver->video_session = rtp_init_if(NULL, NULL, receiver->video_port, 0, ttl,
-            rtcp_bw, 0, rtp_recv_callback, (void *)receiver->video_part_db, 0);
-
-    if (receiver->video_session != NULL) {
-        if (!rtp_set_option(receiver->video_session, RTP_OPT_WEAK_VALIDATION, 1)) {
-            return NULL;
-        }
-        if (!rtp_set_sdes(receiver->video_session, rtp_my_ssrc(receiver->video_session),
-                    RTCP_SDES_TOOL, PACKAGE_STRING, strlen(PACKAGE_STRING))) { //TODO: is this needed?			
+    receiver->video_shard_count = video_shards;
+    receiver->video_sr_table = NULL;
+    receiver->video_shards = calloc(video_shards, sizeof(receiver_shard_t));
+    if (receiver->video_shards == NULL) {
+        error_msg("init_receiver: malloc error\n");
+        free(receiver);
+        return NULL;
+    }
+    if (video_shards > 1) {
+        receiver->video_sr_table = rtp_sr_table_init();
+        if (receiver->video_sr_table == NULL) {
+            error_msg("init_receiver: malloc error\n");
+            free(receiver->video_shards);
+            free(receiver);
             return NULL;
         }
-        if (!rtp_set_recv_buf(receiver->video_session, INITIAL_VIDEO_RECV_BUFFER_SIZE)) {
+    }
+
+    // Every socket binds the same port, SO_REUSEPORT is set by net_udp
+    for (i = 0; i < video_shards; i++) {
+        if (!init_video_shard(receiver, &receiver->video_shards[i], ttl, rtcp_bw)) {
+            error_msg("init_receiver: cannot open video shard %d\n", i);
+            destroy_video_shards(receiver);
+            free(receiver);
             return NULL;
         }
     }
@@ -249,27 +378,56 @@ receiver_t *init_receiver(stream_list_t *video_stream_list, stream_list_t *audio
     return receiver;
 }
 
+void set_receiver_playout_delay(receiver_t *receiver, double min_delay, double max_delay)
+{
+    int i;
+
+    for (i = 0; i < receiver->video_shard_count; i++) {
+        pdb_set_playout_delay(receiver->video_shards[i].part_db, min_delay, max_delay);
+    }
+}
+
 int start_receiver(receiver_t *receiver)
 {
-    receiver->video_run = TRUE;
-    receiver->audio_run = TRUE;
+    int i;
 
-    if (pthread_create(&receiver->video_th_id, NULL, (void *)video_receiver_thread, receiver) != 0)
-        receiver->video_run = FALSE;
+    // Sessions go to the least loaded thread, so each shard gets its own
+    receiver->reactor = rtp_reactor_init(receiver->video_shard_count + 1);
+    if (receiver->reactor == NULL) {
+        return FALSE;
+    }
 
-    if (pthread_create(&receiver->audio_th_id, NULL, (void *)audio_receiver_thread, receiver) != 0)
-        receiver->audio_run = FALSE;
+    receiver->video_run = TRUE;
+    for (i = 0; i < receiver->video_shard_count; i++) {
+        if (!rtp_reactor_add(receiver->reactor, receiver->video_shards[i].session,
+                    video_receiver_batch, &receiver->video_shards[i])) {
+            receiver->video_run = FALSE;
+        }
+    }
+    receiver->audio_run = rtp_reactor_add(receiver->reactor, receiver->audio_session,
+            audio_receiver_batch, receiver);
 
     return receiver->video_run && receiver->audio_run;
 }
 
 void stop_receiver(receiver_t *receiver)
 {
+    int i;
+
+    if (receiver->reactor == NULL) {
+        return;
+    }
+
+    for (i = 0; i < receiver->video_shard_count; i++) {
+        rtp_reactor_remove(receiver->reactor, receiver->video_shards[i].session);
+    }
     receiver->video_run = FALSE;
-    pthread_join(receiver->video_th_id, NULL); 
 
+    rtp_reactor_remove(receiver->reactor, receiver->audio_session);
     receiver->audio_run = FALSE;
-    pthread_join(receiver->audio_th_id, NULL);
+
+    rtp_reactor_done(receiver->reactor);
+    receiver->reactor = NULL;
 }
 
 int destroy_receiver(receiver_t *receiver)
@@ -278,9 +436,8 @@ int destroy_receiver(receiver_t *receiver)
         return FALSE;
     }
 
-    rtp_done(receiver->video_session);
+    destroy_video_shards(receiver);
     rtp_done(receiver->audio_session);
-    pdb_destroy(&receiver->video_part_db);
     pdb_destroy(&receiver->audio_part_db);
     free(receiver);
 
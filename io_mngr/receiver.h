@@ -33,23 +33,49 @@
 
 #include "stream.h"
 #include "participants.h"
+#include "rtp/audio_decoders.h"
+
+// Upper bound of the video sockets sharing the video port
+#define RECEIVER_MAX_VIDEO_SHARDS 16
+
+// Default bounds of the video playout delay, in seconds
+#define RECEIVER_MIN_PLAYOUT_DELAY 0.010
+#define RECEIVER_MAX_PLAYOUT_DELAY 0.200
+// Seconds between two keyframe requests to a sender that has not answered
+#define RECEIVER_KEYFRAME_REQUEST_INTERVAL 0.200
+
+struct rtp_reactor;
+struct receiver;
+
+/*
+ * One of the video sockets bound to the video port. The kernel hashes
+ * every sender flow to a single socket (SO_REUSEPORT), so each shard sees
+ * its own set of SSRCs and keeps them in its own pdb.
+ */
+typedef struct receiver_shard {
+    struct receiver *receiver;
+    struct rtp *session;
+    struct pdb *part_db;
+} receiver_shard_t;
 
 typedef struct receiver {
+    struct rtp_reactor *reactor;
+
     // Video data
     stream_list_t *video_stream_list;
     int video_port;
-    pthread_t video_th_id;
     uint8_t video_run;
-    struct rtp *video_session;
-    struct pdb *video_part_db;
+    int video_shard_count;
+    receiver_shard_t *video_shards;
+    struct rtp_sr_table *video_sr_table;    // shared by the shards, NULL with one
 
     // Audio data
     stream_list_t *audio_stream_list;
     int audio_port;
-    pthread_t audio_th_id;
     uint8_t audio_run;
     struct rtp *audio_session;
     struct pdb *audio_part_db;
+    struct state_audio_decoder audio_decoder;
 } receiver_t;
 
 /**
@@ -58,19 +84,32 @@ typedef struct receiver {
  * @param audio_stream_list Initialized stream_list_t to use for audio.
  * @param video_port Port to bind RTP video session.
  * @param audio_port Port to bind RTP audio session.
+ * @param video_shards Number of video sockets bound to video_port with
+ * SO_REUSEPORT, each served by its own reactor thread. 1 disables sharding.
  * @return A pointer to the generated receiver_t object, NULL otherwise.
  */
-receiver_t *init_receiver(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, uint32_t video_port, uint32_t audio_port);
+receiver_t *init_receiver(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, uint32_t video_port, uint32_t audio_port, int video_shards);
+
+/**
+ * Sets the bounds of the video playout delay. Every participant gets the
+ * lowest delay its interarrival jitter allows within them, reported in
+ * video_data_t playout_delay. Must be called before start_receiver.
+ * @param receiver The receiver_t target.
+ * @param min_delay Lower bound, in seconds.
+ * @param max_delay Upper bound, in seconds. Equal bounds fix the delay.
+ */
+void set_receiver_playout_delay(receiver_t *receiver, double min_delay, double max_delay);
 
 /**
- * Starts both audio and video receiver threads.
+ * Starts serving both audio and video sessions from the receiver reactor,
+ * with one thread per video shard and one for audio.
  * @param transmitter The receiver_t target.
- * @return Returns TRUE if both threads are running, FALSE otherwise.
+ * @return Returns TRUE if both sessions are served, FALSE otherwise.
  */
 int start_receiver(receiver_t *receiver);
 
 /**
- * Stops both audio and video receiver threads.
+ * Stops serving both audio and video sessions and the reactor threads.
  * @param receiver The receiver_t target.
  */
 void stop_receiver(receiver_t *receiver);
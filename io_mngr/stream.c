@@ -24,11 +24,281 @@
  */
 
 #include "stream.h"
+#include "transmitter.h"
+#include "rtp/rtp.h"
+#include "utils/pacer.h"
 #include "debug.h"
 
 #define DEFAULT_FPS 24
 #define PIXEL_FORMAT RGB
 
+static void stream_ready_cb(void *arg);
+static void unlink_ready_stream(stream_data_t *stream);
+static void set_stream_ready_cb(stream_data_t *stream, void (*ready_cb)(void *));
+static void kick_idle_shard(stream_list_t *list, int busy);
+static uint32_t ssrc_bucket(uint32_t ssrc);
+static void index_participant(stream_list_t *list, participant_data_t *participant);
+static void unindex_participant(stream_list_t *list, participant_data_t *participant);
+static void unindex_stream(stream_data_t *stream);
+
+// Another consumer is idle: wake it up so it steals from a busy shard
+static void kick_idle_shard(stream_list_t *list, int busy)
+{
+    int count = __atomic_load_n(&list->shard_count, __ATOMIC_RELAXED);
+    ready_shard_t *shard;
+
+    for (int i = 0; i < count; i++) {
+        shard = &list->shards[i];
+        if (i == busy || !__atomic_load_n(&shard->waiting, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        shard->kicked = TRUE;
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+}
+
+// Runs in the producer thread after each coded frame or audio bag
+static void stream_ready_cb(void *arg)
+{
+    stream_data_t *stream = (stream_data_t *) arg;
+    stream_list_t *list = stream->ready_list;
+    ready_shard_t *shard;
+    uint32_t state = __atomic_load_n(&stream->ready, __ATOMIC_ACQUIRE);
+    int home_waiting;
+
+    do {
+        if (state == READY_QUEUED || state == READY_PENDING) {
+            return;
+        }
+        // A consumer serving the stream will look at it again when done
+    } while (!__atomic_compare_exchange_n(&stream->ready, &state,
+                state == READY_IDLE ? READY_QUEUED : READY_PENDING,
+                FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (state != READY_IDLE) {
+        return;
+    }
+
+    stream->ready_shard = stream->id % __atomic_load_n(&list->shard_count, __ATOMIC_RELAXED);
+    shard = &list->shards[stream->ready_shard];
+
+    pthread_mutex_lock(&shard->lock);
+    stream->ready_next = NULL;
+    if (shard->last == NULL) {
+        __atomic_store_n(&shard->first, stream, __ATOMIC_RELEASE);
+    } else {
+        shard->last->ready_next = stream;
+    }
+    shard->last = stream;
+    home_waiting = shard->waiting;
+    if (home_waiting) {
+        pthread_cond_signal(&shard->cond);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!home_waiting) {
+        kick_idle_shard(list, stream->ready_shard);
+    }
+}
+
+static void unlink_ready_stream(stream_data_t *stream)
+{
+    ready_shard_t *shard = &stream->ready_list->shards[stream->ready_shard];
+    stream_data_t *prev = NULL;
+    stream_data_t *current;
+
+    if (__atomic_load_n(&stream->ready, __ATOMIC_ACQUIRE) != READY_QUEUED) {
+        return;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    for (current = shard->first; current != NULL; prev = current, current = current->ready_next) {
+        if (current == stream) {
+            if (prev == NULL) {
+                __atomic_store_n(&shard->first, stream->ready_next, __ATOMIC_RELEASE);
+            } else {
+                prev->ready_next = stream->ready_next;
+            }
+            if (shard->last == stream) {
+                shard->last = prev;
+            }
+            break;
+        }
+    }
+    stream->ready = READY_IDLE;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void set_stream_ready_cb(stream_data_t *stream, void (*ready_cb)(void *))
+{
+    if (stream->io_type != OUTPUT) {
+        return;
+    }
+
+    if (stream->type == VIDEO) {
+        set_video_frame_cq_ready_cb(stream->video->coded_frames, ready_cb, stream);
+    } else if (stream->type == AUDIO) {
+        cq_set_ready_cb(stream->audio->coded_cq, ready_cb, stream);
+    }
+}
+
+int set_stream_list_shards(stream_list_t *list, int count)
+{
+    if (count < 1 || count > MAX_READY_SHARDS) {
+        error_msg("set_stream_list_shards: %d out of [1, %d]", count, MAX_READY_SHARDS);
+        return FALSE;
+    }
+    // Streams already queued in a higher shard are still found by stealing
+    __atomic_store_n(&list->shard_count, count, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+int wait_ready_streams(stream_list_t *list, int shard_id, uint32_t timeout_us)
+{
+    ready_shard_t *shard = &list->shards[shard_id];
+    struct timespec deadline;
+    int ready;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->first == NULL && !shard->kicked && timeout_us != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_us / 1000000;
+        deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        __atomic_store_n(&shard->waiting, TRUE, __ATOMIC_RELAXED);
+        while (shard->first == NULL && !shard->kicked) {
+            if (pthread_cond_timedwait(&shard->cond, &shard->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        __atomic_store_n(&shard->waiting, FALSE, __ATOMIC_RELAXED);
+    }
+    ready = shard->first != NULL || shard->kicked;
+    shard->kicked = FALSE;
+    pthread_mutex_unlock(&shard->lock);
+
+    return ready;
+}
+
+stream_data_t *pop_ready_stream(stream_list_t *list, int shard_id)
+{
+    ready_shard_t *shard;
+    stream_data_t *stream;
+
+    // Our own shard first, then steal from the others
+    for (int i = 0; i < MAX_READY_SHARDS; i++) {
+        shard = &list->shards[(shard_id + i) % MAX_READY_SHARDS];
+        if (__atomic_load_n(&shard->first, __ATOMIC_ACQUIRE) == NULL) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        stream = shard->first;
+        if (stream != NULL) {
+            __atomic_store_n(&shard->first, stream->ready_next, __ATOMIC_RELEASE);
+            if (stream->ready_next == NULL) {
+                shard->last = NULL;
+            }
+            __atomic_store_n(&stream->ready, READY_SERVING, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        if (stream != NULL) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+int finish_ready_stream(stream_data_t *stream)
+{
+    uint32_t state = READY_SERVING;
+
+    if (__atomic_compare_exchange_n(&stream->ready, &state, READY_IDLE,
+                FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return FALSE;
+    }
+
+    // READY_PENDING: data arrived while serving, keep the stream ourselves
+    __atomic_store_n(&stream->ready, READY_SERVING, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// SSRCs are random, but not every sender picks them well
+static uint32_t ssrc_bucket(uint32_t ssrc)
+{
+    return (ssrc * 2654435761u) >> (32 - SSRC_INDEX_BITS);
+}
+
+// Caller holds the index lock for writing
+static void index_participant(stream_list_t *list, participant_data_t *participant)
+{
+    participant_data_t **bucket;
+
+    participant->index_next = NULL;
+    if (participant->ssrc != 0) {
+        bucket = &list->ssrc_index[ssrc_bucket(participant->ssrc)];
+        participant->index_next = *bucket;
+        *bucket = participant;
+    } else if (participant->type == INPUT) {
+        if (list->unbound_last == NULL) {
+            list->unbound_first = participant;
+        } else {
+            list->unbound_last->index_next = participant;
+        }
+        list->unbound_last = participant;
+    }
+}
+
+// Caller holds the index lock for writing
+static void unindex_participant(stream_list_t *list, participant_data_t *participant)
+{
+    participant_data_t **prev;
+    participant_data_t *last = NULL;
+
+    if (participant->ssrc != 0) {
+        prev = &list->ssrc_index[ssrc_bucket(participant->ssrc)];
+        for (; *prev != NULL; prev = &(*prev)->index_next) {
+            if (*prev == participant) {
+                *prev = participant->index_next;
+                return;
+            }
+        }
+    }
+
+    for (prev = &list->unbound_first; *prev != NULL; prev = &(*prev)->index_next) {
+        if (*prev == participant) {
+            *prev = participant->index_next;
+            if (list->unbound_last == participant) {
+                list->unbound_last = last;
+            }
+            return;
+        }
+        last = *prev;
+    }
+}
+
+static void unindex_stream(stream_data_t *stream)
+{
+    stream_list_t *list = stream->ready_list;
+    participant_data_t *participant;
+
+    pthread_rwlock_wrlock(&list->index_lock);
+    pthread_rwlock_rdlock(&stream->plist->lock);
+    for (participant = stream->plist->first; participant != NULL; participant = participant->next) {
+        unindex_participant(list, participant);
+    }
+    pthread_rwlock_unlock(&stream->plist->lock);
+    pthread_rwlock_unlock(&list->index_lock);
+}
+
 stream_list_t *init_stream_list(void)
 {
     stream_list_t *list = malloc(sizeof(stream_list_t));
@@ -36,10 +306,31 @@ stream_list_t *init_stream_list(void)
         error_msg("init_stream_list malloc error");
         return NULL;
     }
+    pthread_condattr_t attr;
+
     pthread_rwlock_init(&list->lock, NULL);
     list->count = 0;
     list->first = NULL;
     list->last = NULL;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (int i = 0; i < MAX_READY_SHARDS; i++) {
+        pthread_mutex_init(&list->shards[i].lock, NULL);
+        pthread_cond_init(&list->shards[i].cond, &attr);
+        list->shards[i].first = NULL;
+        list->shards[i].last = NULL;
+        list->shards[i].waiting = FALSE;
+        list->shards[i].kicked = FALSE;
+    }
+    pthread_condattr_destroy(&attr);
+    list->shard_count = 1;
+
+    pthread_rwlock_init(&list->index_lock, NULL);
+    memset(list->ssrc_index, 0, sizeof(list->ssrc_index));
+    list->unbound_first = NULL;
+    list->unbound_last = NULL;
+
     return list;
 }
 
@@ -54,10 +345,20 @@ void destroy_stream_list(stream_list_t *list)
     }
     pthread_rwlock_unlock(&list->lock);
     pthread_rwlock_destroy(&list->lock);
+    pthread_rwlock_destroy(&list->index_lock);
+    for (int i = 0; i < MAX_READY_SHARDS; i++) {
+        pthread_cond_destroy(&list->shards[i].cond);
+        pthread_mutex_destroy(&list->shards[i].lock);
+    }
     free(list);
 }
 
 stream_data_t *init_stream(stream_type_t type, io_type_t io_type, uint32_t id, stream_state_t state, float fps, char *stream_name)
+{
+    return init_stream_queues(type, io_type, id, state, fps, stream_name, NULL);
+}
+
+stream_data_t *init_stream_queues(stream_type_t type, io_type_t io_type, uint32_t id, stream_state_t state, float fps, char *stream_name, const video_queue_conf_t *queues)
 {
     stream_data_t *stream = malloc(sizeof(stream_data_t));
     if (stream == NULL) {
@@ -77,12 +378,23 @@ stream_data_t *init_stream(stream_type_t type, io_type_t io_type, uint32_t id, s
     stream->state = state;
     stream->prev = NULL;
     stream->next = NULL;
+    stream->ready_list = NULL;
+    stream->ready_next = NULL;
+    stream->ready_shard = 0;
+    stream->ready = READY_IDLE;
+    stream->pacer = NULL;
 
     if (type == VIDEO) {
         if (io_type == INPUT){
-            stream->video = init_video_data(DECODER, fps);
+            stream->video = init_video_data(DECODER, fps, queues);
         } else if (io_type == OUTPUT){
-            stream->video = init_video_data(ENCODER, fps);
+            stream->video = init_video_data(ENCODER, fps, queues);
+        }
+        if (stream->video == NULL){
+            error_msg("init_stream: init_video_data error");
+            free(stream->stream_name);
+            free(stream);
+            return NULL;
         }
     }
     else if (type == AUDIO) {
@@ -104,13 +416,20 @@ stream_data_t *init_stream(stream_type_t type, io_type_t io_type, uint32_t id, s
 
 void destroy_stream(stream_data_t *stream)
 {
+    // Producer threads are joined first, so nobody can queue us again
     if (stream->type == VIDEO){
         destroy_video_data(stream->video);
     } else if (stream->type == AUDIO){
         ap_destroy(stream->audio);
     }
 
+    if (stream->ready_list != NULL){
+        unlink_ready_stream(stream);
+        unindex_stream(stream);
+    }
+
     destroy_participant_list(stream->plist);
+    pacer_done(stream->pacer);
 
     free(stream->stream_name);
     free(stream);
@@ -135,10 +454,22 @@ int add_stream(stream_list_t *list, stream_data_t *stream)
         list->count++;
     } else {
         error_msg("add_stream list->count < 0");
-        pthread_rwlock_unlock(&list->lock);
         ret = FALSE;
     }
 
+    if (ret) {
+        stream->ready_list = list;
+        set_stream_ready_cb(stream, stream_ready_cb);
+
+        pthread_rwlock_wrlock(&list->index_lock);
+        pthread_rwlock_rdlock(&stream->plist->lock);
+        for (participant_data_t *p = stream->plist->first; p != NULL; p = p->next) {
+            index_participant(list, p);
+        }
+        pthread_rwlock_unlock(&stream->plist->lock);
+        pthread_rwlock_unlock(&list->index_lock);
+    }
+
     pthread_rwlock_unlock(&list->lock);
     return ret;
 }
@@ -209,12 +540,68 @@ void set_stream_state(stream_data_t *stream, stream_state_t state)
 
 void add_participant_stream(stream_data_t *stream, participant_data_t *participant)
 {
-    add_participant(stream->plist, participant);
+    stream_list_t *list = stream->ready_list;
+
     participant->stream = stream;
+    if (stream->pacer != NULL && participant->rtp != NULL) {
+        rtp_set_shared_pacer(participant->rtp->rtp, stream->pacer);
+    }
+    add_participant(stream->plist, participant);
+
+    if (list != NULL) {
+        pthread_rwlock_wrlock(&list->index_lock);
+        index_participant(list, participant);
+        pthread_rwlock_unlock(&list->index_lock);
+    }
+}
+
+int set_stream_pacing(stream_data_t *stream, uint64_t rate, uint32_t burst)
+{
+    if (burst == 0) {
+        burst = PACING_DEFAULT_BURST;
+    }
+
+    if (stream->pacer != NULL) {
+        pacer_set_rate(stream->pacer, rate, burst);
+        return TRUE;
+    }
+    if (rate == 0) {
+        return TRUE;
+    }
+
+    // Kept until destroy_stream, the participants may be sending
+    stream->pacer = pacer_init(rate, burst);
+    if (stream->pacer == NULL) {
+        return FALSE;
+    }
+
+    pthread_rwlock_rdlock(&stream->plist->lock);
+    for (participant_data_t *p = stream->plist->first; p != NULL; p = p->next) {
+        if (p->rtp != NULL) {
+            rtp_set_shared_pacer(p->rtp->rtp, stream->pacer);
+        }
+    }
+    pthread_rwlock_unlock(&stream->plist->lock);
+
+    return TRUE;
 }
 
 int remove_participant_from_stream(stream_data_t *stream, uint32_t id)
 {
+    stream_list_t *list = stream->ready_list;
+    participant_data_t *participant;
+
+    if (list != NULL) {
+        pthread_rwlock_wrlock(&list->index_lock);
+        pthread_rwlock_rdlock(&stream->plist->lock);
+        participant = get_participant_id(stream->plist, id);
+        if (participant != NULL) {
+            unindex_participant(list, participant);
+        }
+        pthread_rwlock_unlock(&stream->plist->lock);
+        pthread_rwlock_unlock(&list->index_lock);
+    }
+
     return remove_participant(stream->plist, id);
 }
 
@@ -236,34 +623,54 @@ participant_data_t *get_participant_stream_id(stream_list_t *list, uint32_t id)
 }
 
 participant_data_t *get_participant_stream_ssrc(stream_list_t *list, uint32_t ssrc){
-    stream_data_t *stream;
-    participant_data_t *part = NULL;
+    participant_data_t *part;
 
-    pthread_rwlock_rdlock(&list->lock);
+    pthread_rwlock_rdlock(&list->index_lock);
 
-    stream = list->first;
-    while(stream != NULL && part == NULL){
-        part = get_participant_ssrc(stream->plist, ssrc);
-        stream = stream->next;
+    part = list->ssrc_index[ssrc_bucket(ssrc)];
+    while(part != NULL && part->ssrc != ssrc){
+        part = part->index_next;
     }
 
-    pthread_rwlock_unlock(&list->lock);
+    pthread_rwlock_unlock(&list->index_lock);
     return part;
 }
 
 participant_data_t *get_participant_stream_non_init(stream_list_t *list){
-    stream_data_t *stream;
-    participant_data_t *part = NULL;
+    participant_data_t *part;
 
-    pthread_rwlock_rdlock(&list->lock);
+    pthread_rwlock_rdlock(&list->index_lock);
+    part = list->unbound_first;
+    pthread_rwlock_unlock(&list->index_lock);
 
-    stream = list->first;
-    while(stream != NULL && part == NULL){
-        part = get_participant_non_init(stream->plist);
-        stream = stream->next;
+    return part;
+}
+
+participant_data_t *claim_participant_stream_ssrc(stream_list_t *list, uint32_t ssrc)
+{
+    participant_data_t *part;
+
+    if ((part = get_participant_stream_ssrc(list, ssrc)) != NULL) {
+        return part;
     }
 
-    pthread_rwlock_unlock(&list->lock);
+    // Writers exclude each other, so two receivers never claim the same participant
+    pthread_rwlock_wrlock(&list->index_lock);
+
+    part = list->ssrc_index[ssrc_bucket(ssrc)];
+    while(part != NULL && part->ssrc != ssrc){
+        part = part->index_next;
+    }
+
+    if (part == NULL && (part = list->unbound_first) != NULL){
+        list->unbound_first = part->index_next;
+        if (list->unbound_first == NULL){
+            list->unbound_last = NULL;
+        }
+        set_participant_ssrc(part, ssrc);
+        index_participant(list, part);
+    }
+
+    pthread_rwlock_unlock(&list->index_lock);
     return part;
 }
-
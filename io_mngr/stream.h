@@ -44,6 +44,17 @@ typedef enum stream_state{
     NON_ACTIVE
 } stream_state_t;
 
+#define MAX_READY_SHARDS 16
+#define SSRC_INDEX_BITS 8
+#define SSRC_INDEX_SIZE (1 << SSRC_INDEX_BITS)
+
+typedef enum ready_state {
+    READY_IDLE,         // no data announced
+    READY_QUEUED,       // waiting in a ready shard
+    READY_SERVING,      // popped by a consumer
+    READY_PENDING       // popped, and new data arrived meanwhile
+} ready_state_t;
+
 typedef struct audio_data {
     // TODO
 } audio_data_t;
@@ -57,17 +68,49 @@ typedef struct stream_data {
     participant_list_t *plist;
     struct stream_data *prev;
     struct stream_data *next;
+    struct stream_list *ready_list;     // list the stream was added to
+    struct stream_data *ready_next;
+    int ready_shard;
+    uint32_t ready;                     // ready_state_t
+    struct pacer *pacer;                // shared by the participants, see set_stream_pacing
     union {
         audio_processor_t *audio;
         video_data_t *video;
     };
 } stream_data_t;
 
+typedef struct ready_shard {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stream_data_t *first;
+    stream_data_t *last;
+    uint8_t waiting;    // its consumer sleeps in wait_ready_streams
+    uint8_t kicked;     // woken up to steal from another shard
+} ready_shard_t;
+
+/**
+ * Besides the streams, the list keeps FIFOs of the OUTPUT streams that got
+ * a coded frame since their consumer last looked at them, so a consumer
+ * serving the whole list only visits the streams with work to do. Streams
+ * are spread by id over shard_count FIFOs, one per consumer thread; an idle
+ * consumer steals from the others. A stream is served by one consumer at a
+ * time, which keeps its frames in order.
+ *
+ * The participants of its streams are also indexed by SSRC, and the INPUT
+ * ones still without SSRC wait in the unbound FIFO, so receivers find the
+ * participant of a packet without walking every stream.
+ */
 typedef struct stream_list {
     pthread_rwlock_t lock;
     int count;
     stream_data_t *first;
     stream_data_t *last;
+    int shard_count;
+    ready_shard_t shards[MAX_READY_SHARDS];
+    pthread_rwlock_t index_lock;
+    participant_data_t *ssrc_index[SSRC_INDEX_SIZE];
+    participant_data_t *unbound_first;
+    participant_data_t *unbound_last;
 } stream_list_t;
 
 /**
@@ -88,6 +131,14 @@ void destroy_stream_list(stream_list_t *list);
  */
 stream_data_t *init_stream(stream_type_t type, io_type_t io_type, uint32_t id, stream_state_t state, float fps, char *stream_name);
 
+/**
+ * Initializes a stream whose video frame queues are sized and managed as
+ * queues tells, see video_queue_conf_t. init_stream is the same with NULL.
+ * @param queues Ignored for AUDIO streams, NULL for the defaults.
+ * @return stream_data_t * if succeeded, NULL otherwise.
+ */
+stream_data_t *init_stream_queues(stream_type_t type, io_type_t io_type, uint32_t id, stream_state_t state, float fps, char *stream_name, const video_queue_conf_t *queues);
+
 /**
  * Destroys a stream.
  * @param stream Target stream_data_t.
@@ -110,6 +161,54 @@ int add_stream(stream_list_t *list, stream_data_t *stream);
  */
 int remove_stream(stream_list_t *list, uint32_t id);
 
+/**
+ * Sets the number of consumer threads serving the ready streams of a list.
+ * @param list Target stream_list_t.
+ * @param count Number of shards, in [1, MAX_READY_SHARDS].
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int set_stream_list_shards(stream_list_t *list, int count);
+
+/**
+ * Sleeps until some OUTPUT stream of a shard has coded data to send, or
+ * another shard has work to steal.
+ * @param list Target stream_list_t.
+ * @param shard_id Shard of the calling consumer.
+ * @param timeout_us Maximum time to wait, in microseconds.
+ * @return TRUE if pop_ready_stream is worth calling, FALSE on timeout.
+ */
+int wait_ready_streams(stream_list_t *list, int shard_id, uint32_t timeout_us);
+
+/**
+ * Takes the oldest ready stream out of our shard, or out of another one if
+ * ours is empty. The caller must hold the list lock, which keeps the
+ * stream from being removed meanwhile, drain the stream queue and then
+ * call finish_ready_stream.
+ * @param list Target stream_list_t.
+ * @param shard_id Shard of the calling consumer.
+ * @return stream_data_t * ready to be served, NULL if there is none.
+ */
+stream_data_t *pop_ready_stream(stream_list_t *list, int shard_id);
+
+/**
+ * Gives back a stream obtained with pop_ready_stream.
+ * @param stream Target stream_data_t.
+ * @return TRUE if data arrived while serving it and it must be drained
+ * again by the same consumer, FALSE otherwise.
+ */
+int finish_ready_stream(stream_data_t *stream);
+
+/**
+ * Paces the packets sent to all the participants of a stream together,
+ * on top of the pacing of every participant (see set_participant_pacing).
+ * May be called while the stream is being sent.
+ * @param stream Target stream_data_t.
+ * @param rate Bits per second, 0 for no limit.
+ * @param burst Bytes that may be sent at once, 0 for PACING_DEFAULT_BURST.
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int set_stream_pacing(stream_data_t *stream, uint64_t rate, uint32_t burst);
+
 // TODO set_stream_audio_data
 
 /**
@@ -160,11 +259,22 @@ participant_data_t *get_participant_stream_id(stream_list_t *list, uint32_t id);
 participant_data_t *get_participant_stream_ssrc(stream_list_t *list, uint32_t ssrc);
 
 /**
- * Get the first uninitialized participant from a stream list.
+ * Get the oldest uninitialized INPUT participant from a stream list.
  * @param list Target stream_list_t.
  * @return participant_data_t * to the participant, NULL otherwise.
  */
 participant_data_t *get_participant_stream_non_init(stream_list_t *list);
 
+/**
+ * Get the participant with an ssrc from a stream list, assigning the ssrc to
+ * the first uninitialized participant if none has it yet. Safe to call from
+ * several receiver threads for the same ssrc. This is the only way to set
+ * the ssrc of a participant already added to a listed stream.
+ * @param list Target stream_list_t.
+ * @param ssrc Target participant ssrc.
+ * @return participant_data_t * to the participant with ssrc, NULL if there is none and all are initialized.
+ */
+participant_data_t *claim_participant_stream_ssrc(stream_list_t *list, uint32_t ssrc);
+
 #endif //__STREAM_H__
 
@@ -34,30 +34,57 @@
 #include "tv.h"
 #include <stdlib.h>
 
-static int send_video_frame(stream_data_t *stream, video_data_frame_t *coded_frame, struct timeval start_time);
+static int send_video_frame(stream_data_t *stream, coded_buffer_t *coded, struct tx_h264_packets *pkts, struct timeval start_time);
 static int send_audio_frame(stream_data_t *stream, audio_frame2 *frame, struct timeval start_time);
+static void drain_video_stream(stream_data_t *stream, struct tx_h264_packets *pkts, struct timeval start_time);
 static void *video_transmitter_thread(void *arg);
 static void *audio_transmitter_thread(void *arg);
 
-// TODO: coded_frame parameter and timestamp revision.
-static int send_video_frame(stream_data_t *stream, video_data_frame_t *coded_frame, struct timeval start_time)
+// TODO: timestamp revision.
+static int send_video_frame(stream_data_t *stream, coded_buffer_t *coded, struct tx_h264_packets *pkts, struct timeval start_time)
 {
     participant_data_t *participant;
     struct timeval curr_time;
     double timestamp;
+    unsigned mtu;
+    uint32_t keyframe_requests;
+    uint64_t rate, target_rate = 0;
     int ret = FALSE;
 
+    pkts->count = 0;
+
     pthread_rwlock_rdlock(&stream->plist->lock);
 
     participant = stream->plist->first;
     while (participant != NULL && participant->rtp != NULL) {
         
         gettimeofday(&curr_time, NULL);
+        // Answers the NACKs received since the last frame
+        rtp_recv_nonblock(participant->rtp->rtp, get_local_mediatime(), 1);
+        // ...and turns its PLIs and FIRs into a keyframe of the stream
+        keyframe_requests = rtp_get_keyframe_requests(participant->rtp->rtp);
+        if (keyframe_requests != participant->rtp->keyframe_requests) {
+            participant->rtp->keyframe_requests = keyframe_requests;
+            request_keyframe(stream->video);
+        }
+        // ...and its reports into the rate the slowest receiver can take
+        rate = rtp_get_target_rate(participant->rtp->rtp);
+        if (rate > 0 && (target_rate == 0 || rate < target_rate)) {
+            target_rate = rate;
+        }
         rtp_update(participant->rtp->rtp, curr_time);
         timestamp = tv_diff(curr_time, start_time)*90000;
         rtp_send_ctrl(participant->rtp->rtp, timestamp, 0, curr_time);            
 
-        tx_send_h264(participant->rtp->tx_session, stream->video->encoder->frame, 
+        // Packetize once, every participant with the same MTU reuses it
+        mtu = tx_get_mtu(participant->rtp->tx_session);
+        if (pkts->count == 0 || pkts->mtu != mtu) {
+            if (!tx_packetize_h264(pkts, coded->data, coded->len, mtu, TRUE)) {
+                break;
+            }
+        }
+
+        tx_send_packetized_h264(participant->rtp->tx_session, pkts,
                      participant->rtp->rtp, get_local_mediatime());
         ret = TRUE;
 
@@ -66,6 +93,10 @@ static int send_video_frame(stream_data_t *stream, video_data_frame_t *coded_fra
 
     pthread_rwlock_unlock(&stream->plist->lock);
 
+    if (target_rate > 0) {
+        set_target_bitrate(stream->video, target_rate);
+    }
+
     return ret;
 }
 
@@ -98,35 +129,64 @@ static int send_audio_frame(stream_data_t *stream, audio_frame2 *frame, struct t
     return ret;
 }
 
+// Sends every coded frame queued in the stream
+static void drain_video_stream(stream_data_t *stream, struct tx_h264_packets *pkts, struct timeval start_time)
+{
+    video_data_frame_t *coded_frame;
+    coded_buffer_t *coded;
+
+    while ((coded_frame = curr_out_frame(stream->video->coded_frames)) != NULL) {
+        if (coded_frame->coded == NULL){
+            // Not filled by the encoder, nothing we can send
+            remove_frame(stream->video->coded_frames);
+            continue;
+        }
+
+        // Keep the data while sending and give the slot back to the encoder
+        coded = coded_buffer_ref(coded_frame->coded);
+        remove_frame(stream->video->coded_frames);
+
+        send_video_frame(stream, coded, pkts, start_time);
+
+        coded_buffer_unref(coded);
+    }
+}
+
 static void *video_transmitter_thread(void *arg)
 {
-    transmitter_t *transmitter = (transmitter_t *)arg;
+    video_worker_t *worker = (video_worker_t *)arg;
+    transmitter_t *transmitter = worker->transmitter;
     stream_data_t *stream;
-    video_data_frame_t *coded_frame;
+    struct tx_h264_packets *pkts;
 
     struct timeval start_time;
     gettimeofday(&start_time, NULL);
 
+    pkts = tx_h264_packets_init();
+    if (pkts == NULL) {
+        error_msg("video_transmitter_thread: malloc error");
+        pthread_exit(NULL);
+    }
+
     while(transmitter->video_run){
-        usleep(500);
+        // The timeout only bounds how long stop_transmitter waits for us
+        if (!wait_ready_streams(transmitter->video_stream_list, worker->shard, transmitter->wait_time)) {
+            continue;
+        }
 
         pthread_rwlock_rdlock(&transmitter->video_stream_list->lock);
 
-        stream = transmitter->video_stream_list->first;
-        while(stream != NULL && transmitter->video_run){
-            coded_frame = curr_out_frame(stream->video->coded_frames);
-            if (coded_frame == NULL){
-                stream = stream->next;
-                continue;
-            }
-            send_video_frame(stream, coded_frame, start_time);
-            remove_frame(stream->video->coded_frames);
-            stream = stream->next;
+        while(transmitter->video_run
+                && (stream = pop_ready_stream(transmitter->video_stream_list, worker->shard)) != NULL){
+            do {
+                drain_video_stream(stream, pkts, start_time);
+            } while (finish_ready_stream(stream));
         }
 
         pthread_rwlock_unlock(&transmitter->video_stream_list->lock);
     }
 
+    tx_h264_packets_done(pkts);
     pthread_exit(NULL);
 }
 
@@ -140,16 +200,20 @@ static void *audio_transmitter_thread(void *arg)
     gettimeofday(&start_time, NULL);
 
     while(transmitter->audio_run) {
-        usleep(500);
+        if (!wait_ready_streams(transmitter->audio_stream_list, 0, transmitter->wait_time)) {
+            continue;
+        }
+
         pthread_rwlock_rdlock(&transmitter->audio_stream_list->lock);
 
-        stream = transmitter->audio_stream_list->first;
-        while(stream != NULL && transmitter->audio_run) {
-            if ((frame = cq_get_front(stream->audio->coded_cq)) != NULL) {
-                send_audio_frame(stream, frame, start_time);
-                cq_remove_bag(stream->audio->coded_cq);
-            }            
-            stream = stream->next;
+        while(transmitter->audio_run
+                && (stream = pop_ready_stream(transmitter->audio_stream_list, 0)) != NULL) {
+            do {
+                while ((frame = cq_get_front(stream->audio->coded_cq)) != NULL) {
+                    send_audio_frame(stream, frame, start_time);
+                    cq_remove_bag(stream->audio->coded_cq);
+                }
+            } while (finish_ready_stream(stream));
         }
 
         pthread_rwlock_unlock(&transmitter->audio_stream_list->lock);
@@ -159,7 +223,7 @@ static void *audio_transmitter_thread(void *arg)
 }
 
 // TODO: Put fps param away!
-transmitter_t *init_transmitter(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, float fps)
+transmitter_t *init_transmitter(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, float fps, int video_threads)
 {
     transmitter_t *transmitter = malloc(sizeof(transmitter_t));
     if (transmitter == NULL) {
@@ -167,6 +231,23 @@ transmitter_t *init_transmitter(stream_list_t *video_stream_list, stream_list_t
         return NULL;
     }
 
+    if (video_threads <= 0) {
+        video_threads = DEFAULT_VIDEO_THREADS;
+    } else if (video_threads > MAX_READY_SHARDS) {
+        error_msg("init_transmitter: using %d video threads", MAX_READY_SHARDS);
+        video_threads = MAX_READY_SHARDS;
+    }
+
+    transmitter->video_workers = malloc(sizeof(video_worker_t) * video_threads);
+    if (transmitter->video_workers == NULL) {
+        error_msg("init_transmitter: malloc error");
+        free(transmitter);
+        return NULL;
+    }
+    transmitter->video_thread_count = video_threads;
+    transmitter->video_threads_started = 0;
+    transmitter->audio_thread_started = FALSE;
+
     transmitter->video_run = FALSE;
     transmitter->audio_run = FALSE;
 
@@ -192,14 +273,34 @@ transmitter_t *init_transmitter(stream_list_t *video_stream_list, stream_list_t
 
 int start_transmitter(transmitter_t *transmitter)
 {  
+    int started;
+
+    set_stream_list_shards(transmitter->video_stream_list, transmitter->video_thread_count);
+
     transmitter->video_run = TRUE;
-    if (pthread_create(&transmitter->video_thread, NULL, video_transmitter_thread, transmitter) != 0) {
+    for (started = 0; started < transmitter->video_thread_count; started++) {
+        transmitter->video_workers[started].transmitter = transmitter;
+        transmitter->video_workers[started].shard = started;
+        if (pthread_create(&transmitter->video_workers[started].thread, NULL, 
+                    video_transmitter_thread, &transmitter->video_workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started < transmitter->video_thread_count) {
+        error_msg("start_transmitter: pthread_create error");
         transmitter->video_run = FALSE;
+        while (started > 0) {
+            pthread_join(transmitter->video_workers[--started].thread, NULL);
+        }
     }
+    transmitter->video_threads_started = started;
 
     transmitter->audio_run = TRUE;
     if (pthread_create(&transmitter->audio_thread, NULL, audio_transmitter_thread, transmitter) != 0) {
+        error_msg("start_transmitter: pthread_create error");
         transmitter->audio_run = FALSE;
+    } else {
+        transmitter->audio_thread_started = TRUE;
     }
 
     return transmitter->video_run && transmitter->audio_run;
@@ -207,10 +308,16 @@ int start_transmitter(transmitter_t *transmitter)
 
 void stop_transmitter(transmitter_t *transmitter)
 {
+    // Only the threads start_transmitter managed to create, and only once
     transmitter->video_run = FALSE;
-    pthread_join(transmitter->video_thread, NULL); 
+    while (transmitter->video_threads_started > 0) {
+        pthread_join(transmitter->video_workers[--transmitter->video_threads_started].thread, NULL);
+    }
     transmitter->audio_run = FALSE;
-    pthread_join(transmitter->audio_thread, NULL); 
+    if (transmitter->audio_thread_started) {
+        pthread_join(transmitter->audio_thread, NULL);
+        transmitter->audio_thread_started = FALSE;
+    }
 }
 
 int destroy_transmitter(transmitter_t *transmitter)
@@ -219,6 +326,7 @@ int destroy_transmitter(transmitter_t *transmitter)
         return FALSE;
     }
 
+    free(transmitter->video_workers);
     free(transmitter);
     return TRUE;
 }
@@ -46,11 +46,28 @@
 #define DEFAULT_SEND_BUFFER_SIZE 1920 * 1080 * 4 * sizeof(char) * 10
 #define PIXEL_FORMAT RGB
 #define MTU 1300 // 1400
+#define RETRANSMISSION_HISTORY 1024 // packets kept to answer NACKs
+#define RETRANSMISSION_BUDGET 200 // packets per second and participant
+#define PACING_DEFAULT_BURST (16 * MTU) // bytes a paced stream or participant sends at once
+#define VIDEO_MIN_BITRATE 300000 // bits per second congestion control goes down to
+#define VIDEO_MAX_BITRATE 8000000 // ...and the encoder starts at
+
+#define DEFAULT_VIDEO_THREADS 1
+
+struct transmitter;
+
+typedef struct video_worker {
+    struct transmitter *transmitter;
+    int shard;
+    pthread_t thread;
+} video_worker_t;
 
 typedef struct transmitter {
     // Video data
     uint32_t video_run;
-    pthread_t video_thread;
+    int video_thread_count;
+    int video_threads_started;  // workers stop_transmitter has to join
+    video_worker_t *video_workers;
     stream_list_t *video_stream_list;
     float fps;
     float wait_time;
@@ -62,6 +79,7 @@ typedef struct transmitter {
     // Audio data
     uint32_t audio_run;
     pthread_t audio_thread;
+    uint8_t audio_thread_started;
     stream_list_t *audio_stream_list;
     //float fps;
     //float wait_time;
@@ -73,11 +91,15 @@ typedef struct transmitter {
 
 /**
  * Initializes a transmitter object with both audio and video.
+ * Video streams are spread over video_threads sending threads; each stream
+ * is sent by one thread at a time, so its frames keep their order.
  * @param video_stream_list Initialized stream_list_t to use for video.
  * @param audio_stream_list Initialized stream_list_t to use for audio.
+ * @param fps Default frame rate.
+ * @param video_threads Number of video sending threads, 0 for DEFAULT_VIDEO_THREADS.
  * @return A pointer to the generated transmitter_t object, NULL otherwise.
  */
-transmitter_t *init_transmitter(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, float fps);
+transmitter_t *init_transmitter(stream_list_t *video_stream_list, stream_list_t *audio_stream_list, float fps, int video_threads);
 
 /**
  * Starts both audio and video transmitter threads.
@@ -7,15 +7,183 @@
 #include "video_frame.h"
 #include "tv.h"
 #include "module.h"
+#include "messaging.h"
 #include "debug.h"
 
 #define PIXEL_FORMAT RGB
 #define DEFAULT_FPS 25
+#define DEFAULT_QUEUE_DEPTH 2
+#define KEYFRAME_MIN_INTERVAL 0.5 // seconds
+#define BITRATE_MIN_INTERVAL 1.0 // seconds
+#define BITRATE_MIN_CHANGE 0.1 // fraction of the current bitrate
+#define BITRATE_DROP_WEIGHT 0.5 // of a new target below the average, per frame
+#define BITRATE_RISE_WEIGHT 0.05 // ...and above it
 
 // private functions
 void *decoder_th(void* data);
 void *encoder_routine(void *arg);
 int reconf_video_frame(video_data_frame_t *frame, struct video_frame *enc_frame, uint32_t fps);
+static uint32_t frame_wait_time(video_data_t *video);
+static frame_type_t h264_frame_type(uint8_t *buffer, uint32_t buffer_len);
+static void force_requested_keyframe(encoder_thread_t *encoder);
+static void apply_target_bitrate(video_data_t *video);
+static void measure_own_bitrate(video_data_t *video, uint32_t coded_len);
+
+// Time to block on a queue before checking the run flag again: one frame period.
+static uint32_t frame_wait_time(video_data_t *video)
+{
+    if (video->fps == 0) {
+        return 1000000 / DEFAULT_FPS;
+    }
+    return 1000000 / video->fps;
+}
+
+// Same classification rtpdec does on reception: IDR -> INTRA, any
+// reference slice -> OTHER, only non reference slices -> BFRAME
+static frame_type_t h264_frame_type(uint8_t *buffer, uint32_t buffer_len)
+{
+    frame_type_t type = BFRAME;
+    uint8_t nal_type;
+
+    for (uint32_t i = 0; i + 3 < buffer_len; i++) {
+        if (buffer[i] != 0 || buffer[i + 1] != 0 || buffer[i + 2] != 1) {
+            continue;
+        }
+        i += 3;
+        nal_type = buffer[i] & 0x1f;
+        if (nal_type == 5) {
+            return INTRA;
+        }
+        if (nal_type >= 1 && nal_type <= 4 && (buffer[i] & 0x60) != 0) {
+            type = OTHER;
+        }
+    }
+
+    return type;
+}
+
+// Passes a pending request_keyframe to the compress module once the last
+// forced keyframe is old enough, otherwise keeps it for a later frame
+static void force_requested_keyframe(encoder_thread_t *encoder)
+{
+    struct msg_change_compress_data *msg;
+    struct response *resp;
+    struct timeval curr_time;
+
+    if (!__atomic_load_n(&encoder->keyframe_requested, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    gettimeofday(&curr_time, NULL);
+    if (tv_diff(curr_time, encoder->keyframe_time) < KEYFRAME_MIN_INTERVAL) {
+        return;
+    }
+    __atomic_store_n(&encoder->keyframe_requested, FALSE, __ATOMIC_RELAXED);
+    encoder->keyframe_time = curr_time;
+
+    msg = (struct msg_change_compress_data *)
+        new_message(sizeof(struct msg_change_compress_data));
+    msg->what = FORCE_KEYFRAME;
+    resp = send_message_to_receiver(CAST_MODULE(encoder->cs), (struct message *) msg);
+    if (resp->status != RESPONSE_OK) {
+        error_msg("force_requested_keyframe: %s\n", response_status_to_text(resp->status));
+    }
+    resp->deleter(resp);
+}
+
+void request_keyframe(video_data_t *data)
+{
+    // Nothing to force before the encoder is started
+    if (data->type != ENCODER || data->encoder == NULL) {
+        return;
+    }
+    __atomic_store_n(&data->encoder->keyframe_requested, TRUE, __ATOMIC_RELEASE);
+}
+
+// Rate the compress module produces at the bitrate it chose itself, which
+// the targets can only lower. Frozen by the first change
+static void measure_own_bitrate(video_data_t *video, uint32_t coded_len)
+{
+    encoder_thread_t *encoder = video->encoder;
+    struct timeval curr_time;
+    double elapsed;
+
+    if (video->bitrate != 0) {
+        return;
+    }
+    gettimeofday(&curr_time, NULL);
+    if (!timerisset(&encoder->own_time)) {
+        encoder->own_time = curr_time;
+    }
+    encoder->own_bytes += coded_len;
+    elapsed = tv_diff(curr_time, encoder->own_time);
+    if (elapsed >= BITRATE_MIN_INTERVAL) {
+        encoder->own_bitrate = encoder->own_bytes * 8 / elapsed;
+    }
+}
+
+// Moves the bitrate of the compress module towards the set_target_bitrate
+// one, averaged so that a single report does not make it jump. Each change
+// restarts the rate control of the codec, so small or frequent ones are
+// held back
+static void apply_target_bitrate(video_data_t *video)
+{
+    encoder_thread_t *encoder = video->encoder;
+    struct msg_change_compress_data *msg;
+    struct response *resp;
+    struct timeval curr_time;
+    uint32_t target, bitrate;
+    double weight;
+
+    target = __atomic_load_n(&encoder->target_bitrate, __ATOMIC_RELAXED);
+    if (target == 0 || encoder->bitrate_unsupported || encoder->own_bitrate == 0) {
+        return;
+    }
+    if (target > encoder->own_bitrate) {
+        target = encoder->own_bitrate;
+    }
+    if (encoder->smoothed_bitrate == 0) {
+        encoder->smoothed_bitrate = target;
+    } else {
+        weight = target < encoder->smoothed_bitrate ? BITRATE_DROP_WEIGHT : BITRATE_RISE_WEIGHT;
+        encoder->smoothed_bitrate += weight * (target - encoder->smoothed_bitrate);
+    }
+    bitrate = (uint32_t) encoder->smoothed_bitrate;
+
+    if (video->bitrate == 0 && bitrate > encoder->own_bitrate * (1 - BITRATE_MIN_CHANGE)) {
+        return;
+    }
+    if (video->bitrate != 0 && bitrate < video->bitrate * (1 + BITRATE_MIN_CHANGE)
+            && bitrate > video->bitrate * (1 - BITRATE_MIN_CHANGE)) {
+        return;
+    }
+    gettimeofday(&curr_time, NULL);
+    if (tv_diff(curr_time, encoder->bitrate_time) < BITRATE_MIN_INTERVAL) {
+        return;
+    }
+    encoder->bitrate_time = curr_time;
+
+    msg = (struct msg_change_compress_data *)
+        new_message(sizeof(struct msg_change_compress_data));
+    msg->what = CHANGE_PARAMS;
+    snprintf(msg->config_string, sizeof(msg->config_string), "bitrate=%u", bitrate);
+    resp = send_message_to_receiver(CAST_MODULE(encoder->cs), (struct message *) msg);
+    if (resp->status == RESPONSE_OK) {
+        video->bitrate = bitrate;
+    } else {
+        error_msg("apply_target_bitrate: %s, keeping the encoder bitrate\n",
+                response_status_to_text(resp->status));
+        encoder->bitrate_unsupported = TRUE;
+    }
+    resp->deleter(resp);
+}
+
+void set_target_bitrate(video_data_t *data, uint32_t bitrate)
+{
+    if (data->type != ENCODER || data->encoder == NULL) {
+        return;
+    }
+    __atomic_store_n(&data->encoder->target_bitrate, bitrate, __ATOMIC_RELAXED);
+}
 
 int reconf_video_frame(video_data_frame_t *frame, struct video_frame *enc_frame, uint32_t fps){
     if (frame->width != vf_get_tile(enc_frame, 0)->width
@@ -38,6 +206,7 @@ void *encoder_routine(void *arg)
     video_data_frame_t* decoded_frame;
     video_data_frame_t* coded_frame;
     struct video_frame *enc_frame;
+    uint32_t wait_time;
 
     // decoded_frame len and memory already initialized
 
@@ -56,28 +225,14 @@ void *encoder_routine(void *arg)
 
     encoder->run = TRUE; 
     encoder->index = 0;
+    wait_time = frame_wait_time(video);
    
     while (encoder->run) {
         
-        if (!encoder->run) {
-            break;
-        }
-        
-        //TODO: set a non magic number in this usleep (maybe related to framerate)
-        usleep(100);
-        
-        decoded_frame = curr_out_frame(video->decoded_frames);
+        decoded_frame = wait_out_frame(video->decoded_frames, wait_time);
         if (decoded_frame == NULL){
             continue;
         }
-              
-        coded_frame = curr_in_frame(video->coded_frames);
-        while (coded_frame == NULL){
-            flush_frames(video->coded_frames);
-            error_msg("Warning! Discarting coded frame in transmission\n");
-            video->lost_coded_frames++;
-            coded_frame = curr_in_frame(video->coded_frames);
-        }
 
         reconf_video_frame(decoded_frame, enc_frame, video->fps);
 
@@ -85,12 +240,32 @@ void *encoder_routine(void *arg)
         enc_frame->tiles[0].data_len = decoded_frame->buffer_len;
         
         struct video_frame *tx_frame;
+        frame_type_t type;
         
+        force_requested_keyframe(encoder);
+        apply_target_bitrate(video);
+
+        // Compress first: the coded queue policy depends on the frame type
         tx_frame = compress_frame(encoder->cs, enc_frame, encoder->index);
+        type = h264_frame_type((uint8_t *)vf_get_tile(tx_frame, 0)->data, 
+                vf_get_tile(tx_frame, 0)->data_len);
+        measure_own_bitrate(video, vf_get_tile(tx_frame, 0)->data_len);
+
+        coded_frame = get_in_frame(video->coded_frames, type, wait_time);
+        if (coded_frame == NULL){
+            error_msg("Warning! Discarting coded frame in transmission\n");
+            video->lost_coded_frames++;
+            remove_frame(video->decoded_frames);
+            continue;
+        }
         
-        encoder->frame = tx_frame;
-        coded_frame->buffer = (uint8_t *)vf_get_tile(tx_frame, 0)->data;
-        coded_frame->buffer_len = vf_get_tile(tx_frame, 0)->data_len;
+        // The packet data is only valid until the encoder reuses its buffer
+        if (!set_coded_frame_data(coded_frame, (uint8_t *)vf_get_tile(tx_frame, 0)->data, 
+                    vf_get_tile(tx_frame, 0)->data_len)){
+            remove_frame(video->decoded_frames);
+            continue;
+        }
+        coded_frame->frame_type = type;
 
         coded_frame->seqno = decoded_frame->seqno;
 
@@ -120,6 +295,15 @@ encoder_thread_t *init_encoder(video_data_t *data)
     }
 
     encoder->run = FALSE;
+    encoder->keyframe_requested = FALSE;
+    timerclear(&encoder->keyframe_time);
+    encoder->target_bitrate = 0;
+    encoder->smoothed_bitrate = 0;
+    timerclear(&encoder->bitrate_time);
+    encoder->bitrate_unsupported = FALSE;
+    encoder->own_bytes = 0;
+    timerclear(&encoder->own_time);
+    encoder->own_bitrate = 0;
     
     // TODO assign the encoder here?
     data->encoder = encoder;
@@ -162,6 +346,7 @@ decoder_thread_t *init_decoder(video_data_t *data){
     }
 
 	decoder->run = FALSE;
+    decoder->scratch = NULL;
     
 	if (decompress_is_available(LIBAVCODEC_MAGIC)) {
         //TODO: add some magic to determine codec
@@ -193,6 +378,14 @@ decoder_thread_t *init_decoder(video_data_t *data){
             return NULL;
         }
 
+        decoder->scratch = malloc(vc_get_linesize(des.width, RGB) * des.height);
+        if (decoder->scratch == NULL) {
+            error_msg("decoder scratch malloc failed");
+            decompress_done(decoder->sd);
+            free(decoder);
+            return NULL;
+        }
+
     } else {
 	    error_msg("decompress not available");
         free(decoder);
@@ -207,23 +400,23 @@ void *decoder_th(void* data){
     
     video_data_frame_t* coded_frame;
     video_data_frame_t* decoded_frame;
+    uint32_t wait_time = frame_wait_time(v_data);
 
     while(v_data->decoder->run){
-        usleep(100);
-             
-        if (!v_data->decoder->run){
-            break;
-        }
-
-        coded_frame = curr_out_frame(v_data->coded_frames);        
+        coded_frame = wait_out_frame(v_data->coded_frames, wait_time);        
         if (coded_frame == NULL){
             continue;
         }
 
-        decoded_frame = curr_in_frame(v_data->decoded_frames);
-        while (decoded_frame == NULL){
-            flush_frames(v_data->decoded_frames);
-            decoded_frame = curr_in_frame(v_data->decoded_frames);
+        // Every coded frame is decoded, or the frames referencing it would
+        // be corrupt until the next INTRA: the decoded queue policy can only
+        // discard the output, so a refused frame is decoded into scratch
+        decoded_frame = get_in_frame(v_data->decoded_frames, coded_frame->frame_type, wait_time);
+        if (decoded_frame == NULL){
+            decompress_frame(v_data->decoder->sd, v_data->decoder->scratch, 
+                (unsigned char *)coded_frame->buffer, coded_frame->buffer_len, 0);
+            remove_frame(v_data->coded_frames);
+            continue;
         }
 
         decompress_frame(v_data->decoder->sd, decoded_frame->buffer, 
@@ -255,6 +448,7 @@ void destroy_decoder(decoder_thread_t *decoder){
     }
 
     decompress_done(decoder->sd);
+    free(decoder->scratch);
     free(decoder);
 }
 
@@ -269,18 +463,72 @@ void stop_decoder(video_data_t *data){
     destroy_decoder(data->decoder);
 }
 
-video_data_t *init_video_data(role_t type, float fps){
-    video_data_t *data = malloc(sizeof(video_data_t));
+int fanout_video_frame(video_data_t *src, video_data_t **dst, int count){
+    video_data_frame_t *in_frame;
+    video_data_frame_t *out_frame;
+    int sent = 0;
+
+    in_frame = curr_out_frame(src->decoded_frames);
+    if (in_frame == NULL){
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++){
+        out_frame = get_in_frame_to_share(dst[i]->decoded_frames, in_frame->frame_type, 0);
+        if (out_frame == NULL){
+            continue;
+        }
+        share_video_data_frame(out_frame, in_frame);
+        put_frame(dst[i]->decoded_frames);
+        sent++;
+    }
+
+    remove_frame(src->decoded_frames);
+
+    return sent;
+}
+
+void video_queue_conf_default(role_t type, video_queue_conf_t *conf){
+    conf->decoded_depth = DEFAULT_QUEUE_DEPTH;
+    conf->decoded_policy = CQ_DROP_OLDEST;
+    conf->coded_depth = DEFAULT_QUEUE_DEPTH;
+    conf->coded_policy = type == DECODER ? CQ_DROP_NEWEST : CQ_DROP_OLDEST;
+}
+
+video_data_t *init_video_data(role_t type, float fps, const video_queue_conf_t *conf){
+    video_queue_conf_t default_conf;
+    video_data_t *data;
 
-    //TODO: get rid of magic numbers
-    data->decoded_frames = init_video_frame_cq(2);
-    data->coded_frames = init_video_frame_cq(2);
+    if (conf == NULL){
+        video_queue_conf_default(type, &default_conf);
+        conf = &default_conf;
+    }
+
+    data = malloc(sizeof(video_data_t));
+    if (data == NULL){
+        error_msg("init_video_data: malloc error");
+        return NULL;
+    }
+
+    data->decoded_frames = init_video_frame_cq(conf->decoded_depth, conf->decoded_policy);
+    data->coded_frames = init_video_frame_cq(conf->coded_depth, conf->coded_policy);
+    if (data->decoded_frames == NULL || data->coded_frames == NULL){
+        if (data->decoded_frames != NULL){
+            destroy_video_frame_cq(data->decoded_frames);
+        }
+        if (data->coded_frames != NULL){
+            destroy_video_frame_cq(data->coded_frames);
+        }
+        free(data);
+        return NULL;
+    }
     data->type = type;
     data->fps = fps;
     data->bitrate = 0;
     data->decoder = NULL; //As decoder and encoder are union, this is valid for both
     data->seqno = 0; 
     data->lost_coded_frames = 0;
+    data->playout_delay = 0;
 
 
     return data;
@@ -8,6 +8,7 @@ typedef struct decoder_thread {
     pthread_t thread;
     uint8_t run;
     struct state_decompress *sd;
+    uint8_t *scratch;           // output of the frames the decoded queue refuses
 } decoder_thread_t;
 
 typedef struct encoder_thread {
@@ -16,9 +17,16 @@ typedef struct encoder_thread {
 
     int index;
 
-    struct video_frame *frame;  // TODO: should be gone!
-                                // redundant with stream->coded_frame
     struct compress_state *cs;
+    uint32_t keyframe_requested;        // set by request_keyframe
+    struct timeval keyframe_time;       // last keyframe forced on cs
+    uint32_t target_bitrate;            // set by set_target_bitrate, 0 for none
+    double smoothed_bitrate;            // target_bitrate averaged over frames
+    struct timeval bitrate_time;        // last bitrate set on cs
+    uint8_t bitrate_unsupported;        // cs refused it, no more tries
+    uint64_t own_bytes;                 // coded while cs chooses its bitrate
+    struct timeval own_time;            // ...since then
+    uint32_t own_bitrate;               // ...their rate, 0 until measured
 } encoder_thread_t;
 
 typedef struct video_data {
@@ -28,14 +36,34 @@ typedef struct video_data {
     uint32_t interlacing;  //TODO: fix this. It has to be UG enum
     uint32_t fps;       //TODO: fix this. It has to be UG enum
     uint32_t seqno;
-    uint32_t bitrate;
+    uint32_t bitrate;   // bits per second set on the encoder, 0 for its own choice
     uint32_t lost_coded_frames;
+    double playout_delay;   // seconds, chosen by the receiver jitter buffer
     union {
         struct encoder_thread *encoder;
         struct decoder_thread *decoder;
     };
 } video_data_t;
 
+/**
+ * Depth and overflow policy of the two frame queues of a video_data_t,
+ * see cq_policy_t. Fill it with video_queue_conf_default first.
+ */
+typedef struct video_queue_conf {
+    uint8_t decoded_depth;
+    cq_policy_t decoded_policy;
+    uint8_t coded_depth;
+    cq_policy_t coded_policy;
+} video_queue_conf_t;
+
+/**
+ * Default queues of a role. A DECODER receiver can only discard the frame
+ * being depacketized, so its coded queue drops the newest frame.
+ * @param type DECODER or ENCODER.
+ * @param conf Filled.
+ */
+void video_queue_conf_default(role_t type, video_queue_conf_t *conf);
+
 decoder_thread_t *init_decoder(video_data_t *data);
 encoder_thread_t *init_encoder(video_data_t *data);
 
@@ -45,5 +73,45 @@ void destroy_encoder(video_data_t *data);
 void stop_decoder(video_data_t *data);
 void stop_encoder(video_data_t *data);
 
-video_data_t *init_video_data(role_t type, float fps);
+/**
+ * Makes the encoder of an ENCODER stream emit an IDR frame, so receivers
+ * that lost data or just joined can decode again. Requests are coalesced:
+ * at most one keyframe is forced every KEYFRAME_MIN_INTERVAL seconds.
+ * Any thread. A no-op on other streams and before the encoder starts.
+ * @param data ENCODER video_data_t.
+ */
+void request_keyframe(video_data_t *data);
+
+/**
+ * Sets the rate the encoder of an ENCODER stream should produce, usually
+ * the lowest target of the RTP sessions sending it. It can only lower the
+ * bitrate the compress module chooses itself, as measured while it does,
+ * never raise it above. The encoder follows
+ * drops within a few frames and rises over seconds, and reconfigures the
+ * compress module at most every BITRATE_MIN_INTERVAL seconds, for changes
+ * over BITRATE_MIN_CHANGE of the current rate.
+ * Any thread. A no-op on other streams and before the encoder starts.
+ * @param data ENCODER video_data_t.
+ * @param bitrate Bits per second.
+ */
+void set_target_bitrate(video_data_t *data, uint32_t bitrate);
+
+/**
+ * Publishes the oldest decoded frame of src in the decoded queue of every
+ * dst without copying it. Each output applies its own queue policy, so a
+ * full output may miss the frame without holding back the others.
+ * @param src Input video_data_t, usually a DECODER.
+ * @param dst Output video_data_t array, usually ENCODERs.
+ * @param count Number of outputs.
+ * @return Number of outputs that got the frame, -1 if src had none.
+ */
+int fanout_video_frame(video_data_t *src, video_data_t **dst, int count);
+
+/**
+ * @param type DECODER or ENCODER.
+ * @param fps Frame rate.
+ * @param conf Queues, NULL for video_queue_conf_default.
+ * @return New video_data_t, NULL on error.
+ */
+video_data_t *init_video_data(role_t type, float fps, const video_queue_conf_t *conf);
 int destroy_video_data(video_data_t *data);
@@ -68,7 +68,8 @@ struct msg_change_fec_data {
 
 enum compress_change_type {
         CHANGE_COMPRESS,
-        CHANGE_PARAMS
+        CHANGE_PARAMS,
+        FORCE_KEYFRAME          ///< next compressed frame must be decodable on its own
 };
 
 struct msg_change_compress_data {
@@ -85,6 +85,12 @@ struct pdb {
         pdb_node_t *root;
         uint32_t magic;
         int count;
+        struct pdb_e *ready_first;
+        struct pdb_e *ready_last;
+        int ready_count;
+        /* Adaptive playout delay bounds of new entries, 0 if fixed */
+        double min_playout_delay;
+        double max_playout_delay;
 };
 
 /*****************************************************************************/
@@ -247,6 +253,11 @@ struct pdb *pdb_init(void)
                 db->magic = PDB_MAGIC;
                 db->count = 0;
                 db->root = NULL;
+                db->ready_first = NULL;
+                db->ready_last = NULL;
+                db->ready_count = 0;
+                db->min_playout_delay = 0;
+                db->max_playout_delay = 0;
         }
         return db;
 }
@@ -266,7 +277,13 @@ void pdb_destroy(struct pdb **db_p)
         *db_p = NULL;
 }
 
-static struct pdb_e *pdb_create_item(uint32_t ssrc)
+void pdb_set_playout_delay(struct pdb *db, double min_delay, double max_delay)
+{
+        db->min_playout_delay = min_delay;
+        db->max_playout_delay = max_delay;
+}
+
+static struct pdb_e *pdb_create_item(struct pdb *db, uint32_t ssrc)
 {
         struct pdb_e *p = malloc(sizeof(struct pdb_e));
         if (p != NULL) {
@@ -283,7 +300,14 @@ static struct pdb_e *pdb_create_item(uint32_t ssrc)
                 p->decoder_state_deleter = NULL;
                 p->pt = 255;
                 p->playout_buffer = pbuf_init();
+                if (p->playout_buffer != NULL && db->max_playout_delay > 0) {
+                        pbuf_set_adaptive_delay(p->playout_buffer,
+                                        db->min_playout_delay,
+                                        db->max_playout_delay);
+                }
                 p->tfrc_state = tfrc_init(p->creation_time);
+                p->ready_next = NULL;
+                p->ready = FALSE;
         }
         return p;
 }
@@ -303,7 +327,7 @@ int pdb_add(struct pdb *db, uint32_t ssrc)
                 return 1;
         }
 
-        i = pdb_create_item(ssrc);
+        i = pdb_create_item(db, ssrc);
         if (i == NULL) {
                 debug_msg("Unable to create database entry - ssrc %x\n", ssrc);
                 return 2;
@@ -335,6 +359,24 @@ struct pdb_e *pdb_get(struct pdb *db, uint32_t ssrc)
         return NULL;
 }
 
+static void unlink_ready(struct pdb *db, struct pdb_e *item)
+{
+        struct pdb_e **prev;
+
+        db->ready_last = NULL;
+        for (prev = &db->ready_first; *prev != NULL; prev = &(*prev)->ready_next) {
+                if (*prev == item) {
+                        *prev = item->ready_next;
+                        db->ready_count--;
+                        if (*prev == NULL) {
+                                break;
+                        }
+                }
+                db->ready_last = *prev;
+        }
+        item->ready = FALSE;
+}
+
 int pdb_remove(struct pdb *db, uint32_t ssrc, struct pdb_e **item)
 {
         /* Remove the item indexed by ssrc. Return zero on success.   */
@@ -356,9 +398,48 @@ int pdb_remove(struct pdb *db, uint32_t ssrc, struct pdb_e **item)
         *item = x->data;
         x = pdb_delete_node(db, x);
         free(x);
+        if ((*item)->ready) {
+                unlink_ready(db, *item);
+        }
         return 0;
 }
 
+void pdb_push_ready(struct pdb *db, struct pdb_e *item)
+{
+        if (item->ready) {
+                return;
+        }
+        item->ready = TRUE;
+        item->ready_next = NULL;
+        if (db->ready_last == NULL) {
+                db->ready_first = item;
+        } else {
+                db->ready_last->ready_next = item;
+        }
+        db->ready_last = item;
+        db->ready_count++;
+}
+
+struct pdb_e *pdb_pop_ready(struct pdb *db)
+{
+        struct pdb_e *item = db->ready_first;
+
+        if (item != NULL) {
+                db->ready_first = item->ready_next;
+                if (db->ready_first == NULL) {
+                        db->ready_last = NULL;
+                }
+                item->ready = FALSE;
+                db->ready_count--;
+        }
+        return item;
+}
+
+int pdb_ready_count(struct pdb *db)
+{
+        return db->ready_count;
+}
+
 /* 
  * Iterator functions 
  */
@@ -78,6 +78,8 @@ struct pdb_e {
 	struct pbuf		*playout_buffer;
 	struct tfrc		*tfrc_state;
 	struct timeval		 creation_time;	/* Time this entry was created */
+	struct pdb_e		*ready_next;	/* In the ready list of the database */
+	int			 ready;
 };
 
 struct pdb;	/* The participant database */
@@ -85,6 +87,12 @@ struct pdb;	/* The participant database */
 struct pdb          *pdb_init(void);
 void                 pdb_destroy(struct pdb **db);
 int                  pdb_add(struct pdb *db, uint32_t ssrc);
+
+/* Playout buffers of the entries added afterwards adapt their delay to the
+ * jitter of the participant within [min_delay, max_delay] seconds (see
+ * pbuf_set_adaptive_delay). A max_delay of 0 restores the fixed delay.
+ */
+void                 pdb_set_playout_delay(struct pdb *db, double min_delay, double max_delay);
 struct pdb_e        *pdb_get(struct pdb *db, uint32_t ssrc);
 
 /* Remove the entry indexed by "ssrc" from the database, returning a
@@ -92,6 +100,15 @@ struct pdb_e        *pdb_get(struct pdb *db, uint32_t ssrc);
  */
 int                  pdb_remove(struct pdb *db, uint32_t ssrc, struct pdb_e **item);
 
+/* 
+ * Entries whose playout buffer got a complete frame, so the receiver only
+ * visits those instead of the whole database. An entry is queued once no
+ * matter how many times it is pushed, and pdb_remove unlinks it.
+ */
+void                 pdb_push_ready(struct pdb *db, struct pdb_e *item);
+struct pdb_e        *pdb_pop_ready(struct pdb *db);
+int                  pdb_ready_count(struct pdb *db);
+
 typedef void *pdb_iter_t;
 /*
  * Iterator for the database.
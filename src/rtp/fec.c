@@ -0,0 +1,290 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#include "config_unix.h"
+#include "config_win32.h"
+#endif
+
+#include "debug.h"
+#include "rtp/fec.h"
+
+/* Parity of the packets of a row or a column */
+struct fec_xor_parity {
+        uint8_t mpt;
+        uint16_t sn_base;
+        uint16_t len;
+        uint64_t mask;
+        int count;
+        int ready;
+        uint8_t *data;
+        int data_len;           ///< bytes of data in use, the longest packet so far
+        int size;
+};
+
+struct fec_xor_encoder {
+        int cols;
+        int rows;
+        int count;              ///< packets of the current block
+        int closed;             ///< block complete, restarted by the next packet
+        uint16_t next_seq;
+        uint32_t ts;
+        struct fec_xor_parity row;
+        struct fec_xor_parity *columns;
+};
+
+void fec_xor(uint8_t *dst, const uint8_t *src, int len)
+{
+        uint64_t a, b;
+
+        for (; len >= 8; len -= 8, dst += 8, src += 8) {
+                memcpy(&a, dst, 8);
+                memcpy(&b, src, 8);
+                a ^= b;
+                memcpy(dst, &a, 8);
+        }
+        while (len-- > 0) {
+                *dst++ ^= *src++;
+        }
+}
+
+int fec_xor_parse(const uint8_t *buffer, int len, struct fec_xor_header *hdr)
+{
+        int i;
+
+        /* E must be clear, and L set for the 48 bit mask we send */
+        if (len < FEC_XOR_HDR_LEN || (buffer[0] & 0xc0) != 0x40) {
+                return FALSE;
+        }
+
+        hdr->pxcc = buffer[0] & 0x3f;
+        hdr->mpt = buffer[1];
+        hdr->sn_base = (buffer[2] << 8) | buffer[3];
+        hdr->ts = ((uint32_t) buffer[4] << 24) | (buffer[5] << 16)
+                | (buffer[6] << 8) | buffer[7];
+        hdr->len = (buffer[8] << 8) | buffer[9];
+        hdr->prot_len = (buffer[10] << 8) | buffer[11];
+        hdr->mask = 0;
+        for (i = 12; i < FEC_XOR_HDR_LEN; i++) {
+                hdr->mask = (hdr->mask << 8) | buffer[i];
+        }
+
+        return hdr->mask != 0 && hdr->prot_len <= len - FEC_XOR_HDR_LEN;
+}
+
+int fec_xor_covers(const struct fec_xor_header *hdr, uint16_t seq)
+{
+        uint16_t d = seq - hdr->sn_base;
+
+        return d < FEC_XOR_MAX_SPAN && ((hdr->mask >> (FEC_XOR_MAX_SPAN - 1 - d)) & 1);
+}
+
+static void parity_reset(struct fec_xor_parity *parity)
+{
+        parity->mpt = 0;
+        parity->len = 0;
+        parity->mask = 0;
+        parity->count = 0;
+        parity->ready = FALSE;
+        parity->data_len = 0;
+}
+
+static int parity_add(struct fec_xor_parity *parity, uint16_t seq, int m, int pt,
+                const char *phdr, int phdr_len, const char *data, int data_len)
+{
+        int len = phdr_len + data_len;
+        uint8_t *buffer;
+
+        if (parity->size < len) {
+                buffer = realloc(parity->data, len);
+                if (buffer == NULL) {
+                        error_msg("fec_xor_encoder_add: malloc error\n");
+                        return FALSE;
+                }
+                parity->data = buffer;
+                parity->size = len;
+        }
+        /* Shorter packets are padded with zeros */
+        if (parity->data_len < len) {
+                memset(parity->data + parity->data_len, 0, len - parity->data_len);
+                parity->data_len = len;
+        }
+
+        if (parity->count == 0) {
+                parity->sn_base = seq;
+        }
+        parity->mpt ^= (m ? 0x80 : 0) | (pt & 0x7f);
+        parity->len ^= len;
+        parity->mask |= 1ULL << (FEC_XOR_MAX_SPAN - 1 - (uint16_t) (seq - parity->sn_base));
+        if (phdr_len > 0) {
+                fec_xor(parity->data, (const uint8_t *) phdr, phdr_len);
+        }
+        fec_xor(parity->data + phdr_len, (const uint8_t *) data, data_len);
+        parity->count++;
+
+        return TRUE;
+}
+
+static void encoder_reset(struct fec_xor_encoder *enc)
+{
+        int i;
+
+        parity_reset(&enc->row);
+        for (i = 0; i < enc->cols; i++) {
+                parity_reset(&enc->columns[i]);
+        }
+        enc->count = 0;
+        enc->closed = FALSE;
+}
+
+struct fec_xor_encoder *fec_xor_encoder_init(int cols, int rows)
+{
+        struct fec_xor_encoder *enc;
+
+        if (cols < 2 || cols > FEC_XOR_MAX_SPAN || rows < 1
+                        || (rows - 1) * cols + 1 > FEC_XOR_MAX_SPAN) {
+                error_msg("fec_xor_encoder_init: unsupported %dx%d matrix\n", cols, rows);
+                return NULL;
+        }
+
+        enc = calloc(1, sizeof(struct fec_xor_encoder));
+        if (enc == NULL) {
+                error_msg("fec_xor_encoder_init: malloc error\n");
+                return NULL;
+        }
+        enc->columns = calloc(cols, sizeof(struct fec_xor_parity));
+        if (enc->columns == NULL) {
+                error_msg("fec_xor_encoder_init: malloc error\n");
+                free(enc);
+                return NULL;
+        }
+        enc->cols = cols;
+        enc->rows = rows;
+
+        return enc;
+}
+
+void fec_xor_encoder_done(struct fec_xor_encoder *enc)
+{
+        int i;
+
+        if (enc == NULL) {
+                return;
+        }
+
+        free(enc->row.data);
+        for (i = 0; i < enc->cols; i++) {
+                free(enc->columns[i].data);
+        }
+        free(enc->columns);
+        free(enc);
+}
+
+int fec_xor_encoder_add(struct fec_xor_encoder *enc, uint16_t seq, int m, int pt,
+                uint32_t ts, const char *phdr, int phdr_len,
+                const char *data, int data_len)
+{
+        struct fec_xor_parity *column;
+        int idx, ready = 0;
+        int i;
+
+        if (phdr == NULL) {
+                phdr_len = 0;
+        }
+
+        /* Payloads not taken are lost */
+        if (enc->row.ready) {
+                parity_reset(&enc->row);
+        }
+        if (enc->closed || (enc->count > 0 && (seq != enc->next_seq || ts != enc->ts))) {
+                encoder_reset(enc);
+        }
+
+        idx = enc->count++;
+        column = &enc->columns[idx % enc->cols];
+        if (idx == 0) {
+                enc->ts = ts;
+        }
+        enc->next_seq = seq + 1;
+
+        if (!parity_add(&enc->row, seq, m, pt, phdr, phdr_len, data, data_len)
+                        || (enc->rows > 1
+                            && !parity_add(column, seq, m, pt, phdr, phdr_len, data, data_len))) {
+                enc->closed = TRUE;
+                return 0;
+        }
+
+        /* A single packet is better protected by a retransmission */
+        if (idx % enc->cols == enc->cols - 1 || m) {
+                if (enc->row.count > 1) {
+                        enc->row.ready = TRUE;
+                        ready++;
+                } else {
+                        parity_reset(&enc->row);
+                }
+        }
+        if (idx == enc->cols * enc->rows - 1 || m) {
+                enc->closed = TRUE;
+                if (enc->rows > 1) {
+                        for (i = 0; i < enc->cols; i++) {
+                                if (enc->columns[i].count > 1) {
+                                        enc->columns[i].ready = TRUE;
+                                        ready++;
+                                }
+                        }
+                }
+        }
+
+        return ready;
+}
+
+int fec_xor_encoder_pop(struct fec_xor_encoder *enc, uint8_t *buffer, int buflen,
+                uint32_t *ts)
+{
+        struct fec_xor_parity *parity = NULL;
+        int i;
+
+        if (enc->row.ready) {
+                parity = &enc->row;
+        } else {
+                for (i = 0; i < enc->cols && parity == NULL; i++) {
+                        if (enc->columns[i].ready) {
+                                parity = &enc->columns[i];
+                        }
+                }
+        }
+        if (parity == NULL) {
+                return 0;
+        }
+
+        if (FEC_XOR_HDR_LEN + parity->data_len > buflen) {
+                parity_reset(parity);
+                return 0;
+        }
+
+        /* Neither P, X nor CC are set on the packets we protect, and the */
+        /* block shares one timestamp, so TS recovery is 0 or that TS.    */
+        buffer[0] = 0x40;
+        buffer[1] = parity->mpt;
+        buffer[2] = parity->sn_base >> 8;
+        buffer[3] = parity->sn_base & 0xff;
+        if (parity->count % 2) {
+                buffer[4] = enc->ts >> 24;
+                buffer[5] = (enc->ts >> 16) & 0xff;
+                buffer[6] = (enc->ts >> 8) & 0xff;
+                buffer[7] = enc->ts & 0xff;
+        } else {
+                memset(buffer + 4, 0, 4);
+        }
+        buffer[8] = parity->len >> 8;
+        buffer[9] = parity->len & 0xff;
+        buffer[10] = parity->data_len >> 8;
+        buffer[11] = parity->data_len & 0xff;
+        for (i = 0; i < 6; i++) {
+                buffer[12 + i] = (parity->mask >> (40 - 8 * i)) & 0xff;
+        }
+        memcpy(buffer + FEC_XOR_HDR_LEN, parity->data, parity->data_len);
+        *ts = enc->ts;
+
+        i = FEC_XOR_HDR_LEN + parity->data_len;
+        parity_reset(parity);
+        return i;
+}
@@ -0,0 +1,99 @@
+#ifndef FEC_H_
+#define FEC_H_
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * XOR parity FEC (RFC 5109, ULP level 0 only, 48 bit masks).
+ *
+ * Media packets are laid out in blocks of cols x rows consecutive seqnos.
+ * Every row gets a FEC packet as soon as it is complete, and when the
+ * block has more than one row every column gets one at the end of the
+ * block, so a lost burst shorter than a row is recovered too. A block is
+ * also closed by the M bit of a frame, so a frame never waits for the
+ * packets of the next one to be protected and a FEC packet carries the
+ * timestamp of the frame it protects.
+ *
+ * A FEC payload is the FEC header, the level 0 header and the XOR of the
+ * protected packets past their fixed RTP header, padded to the longest.
+ * Only media packets without CSRC list nor header extension are protected.
+ *
+ * usage:
+ * struct fec_xor_encoder *enc = fec_xor_encoder_init(10, 4);
+ * fec_xor_encoder_add(enc, seq, m, pt, ts, phdr, phdr_len, data, data_len);
+ * while ((len = fec_xor_encoder_pop(enc, buffer, sizeof(buffer), &ts)) > 0) {
+ *         ... send buffer as the payload of a FEC packet ...
+ * }
+ * fec_xor_encoder_done(enc);
+ */
+
+#define FEC_XOR_HDR_LEN         18      /* FEC header and level 0 header */
+#define FEC_XOR_MAX_SPAN        48      /* Seqnos a mask can cover */
+
+struct fec_xor_header {
+        uint8_t pxcc;           /* P, X and CC recovery */
+        uint8_t mpt;            /* M and PT recovery */
+        uint16_t sn_base;
+        uint32_t ts;            /* TS recovery */
+        uint16_t len;           /* Length recovery */
+        uint16_t prot_len;      /* Bytes of parity */
+        uint64_t mask;          /* Bit 47 is sn_base, bit 0 sn_base + 47 */
+};
+
+/**
+ * @param buffer FEC payload.
+ * @param len Length of buffer.
+ * @param hdr Filled with the headers of buffer.
+ * @return TRUE if buffer holds a FEC payload we can use, FALSE otherwise.
+ */
+int fec_xor_parse(const uint8_t *buffer, int len, struct fec_xor_header *hdr);
+
+/**
+ * @return TRUE if seq is protected by hdr.
+ */
+int fec_xor_covers(const struct fec_xor_header *hdr, uint16_t seq);
+
+/**
+ * dst ^= src, len bytes.
+ */
+void fec_xor(uint8_t *dst, const uint8_t *src, int len);
+
+struct fec_xor_encoder;
+
+/**
+ * @param cols Packets per row, at least 2.
+ * @param rows Rows per block, so that a column fits FEC_XOR_MAX_SPAN.
+ * @return New encoder, NULL on error.
+ */
+struct fec_xor_encoder *fec_xor_encoder_init(int cols, int rows);
+void fec_xor_encoder_done(struct fec_xor_encoder *enc);
+
+/**
+ * Adds a media packet to the parity of its row and column. A seqno that
+ * does not follow the previous one, or a timestamp other than the one of
+ * the block, discards the unfinished block.
+ * @param phdr Payload header sent between the RTP header and data, or NULL.
+ * @return Number of FEC payloads ready, to be taken with fec_xor_encoder_pop
+ * before the next call.
+ */
+int fec_xor_encoder_add(struct fec_xor_encoder *enc, uint16_t seq, int m, int pt,
+                uint32_t ts, const char *phdr, int phdr_len,
+                const char *data, int data_len);
+
+/**
+ * Writes the next ready FEC payload into buffer.
+ * @param ts Set to the RTP timestamp of the protected packets.
+ * @return Length of the payload, 0 if none is ready or it does not fit.
+ */
+int fec_xor_encoder_pop(struct fec_xor_encoder *enc, uint8_t *buffer, int buflen,
+                uint32_t *ts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif// FEC_H_
@@ -43,6 +43,10 @@
 /* appropriate system header files should also be included   */
 /* by those files.                                           */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sendmmsg(), recvmmsg() */
+#endif
+
 #include "config.h"
 #include "config_unix.h"
 #include "config_win32.h"
@@ -1019,6 +1023,38 @@ int udp_send(socket_udp * s, char *buffer, int buflen)
         return -1;
 }
 
+/**
+ * udp_sendto:
+ * @s: UDP session.
+ * @buffer: pointer to buffer to be transmitted.
+ * @buflen: length of @buffer.
+ * @addr: destination, as reported by udp_recv_batch_from().
+ *
+ * Transmits a UDP datagram to @addr instead of the session destination.
+ *
+ * Return value: number of bytes sent, -1 on failure.
+ **/
+int udp_sendto(socket_udp * s, char *buffer, int buflen,
+               const struct sockaddr_storage *addr)
+{
+        socklen_t addrlen;
+
+        switch (addr->ss_family) {
+        case AF_INET:
+                addrlen = sizeof(struct sockaddr_in);
+                break;
+#ifdef HAVE_IPv6
+        case AF_INET6:
+                addrlen = sizeof(struct sockaddr_in6);
+                break;
+#endif
+        default:
+                return -1;
+        }
+        return sendto(s->fd, buffer, buflen, 0, (const struct sockaddr *) addr,
+                      addrlen);
+}
+
 #ifdef WIN32
 int udp_sendv(socket_udp * s, LPWSABUF vector, int count)
 #else
@@ -1036,6 +1072,85 @@ int udp_sendv(socket_udp * s, struct iovec *vector, int count)
         return -1;
 }
 
+/**
+ * udp_sendv_batch:
+ * @s: UDP session.
+ * @vectors: one scatter/gather array per datagram.
+ * @counts: number of entries of each array in @vectors.
+ * @n: number of datagrams.
+ *
+ * Transmits @n UDP datagrams, handing as many of them to the kernel
+ * per system call as the platform allows (sendmmsg() where available,
+ * one udp_sendv() per datagram otherwise).
+ *
+ * Return value: number of datagrams sent, -1 if none could be sent.
+ **/
+#ifdef WIN32
+int udp_sendv_batch(socket_udp * s, LPWSABUF * vectors, int *counts, int n)
+#else
+int udp_sendv_batch(socket_udp * s, struct iovec **vectors, int *counts, int n)
+#endif // WIN32
+{
+#if defined HAVE_SENDMMSG && !defined WIN32
+        struct mmsghdr msgs[UDP_MAX_BATCH];
+        struct sockaddr_in s_in;
+        struct sockaddr *name;
+        socklen_t namelen;
+        int pos = 0, sent = 0;
+        int i, chunk, rc;
+
+        switch (s->mode) {
+        case IPv4:
+                s_in.sin_family = AF_INET;
+                s_in.sin_addr.s_addr = s->addr4.s_addr;
+                s_in.sin_port = htons(s->tx_port);
+                name = (struct sockaddr *) &s_in;
+                namelen = sizeof(s_in);
+                break;
+#ifdef HAVE_IPv6
+        case IPv6:
+                name = (struct sockaddr *) &s->sock6;
+                namelen = sizeof(s->sock6);
+                break;
+#endif
+        default:
+                abort();
+        }
+
+        while (pos < n) {
+                chunk = n - pos < UDP_MAX_BATCH ? n - pos : UDP_MAX_BATCH;
+                for (i = 0; i < chunk; i++) {
+                        msgs[i].msg_hdr.msg_name = name;
+                        msgs[i].msg_hdr.msg_namelen = namelen;
+                        msgs[i].msg_hdr.msg_iov = vectors[pos + i];
+                        msgs[i].msg_hdr.msg_iovlen = counts[pos + i];
+                        msgs[i].msg_hdr.msg_control = 0;
+                        msgs[i].msg_hdr.msg_controllen = 0;
+                        msgs[i].msg_hdr.msg_flags = 0;
+                        msgs[i].msg_len = 0;
+                }
+                rc = sendmmsg(s->fd, msgs, chunk, 0);
+                if (rc <= 0) {
+                        /* The first datagram was refused: drop it, as a failed sendmsg() would */
+                        pos++;
+                        continue;
+                }
+                pos += rc;
+                sent += rc;
+        }
+        return sent == 0 && n > 0 ? -1 : sent;
+#else
+        int i, sent = 0;
+
+        for (i = 0; i < n; i++) {
+                if (udp_sendv(s, vectors[i], counts[i]) >= 0) {
+                        sent++;
+                }
+        }
+        return sent == 0 && n > 0 ? -1 : sent;
+#endif
+}
+
 static int udp_do_recv(socket_udp * s, char *buffer, int buflen, int flags)
 {
         /* Reads data into the buffer, returning the number of bytes read.   */
@@ -1092,6 +1207,103 @@ int udp_recv(socket_udp * s, char *buffer, int buflen)
         return udp_do_recv(s, buffer, buflen, 0);
 }
 
+/**
+ * udp_recv_batch:
+ * @s: UDP session.
+ * @buffers: @n buffers to read datagrams into.
+ * @buflen: length of each buffer in @buffers.
+ * @lens: receives the length of each datagram read.
+ * @n: maximum number of datagrams to read.
+ *
+ * Reads the datagrams already queued on the socket, up to @n of them,
+ * without blocking: with a single recvmmsg() where available, one
+ * recvfrom() per datagram otherwise.
+ *
+ * Return value: number of datagrams read, 0 if none was available.
+ **/
+int udp_recv_batch(socket_udp * s, char **buffers, int buflen, int *lens, int n)
+{
+        return udp_recv_batch_from(s, buffers, buflen, lens, NULL, n);
+}
+
+/**
+ * udp_recv_batch_from:
+ * @s: UDP session.
+ * @buffers: @n buffers to read datagrams into.
+ * @buflen: length of each buffer in @buffers.
+ * @lens: receives the length of each datagram read.
+ * @addrs: receives the sender of each datagram, may be NULL. The family
+ * is AF_UNSPEC where the platform does not tell.
+ * @n: maximum number of datagrams to read.
+ *
+ * udp_recv_batch() that also reports where the datagrams came from.
+ *
+ * Return value: number of datagrams read, 0 if none was available.
+ **/
+int udp_recv_batch_from(socket_udp * s, char **buffers, int buflen, int *lens,
+                        struct sockaddr_storage *addrs, int n)
+{
+#if defined HAVE_RECVMMSG && !defined WIN32
+        struct mmsghdr msgs[UDP_MAX_BATCH];
+        struct iovec vectors[UDP_MAX_BATCH];
+        int i, rc;
+
+        if (n > UDP_MAX_BATCH) {
+                n = UDP_MAX_BATCH;
+        }
+        for (i = 0; i < n; i++) {
+                vectors[i].iov_base = buffers[i];
+                vectors[i].iov_len = buflen;
+                msgs[i].msg_hdr.msg_name = addrs != NULL ? &addrs[i] : 0;
+                msgs[i].msg_hdr.msg_namelen = addrs != NULL ? sizeof(addrs[i]) : 0;
+                msgs[i].msg_hdr.msg_iov = &vectors[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_control = 0;
+                msgs[i].msg_hdr.msg_controllen = 0;
+                msgs[i].msg_hdr.msg_flags = 0;
+        }
+        rc = recvmmsg(s->fd, msgs, n, MSG_DONTWAIT, NULL);
+        if (rc < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                        socket_error("recvmmsg");
+                }
+                return 0;
+        }
+        for (i = 0; i < rc; i++) {
+                lens[i] = msgs[i].msg_len;
+        }
+        return rc;
+#elif !defined WIN32
+        socklen_t addrlen;
+        int i, len;
+
+        for (i = 0; i < n; i++) {
+                addrlen = sizeof(struct sockaddr_storage);
+                len = recvfrom(s->fd, buffers[i], buflen, MSG_DONTWAIT,
+                               addrs != NULL ? (struct sockaddr *) &addrs[i] : 0,
+                               addrs != NULL ? &addrlen : 0);
+                if (len <= 0) {
+                        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                            && errno != ECONNREFUSED) {
+                                socket_error("recvfrom");
+                        }
+                        break;
+                }
+                lens[i] = len;
+        }
+        return i;
+#else
+        if (n < 1) {
+                return 0;
+        }
+        lens[0] = udp_recv(s, buffers[0], buflen);
+        if (addrs != NULL) {
+                addrs[0].ss_family = AF_UNSPEC;
+        }
+        return lens[0] > 0 ? 1 : 0;
+#endif
+}
+
 #ifndef WIN32
 int udp_recvv(socket_udp * s, struct msghdr *m)
 {
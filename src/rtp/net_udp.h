@@ -47,6 +47,9 @@
 
 typedef struct _socket_udp socket_udp; 
 
+/* Maximum number of datagrams udp_sendv_batch and udp_recv_batch move at once */
+#define UDP_MAX_BATCH 64
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -59,12 +62,18 @@ void        udp_exit(socket_udp *s);
 int         udp_peek(socket_udp *s, char *buffer, int buflen);
 int         udp_recv(socket_udp *s, char *buffer, int buflen);
 int         udp_send(socket_udp *s, char *buffer, int buflen);
+int         udp_sendto(socket_udp *s, char *buffer, int buflen, const struct sockaddr_storage *addr);
 
+int         udp_recv_batch(socket_udp *s, char **buffers, int buflen, int *lens, int n);
+int         udp_recv_batch_from(socket_udp *s, char **buffers, int buflen, int *lens,
+                                struct sockaddr_storage *addrs, int n);
 int         udp_recvv(socket_udp *s, struct msghdr *m);
 #ifdef WIN32
 int         udp_sendv(socket_udp *s, LPWSABUF vector, int count);
+int         udp_sendv_batch(socket_udp *s, LPWSABUF *vectors, int *counts, int n);
 #else
 int         udp_sendv(socket_udp *s, struct iovec *vector, int count);
+int         udp_sendv_batch(socket_udp *s, struct iovec **vectors, int *counts, int n);
 #endif
 
 const char *udp_host_addr(socket_udp *s);
@@ -66,270 +66,656 @@
 #include "rtp/rtp_callback.h"
 #include "rtp/ptime.h"
 #include "rtp/pbuf.h"
+#include "rtp/fec.h"
 //#include "rtp/decoders.h"
 
 #define PBUF_MAGIC	0xcafebabe
 
+/* Frames buffered at most, the oldest one is given up to make room        */
+#define PBUF_MAX_FRAMES	32
+/* Packet slots of a frame, doubled when its seqnos span more (up to max)  */
+#define PBUF_MIN_SLOTS	64
+#define PBUF_MAX_SLOTS	16384
+/* Adaptive playout delay in interarrival jitters, see pbuf_update_jitter() */
+#define PBUF_JITTER_FACTOR	4.0
+/* Retransmission requests per frame, and seconds between them            */
+#define PBUF_MAX_NACKS		3
+#define PBUF_NACK_INTERVAL	0.020
+/* Seconds a hole waits for reordered packets before it is requested, at */
+/* least: half the jitter otherwise                                      */
+#define PBUF_REORDER_MIN	0.003
+/* FEC packets waiting for all but one of their packets, the oldest is dropped */
+#define PBUF_MAX_FEC		32
+
 extern long frame_begin[2];
 
 struct pbuf_node {
-        struct pbuf_node *nxt;
-        struct pbuf_node *prv;
         uint32_t rtp_timestamp; /* RTP timestamp for the frame           */
         struct timeval arrival_time;    /* Arrival time of first packet in frame */
         struct timeval playout_time;    /* Playout time for the frame            */
         struct timeval deletion_time;   /* Time after which will be frame deleted (no matter if decoded or not) */
-        struct coded_data *cdata;       /*                                       */
+        struct coded_data *cdata;       /* Packets linked by link_frame, in seqno order */
+        struct coded_data *slots;       /* Packets indexed by seqno % capacity   */
+        uint64_t *present;              /* Bitmap of the used slots              */
+        uint32_t capacity;
+        uint16_t min_seq;               /* Lowest and highest seqno received     */
+        uint16_t max_seq;
+        uint16_t mbit_seq;              /* Seqno of the packet with the M bit    */
+        int received;           /* Packets in slots                      */
+        int complete;           /* M bit seen and no seqno missing       */
         int decoded;            /* Non-zero if we've decoded this frame  */
         int mbit;               /* determines if mbit of frame had been seen */
+        int nacks;              /* Retransmission requests so far        */
+        struct timeval nack_time;       /* Time of the last request      */
+        int gap;                /* A hole was seen, at gap_time          */
+        struct timeval gap_time;
         uint32_t magic;         /* For debugging                         */
 };
 
+struct pbuf_fec {
+        rtp_packet *pkt;
+        struct fec_xor_header hdr;
+};
+
+/*
+ * Only used by the thread receiving the session. Frames live in a ring
+ * sorted by RTP timestamp, so the frame of a packet is the newest one or
+ * found by binary search, and packets are stored by seqno in their frame,
+ * so reordering costs nothing and holes are counted exactly.
+ */
 struct pbuf {
-        struct pbuf_node *frst;
-        struct pbuf_node *last;
+        struct pbuf_node *ring[PBUF_MAX_FRAMES];  /* ring[(head + i) % PBUF_MAX_FRAMES] */
+        int head;
+        int count;
+        struct pbuf_node *spare[PBUF_MAX_FRAMES];
+        int spare_count;
+        struct pbuf_node frames[PBUF_MAX_FRAMES];
+        /* Last frame given up, older packets are late */
+        uint32_t last_timestamp;
+        uint16_t last_mbit_seq;
+        int last_valid;
+        int last_mbit;
         double playout_delay;
         double deletion_delay;
+        double reorder_window;  /* See pbuf_get_nacks() */
+        /* Bounds of the adaptive delay, see pbuf_set_adaptive_delay() */
+        int adaptive;
+        double min_delay;
+        double max_delay;
+        struct pbuf_fec fec[PBUF_MAX_FEC];      /* Oldest first */
+        int fec_count;
+        struct pbuf_stats stats;
 };
 
-static void free_cdata(struct coded_data *head);
 /*********************************************************************************/
 
+static int ts_before(uint32_t a, uint32_t b)
+{
+        return (int32_t) (a - b) < 0;
+}
+
+static int seq_before(uint16_t a, uint16_t b)
+{
+        return (int16_t) (a - b) < 0;
+}
+
+static struct pbuf_node *frame_at(struct pbuf *playout_buf, int i)
+{
+        return playout_buf->ring[(playout_buf->head + i) % PBUF_MAX_FRAMES];
+}
+
+static int slot_present(struct pbuf_node *frame, uint16_t seq)
+{
+        uint32_t idx = seq & (frame->capacity - 1);
+
+        return (frame->present[idx / 64] >> (idx % 64)) & 1;
+}
+
+static int frame_has_seq(struct pbuf_node *frame, uint16_t seq)
+{
+        if (seq_before(seq, frame->min_seq) || seq_before(frame->max_seq, seq)) {
+                return FALSE;
+        }
+        return slot_present(frame, seq);
+}
+
 static void pbuf_validate(struct pbuf *playout_buf)
 {
         /* Run through the entire playout buffer, checking pointers, etc.  */
         /* Only used in debugging mode, since it's a lot of overhead [csp] */
 #ifdef NDEF
-        struct pbuf_node *cpb, *ppb;
-        struct coded_data *ccd, *pcd;
-
-        cpb = playout_buf->frst;
-        ppb = NULL;
-        while (cpb != NULL) {
-                assert(cpb->magic == PBUF_MAGIC);
-                assert(cpb->prv == ppb);
-                if (cpb->prv != NULL) {
-                        assert(cpb->prv->nxt == cpb);
-                        /* stored in RTP timestamp order */
-                        assert(cpb->rtp_timestamp > ppb->rtp_timestamp);
-                        /* stored in playout time order  */
-                        /* TODO: eventually check why is this assert always failng */
-                        // assert(tv_gt(cpb->ptime, ppb->ptime));  
+        struct pbuf_node *curr, *prev = NULL;
+        int i;
+
+        assert(playout_buf->count + playout_buf->spare_count == PBUF_MAX_FRAMES);
+        for (i = 0; i < playout_buf->count; i++) {
+                curr = frame_at(playout_buf, i);
+                assert(curr->magic == PBUF_MAGIC);
+                assert(curr->received > 0);
+                /* stored in RTP timestamp order */
+                assert(prev == NULL || ts_before(prev->rtp_timestamp, curr->rtp_timestamp));
+                assert((uint16_t) (curr->max_seq - curr->min_seq) < curr->capacity);
+                prev = curr;
+        }
+#else
+        UNUSED(playout_buf);
+#endif
+}
+
+/*
+ * Seqno the first packet of a frame must have: the one after the M bit of
+ * the frame before it, when known, else the lowest one received.
+ */
+static uint16_t frame_first_seq(struct pbuf *playout_buf, int i)
+{
+        struct pbuf_node *frame = frame_at(playout_buf, i);
+        struct pbuf_node *prev;
+
+        if (i > 0) {
+                prev = frame_at(playout_buf, i - 1);
+                if (prev->mbit && seq_before(prev->mbit_seq, frame->min_seq)) {
+                        return prev->mbit_seq + 1;
+                }
+        } else if (playout_buf->last_mbit
+                        && seq_before(playout_buf->last_mbit_seq, frame->min_seq)) {
+                return playout_buf->last_mbit_seq + 1;
+        }
+        return frame->min_seq;
+}
+
+/* Returns TRUE if frame i just became complete */
+static int update_complete(struct pbuf *playout_buf, int i)
+{
+        struct pbuf_node *frame = frame_at(playout_buf, i);
+        int was_complete = frame->complete;
+        uint16_t first;
+
+        frame->complete = FALSE;
+        if (frame->mbit && frame->max_seq == frame->mbit_seq) {
+                first = frame_first_seq(playout_buf, i);
+                frame->complete =
+                        frame->received == (uint16_t) (frame->mbit_seq - first) + 1;
+        }
+        return frame->complete && !was_complete;
+}
+
+static int frame_missing(struct pbuf *playout_buf, int i)
+{
+        struct pbuf_node *frame = frame_at(playout_buf, i);
+        uint16_t last = frame->mbit ? frame->mbit_seq : frame->max_seq;
+        int missing;
+
+        /* Packets past the M bit are counted as received, not expected */
+        missing = (uint16_t) (last - frame_first_seq(playout_buf, i)) + 1 - frame->received;
+        return missing > 0 ? missing : 0;
+}
+
+static int grow_frame(struct pbuf_node *frame, uint32_t span)
+{
+        uint32_t capacity = frame->capacity;
+        struct coded_data *slots;
+        uint64_t *present;
+        uint32_t w, idx;
+        int bit;
+
+        while (capacity < span) {
+                capacity *= 2;
+        }
+        if (capacity > PBUF_MAX_SLOTS) {
+                return FALSE;
+        }
+
+        slots = malloc(capacity * sizeof(struct coded_data));
+        present = calloc(capacity / 64, sizeof(uint64_t));
+        if (slots == NULL || present == NULL) {
+                free(slots);
+                free(present);
+                return FALSE;
+        }
+
+        for (w = 0; w < frame->capacity / 64; w++) {
+                while (frame->present[w] != 0) {
+                        bit = __builtin_ctzll(frame->present[w]);
+                        frame->present[w] &= frame->present[w] - 1;
+                        idx = frame->slots[w * 64 + bit].seqno & (capacity - 1);
+                        slots[idx] = frame->slots[w * 64 + bit];
+                        present[idx / 64] |= 1ULL << (idx % 64);
+                }
+        }
+
+        free(frame->slots);
+        free(frame->present);
+        frame->slots = slots;
+        frame->present = present;
+        frame->capacity = capacity;
+        return TRUE;
+}
+
+static void release_packets(struct pbuf_node *frame)
+{
+        uint32_t w;
+        int bit;
+
+        for (w = 0; w < frame->capacity / 64; w++) {
+                while (frame->present[w] != 0) {
+                        bit = __builtin_ctzll(frame->present[w]);
+                        frame->present[w] &= frame->present[w] - 1;
+                        rtp_free_packet(frame->slots[w * 64 + bit].data);
+                }
+        }
+        frame->received = 0;
+        frame->cdata = NULL;
+}
+
+/* Gives up the oldest frame, accounting for its holes if never used */
+static void release_first(struct pbuf *playout_buf)
+{
+        struct pbuf_node *frame = frame_at(playout_buf, 0);
+
+        if (!frame->complete && !frame->decoded) {
+                playout_buf->stats.incomplete_frames++;
+                playout_buf->stats.lost += frame_missing(playout_buf, 0);
+        }
+
+        playout_buf->last_timestamp = frame->rtp_timestamp;
+        playout_buf->last_valid = TRUE;
+        playout_buf->last_mbit = frame->mbit;
+        playout_buf->last_mbit_seq = frame->mbit_seq;
+
+        release_packets(frame);
+        playout_buf->head = (playout_buf->head + 1) % PBUF_MAX_FRAMES;
+        playout_buf->count--;
+        playout_buf->spare[playout_buf->spare_count++] = frame;
+}
+
+/* Releases frames up to and including frame i */
+static void release_until(struct pbuf *playout_buf, int i)
+{
+        while (i-- >= 0) {
+                release_first(playout_buf);
+        }
+}
+
+/*
+ * Position of the frame with timestamp ts, or the position where it must
+ * be inserted if found is FALSE.
+ */
+static int find_frame(struct pbuf *playout_buf, uint32_t ts, int *found)
+{
+        int lo = 0, hi = playout_buf->count, mid;
+        uint32_t mid_ts;
+
+        *found = FALSE;
+        if (hi == 0) {
+                return 0;
+        }
+
+        /* Nearly every packet belongs to the newest frame or a new one */
+        mid_ts = frame_at(playout_buf, hi - 1)->rtp_timestamp;
+        if (mid_ts == ts) {
+                *found = TRUE;
+                return hi - 1;
+        }
+        if (ts_before(mid_ts, ts)) {
+                return hi;
+        }
+
+        hi--;
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                mid_ts = frame_at(playout_buf, mid)->rtp_timestamp;
+                if (mid_ts == ts) {
+                        *found = TRUE;
+                        return mid;
                 }
-                if (cpb->nxt != NULL) {
-                        assert(cpb->nxt->prv == cpb);
+                if (ts_before(mid_ts, ts)) {
+                        lo = mid + 1;
                 } else {
-                        assert(cpb = playout_buf->last);
+                        hi = mid;
                 }
-                if (cpb->cdata != NULL) {
-                        /* We have coded data... check all the pointers on that list too */
-                        ccd = cpb->cdata;
-                        pcd = NULL;
-                        while (ccd != NULL) {
-                                assert(ccd->prv == pcd);
-                                if (ccd->prv != NULL) {
-                                        assert(ccd->prv->nxt == ccd);
-                                        /* list is descending - cant really check this now */
-                                        //assert(ccd->seqno < pcd->seqno); 
-                                        assert(ccd->data != NULL);
-                                }
-                                if (ccd->nxt != NULL) {
-                                        assert(ccd->nxt->prv == ccd);
-                                }
-                                pcd = ccd;
-                                ccd = ccd->nxt;
-                        }
+        }
+        return lo;
+}
+
+/* Returns the position of the new frame, -1 if the packet must be dropped */
+static int insert_frame(struct pbuf *playout_buf, int pos, rtp_packet * pkt)
+{
+        struct pbuf_node *frame;
+        int i;
+
+        if (playout_buf->count == PBUF_MAX_FRAMES) {
+                if (pos == 0) {
+                        return -1;
                 }
-                ppb = cpb;
-                cpb = cpb->nxt;
+                release_first(playout_buf);
+                pos--;
         }
-#else
-        UNUSED(playout_buf);
-#endif
+
+        frame = playout_buf->spare[playout_buf->spare_count - 1];
+        if (frame->capacity == 0) {
+                frame->slots = malloc(PBUF_MIN_SLOTS * sizeof(struct coded_data));
+                frame->present = calloc(PBUF_MIN_SLOTS / 64, sizeof(uint64_t));
+                if (frame->slots == NULL || frame->present == NULL) {
+                        free(frame->slots);
+                        free(frame->present);
+                        frame->slots = NULL;
+                        frame->present = NULL;
+                        return -1;
+                }
+                frame->capacity = PBUF_MIN_SLOTS;
+        }
+        playout_buf->spare_count--;
+
+        perf_record(UVP_CREATEPBUF, pkt->ts);
+
+        frame->magic = PBUF_MAGIC;
+        frame->cdata = NULL;
+        frame->decoded = 0;
+        frame->complete = FALSE;
+        frame->mbit = 0;
+        frame->nacks = 0;
+        frame->gap = FALSE;
+        frame->received = 0;
+        frame->rtp_timestamp = pkt->ts;
+        gettimeofday(&(frame->arrival_time), NULL);
+        frame->playout_time = frame->arrival_time;
+        frame->deletion_time = frame->arrival_time;
+        tv_add(&(frame->playout_time), playout_buf->playout_delay);
+        tv_add(&(frame->deletion_time), playout_buf->deletion_delay);
+
+        for (i = playout_buf->count; i > pos; i--) {
+                playout_buf->ring[(playout_buf->head + i) % PBUF_MAX_FRAMES] =
+                        frame_at(playout_buf, i - 1);
+        }
+        playout_buf->ring[(playout_buf->head + pos) % PBUF_MAX_FRAMES] = frame;
+        playout_buf->count++;
+
+        return pos;
+}
+
+/* Takes pkt, freeing it if it cannot be stored */
+static int store_packet(struct pbuf *playout_buf, struct pbuf_node *frame, rtp_packet * pkt)
+{
+        uint16_t seq = pkt->seq;
+        uint16_t lo, hi;
+        uint32_t idx;
+
+        if (frame->received == 0) {
+                frame->min_seq = frame->max_seq = seq;
+        } else {
+                lo = seq_before(seq, frame->min_seq) ? seq : frame->min_seq;
+                hi = seq_before(frame->max_seq, seq) ? seq : frame->max_seq;
+                if ((uint32_t) (uint16_t) (hi - lo) + 1 > frame->capacity
+                                && !grow_frame(frame, (uint32_t) (uint16_t) (hi - lo) + 1)) {
+                        debug_msg("Frame too big for the playout buffer (RTP TS=%u)\n",
+                                        frame->rtp_timestamp);
+                        rtp_free_packet(pkt);
+                        return FALSE;
+                }
+                if (slot_present(frame, seq)) {
+                        playout_buf->stats.duplicates++;
+                        rtp_free_packet(pkt);
+                        return FALSE;
+                }
+                frame->min_seq = lo;
+                frame->max_seq = hi;
+        }
+
+        idx = seq & (frame->capacity - 1);
+        frame->slots[idx].seqno = seq;
+        frame->slots[idx].data = pkt;
+        frame->present[idx / 64] |= 1ULL << (idx % 64);
+        frame->received++;
+        playout_buf->stats.received++;
+
+        if (pkt->m) {
+                frame->mbit = 1;
+                frame->mbit_seq = seq;
+        }
+        return TRUE;
+}
+
+/* Chains the packets of a frame in seqno order for the decoders */
+static void link_frame(struct pbuf_node *frame)
+{
+        struct coded_data *head = NULL, *tail = NULL, *curr;
+        uint16_t seq = frame->min_seq;
+        uint16_t span = frame->max_seq - frame->min_seq;
+        uint32_t n;
+
+        for (n = 0; n <= span; n++, seq++) {
+                if (!slot_present(frame, seq)) {
+                        continue;
+                }
+                curr = &frame->slots[seq & (frame->capacity - 1)];
+                curr->nxt = NULL;
+                curr->prv = tail;
+                if (tail != NULL) {
+                        tail->nxt = curr;
+                } else {
+                        head = curr;
+                }
+                tail = curr;
+        }
+        frame->cdata = head;
 }
 
 struct pbuf *pbuf_init(void)
 {
         struct pbuf *playout_buf = NULL;
+        int i;
 
-        playout_buf = malloc(sizeof(struct pbuf));
+        playout_buf = calloc(1, sizeof(struct pbuf));
         if (playout_buf != NULL) {
-                playout_buf->frst = NULL;
-                playout_buf->last = NULL;
-                /* Playout delay... should really be adaptive, based on the */
-                /* jitter, but we use a (conservative) fixed 32ms delay for */
-                /* now (2 video frames at 60fps).                           */
-                playout_buf->deletion_delay =
-                        playout_buf->playout_delay = 0.032;
+                for (i = 0; i < PBUF_MAX_FRAMES; i++) {
+                        playout_buf->spare[i] = &playout_buf->frames[i];
+                }
+                playout_buf->spare_count = PBUF_MAX_FRAMES;
+                /* A (conservative) fixed 32ms delay (2 video frames at  */
+                /* 60fps) unless pbuf_set_adaptive_delay() is called.     */
+                /* Frames are given up twice as late, see pbuf_remove(). */
+                playout_buf->playout_delay = 0.032;
+                playout_buf->deletion_delay = 2 * playout_buf->playout_delay;
+                playout_buf->reorder_window = PBUF_REORDER_MIN;
         } else {
                 debug_msg("Failed to allocate memory for playout buffer\n");
         }
         return playout_buf;
 }
 
-static void add_coded_unit(struct pbuf_node *node, rtp_packet * pkt)
+static int insert_packet(struct pbuf *playout_buf, rtp_packet * pkt)
 {
-    /* Add "pkt" to the frame represented by "node". The "node" has    */
-    /* previously been created, and has some coded data already...     */
+        int pos, found, completed;
 
-    /* New arrivals are added at the head of the list, which is stored */
-    /* in descending order of packets as they arrive (NOT necessarily  */
-    /* descending sequence number order, as the network might reorder) */
+        if (playout_buf->last_valid
+                        && !ts_before(playout_buf->last_timestamp, pkt->ts)) {
+                /* Its frame was already played out or given up */
+                if (pkt->m) {
+                        debug_msg("Oops... dropped packet with M bit set\n");
+                }
+                playout_buf->stats.late++;
+                rtp_free_packet(pkt);
+                return FALSE;
+        }
 
-    struct coded_data *tmp, *curr, *prv;
+        pos = find_frame(playout_buf, pkt->ts, &found);
+        if (!found && (pos = insert_frame(playout_buf, pos, pkt)) < 0) {
+                playout_buf->stats.late++;
+                rtp_free_packet(pkt);
+                return FALSE;
+        }
 
-    assert(node->rtp_timestamp == pkt->ts);
-    assert(node->cdata != NULL);
+        if (!store_packet(playout_buf, frame_at(playout_buf, pos), pkt)) {
+                return FALSE;
+        }
 
-    tmp = malloc(sizeof(struct coded_data));
-    if (tmp == NULL) { 
-        /* this is bad, out of memory, drop the packet... */
-        free(pkt);
-        return;
-    }
-    
-    tmp->seqno = pkt->seq;
-    tmp->data = pkt;
-    node->mbit |= pkt->m;
-    if((int16_t)(tmp->seqno - node->cdata->seqno) > 0){
-        tmp->prv = NULL;
-        tmp->nxt = node->cdata;
-        node->cdata->prv = tmp;
-        node->cdata = tmp;
-    } else {
-        curr = node->cdata;
-        if (curr == NULL){
-             /* this is bad, out of memory, drop the packet... */
-            free(pkt);
-            free_cdata(tmp);
-        } else {
-            while (curr != NULL &&  ((int16_t)(tmp->seqno - curr->seqno) < 0)){
-                prv = curr;
-                curr = curr->nxt;
-            }
-            if (curr == NULL) {
-                tmp->nxt = NULL;
-                tmp->prv = prv;
-                prv->nxt = tmp;
-            }else if ((int16_t)(tmp->seqno - curr->seqno) > 0){
-                tmp->nxt = curr;
-                tmp->prv = curr->prv;
-                tmp->prv->nxt = tmp;
-                curr->prv = tmp;
-            } else {
-                /* this is bad, something went terribly wrong... */
-                free(pkt);
-                free_cdata(tmp);
-            }
+        /* The next frame starts after our M bit */
+        completed = update_complete(playout_buf, pos);
+        if (pos + 1 < playout_buf->count) {
+                completed |= update_complete(playout_buf, pos + 1);
         }
-    }  
+        return completed;
 }
 
+static void remove_fec(struct pbuf *playout_buf, int i)
+{
+        playout_buf->fec_count--;
+        memmove(&playout_buf->fec[i], &playout_buf->fec[i + 1],
+                (playout_buf->fec_count - i) * sizeof(struct pbuf_fec));
+}
 
-static struct pbuf_node *create_new_pnode(rtp_packet * pkt, double playout_delay,
-                double deletion_delay)
+/*
+ * Rebuilds the packet a FEC packet protects when it is the only one
+ * missing, reusing the FEC packet for it. The packets of a FEC packet
+ * share its timestamp, so they are all looked up in a single frame.
+ * Returns FALSE once the FEC packet is no longer held by fec.
+ */
+static int recover_packet(struct pbuf *playout_buf, struct pbuf_fec *fec, int *completed)
 {
-        struct pbuf_node *tmp;
+        rtp_packet *pkt = fec->pkt;
+        struct fec_xor_header *hdr = &fec->hdr;
+        struct pbuf_node *frame = NULL;
+        rtp_packet *curr;
+        uint8_t *payload = (uint8_t *) pkt->data + FEC_XOR_HDR_LEN;
+        uint8_t pxcc = hdr->pxcc, mpt = hdr->mpt;
+        uint32_t ts = hdr->ts;
+        uint16_t len = hdr->len;
+        uint16_t seq, lost = 0;
+        int d, pos, found, missing = 0;
 
-        perf_record(UVP_CREATEPBUF, pkt->ts);
+        if (playout_buf->last_valid && !ts_before(playout_buf->last_timestamp, pkt->ts)) {
+                rtp_free_packet(pkt);
+                return FALSE;
+        }
 
-        tmp = malloc(sizeof(struct pbuf_node));
-        if (tmp != NULL) {
-            tmp->magic = PBUF_MAGIC;
-            tmp->nxt = NULL;
-            tmp->prv = NULL;
-            tmp->decoded = 0;
-            tmp->rtp_timestamp = pkt->ts;
-            tmp->mbit = pkt->m;
-            gettimeofday(&(tmp->arrival_time), NULL);
-            gettimeofday(&(tmp->playout_time), NULL);
-            tmp->deletion_time = tmp->playout_time;
-            tv_add(&(tmp->playout_time), playout_delay);
-            tv_add(&(tmp->deletion_time), deletion_delay);
-
-            tmp->cdata = malloc(sizeof(struct coded_data));
-            if (tmp->cdata != NULL) {
-                    tmp->cdata->nxt = NULL;
-                    tmp->cdata->prv = NULL;
-                    tmp->cdata->seqno = pkt->seq;
-                    tmp->cdata->data = pkt;
-            } else {
-                    free(pkt);
-                    free(tmp);
-                    return NULL;
-            }
-        } else {
-                free(pkt);
+        pos = find_frame(playout_buf, pkt->ts, &found);
+        if (found) {
+                frame = frame_at(playout_buf, pos);
+        }
+        for (d = 0; d < FEC_XOR_MAX_SPAN; d++) {
+                seq = hdr->sn_base + d;
+                if (fec_xor_covers(hdr, seq) && (frame == NULL || !frame_has_seq(frame, seq))) {
+                        lost = seq;
+                        if (++missing > 1) {
+                                return TRUE;
+                        }
+                }
         }
-        return tmp;
+        if (missing == 0) {
+                rtp_free_packet(pkt);
+                return FALSE;
+        }
+
+        for (d = 0; d < FEC_XOR_MAX_SPAN && frame != NULL; d++) {
+                seq = hdr->sn_base + d;
+                if (seq == lost || !fec_xor_covers(hdr, seq)) {
+                        continue;
+                }
+                curr = frame->slots[seq & (frame->capacity - 1)].data;
+                if (curr->cc != 0 || curr->x || curr->data_len > hdr->prot_len) {
+                        rtp_free_packet(pkt);
+                        return FALSE;
+                }
+                pxcc ^= curr->p << 5;
+                mpt ^= (curr->m << 7) | curr->pt;
+                ts ^= curr->ts;
+                len ^= curr->data_len;
+                fec_xor(payload, (uint8_t *) curr->data, curr->data_len);
+        }
+        if ((pxcc & 0x1f) != 0 || len > hdr->prot_len) {
+                rtp_free_packet(pkt);
+                return FALSE;
+        }
+
+        pkt->v = 2;
+        pkt->p = (pxcc >> 5) & 1;
+        pkt->x = 0;
+        pkt->cc = 0;
+        pkt->m = mpt >> 7;
+        pkt->pt = mpt & 0x7f;
+        pkt->seq = lost;
+        pkt->ts = ts;
+        pkt->ssrc = pkt->csrc[0];
+        pkt->csrc = NULL;
+        pkt->extn = NULL;
+        pkt->extn_len = 0;
+        pkt->extn_type = 0;
+        pkt->data = (char *) payload;
+        pkt->data_len = len;
+
+        playout_buf->stats.recovered++;
+        *completed |= insert_packet(playout_buf, pkt);
+        return FALSE;
+}
+
+/* Uses the FEC packets held, until none of them rebuilds a packet */
+static int recover_packets(struct pbuf *playout_buf)
+{
+        uint32_t recovered;
+        int i, completed = FALSE;
+
+        do {
+                recovered = playout_buf->stats.recovered;
+                for (i = 0; i < playout_buf->fec_count;) {
+                        if (recover_packet(playout_buf, &playout_buf->fec[i], &completed)) {
+                                i++;
+                        } else {
+                                remove_fec(playout_buf, i);
+                        }
+                }
+        } while (recovered != playout_buf->stats.recovered);
+
+        return completed;
 }
 
-void pbuf_insert(struct pbuf *playout_buf, rtp_packet * pkt)
+int pbuf_insert(struct pbuf *playout_buf, rtp_packet * pkt)
 {
-        struct pbuf_node *tmp;
-		struct pbuf_node *curr;
+        uint16_t seq = pkt->seq;
+        int i, completed;
 
         pbuf_validate(playout_buf);
 
-        if (playout_buf->frst == NULL && playout_buf->last == NULL) {
-                /* playout buffer is empty - add new frame */
-                playout_buf->frst = create_new_pnode(pkt, playout_buf->playout_delay,
-                                playout_buf->deletion_delay);
-                playout_buf->last = playout_buf->frst;
-                return;
+        completed = insert_packet(playout_buf, pkt);
+        /* The packet may leave a FEC packet a single one to rebuild */
+        for (i = 0; i < playout_buf->fec_count; i++) {
+                if (fec_xor_covers(&playout_buf->fec[i].hdr, seq)) {
+                        completed |= recover_packets(playout_buf);
+                        break;
+                }
         }
 
-        if (playout_buf->last->rtp_timestamp < pkt->ts) {
-			/* Packet belongs to a new frame... */
-            tmp = create_new_pnode(pkt, playout_buf->playout_delay, playout_buf->deletion_delay);
-			playout_buf->last->nxt = tmp;
-            tmp->prv = playout_buf->last;
-            playout_buf->last = tmp;
-        } else {
-			/* Packet belongs to a previous frame... */
-			curr = playout_buf->last;
-			while(curr != playout_buf->frst && curr->rtp_timestamp > pkt->ts){
-				curr = curr->prv;
-			}
-			
-			if (curr->rtp_timestamp == pkt->ts) {
-				/* Packet belongs to a previous existing frame... */
-				add_coded_unit(curr, pkt);
-			} else if (curr->rtp_timestamp < pkt->ts){
-				/* Packet belongs to a new previous frame */
-				tmp = create_new_pnode(pkt, playout_buf->playout_delay,playout_buf->deletion_delay);
-                tmp->nxt = curr->nxt;
-                tmp->prv = curr;
-                curr->nxt->prv = tmp;
-                curr->nxt = tmp;
-            } else if (curr == playout_buf->frst) {
-                tmp = create_new_pnode(pkt, playout_buf->playout_delay,playout_buf->deletion_delay);
-                tmp->nxt = playout_buf->frst;
-                curr->prv = tmp;
-                playout_buf->frst = tmp;
-
-			} else {
-				
-				if (pkt->m) {
-					debug_msg
-						("Oops... dropped packet with M bit set\n");
-				}
-				free(pkt);
-			}
-        }
         pbuf_validate(playout_buf);
+        return completed;
 }
 
-static void free_cdata(struct coded_data *head)
+int pbuf_insert_fec(struct pbuf *playout_buf, rtp_packet * pkt)
 {
-        struct coded_data *tmp;
+        struct pbuf_fec *fec;
+        uint32_t recovered = playout_buf->stats.recovered;
+        int completed = FALSE;
+
+        pbuf_validate(playout_buf);
 
-        while (head != NULL) {
-                free(head->data);
-                tmp = head;
-                head = head->nxt;
-                free(tmp);
+        if (playout_buf->fec_count == PBUF_MAX_FEC) {
+                rtp_free_packet(playout_buf->fec[0].pkt);
+                remove_fec(playout_buf, 0);
         }
+        fec = &playout_buf->fec[playout_buf->fec_count];
+        if (pkt->cc != 1 || !fec_xor_parse((uint8_t *) pkt->data, pkt->data_len, &fec->hdr)) {
+                rtp_free_packet(pkt);
+                return FALSE;
+        }
+        fec->pkt = pkt;
+
+        if (recover_packet(playout_buf, fec, &completed)) {
+                playout_buf->fec_count++;
+        } else if (recovered != playout_buf->stats.recovered && playout_buf->fec_count > 0) {
+                /* What it rebuilt may help the ones already held */
+                completed |= recover_packets(playout_buf);
+        }
+
+        pbuf_validate(playout_buf);
+        return completed;
 }
 
 void pbuf_remove(struct pbuf *playout_buf, struct timeval curr_time)
@@ -338,123 +724,233 @@ void pbuf_remove(struct pbuf *playout_buf, struct timeval curr_time)
     /* time from the playout buffer. Incomplete frames that have passed */
     /* their playout time are also discarded.                           */
 
-    struct pbuf_node *curr, *temp;
-    
     pbuf_validate(playout_buf);
-    
-    curr = playout_buf->frst;
-    while (curr != NULL) {
-        temp = curr->nxt;
-        if (tv_gt(curr_time, curr->deletion_time)) {
-            if (curr == playout_buf->frst) {
-                playout_buf->frst = curr->nxt;
-            }
-            if (curr == playout_buf->last) {
-                playout_buf->last = curr->prv;
-            }
-            if (curr->nxt != NULL) {
-                curr->nxt->prv = curr->prv;
-            }
-            if (curr->prv != NULL) {
-                curr->prv->nxt = curr->nxt;
-            }
-            free_cdata(curr->cdata);
-            free(curr);
-        } else {
-            /* The playout buffer is stored in order, so once  */
-            /* we see one packet that has not yet reached it's */
-            /* playout time, we can be sure none of the others */
-            /* will have done so...                            */
-            break;
-        }
-        curr = temp;
+
+    /* The playout buffer is stored in order, so once  */
+    /* we see one packet that has not yet reached it's */
+    /* playout time, we can be sure none of the others */
+    /* will have done so...                            */
+    while (playout_buf->count > 0
+            && tv_gt(curr_time, frame_at(playout_buf, 0)->deletion_time)) {
+        release_first(playout_buf);
     }
 
     pbuf_validate(playout_buf);
-    return;
 }
 
 void pbuf_remove_first(struct pbuf *playout_buf)
 {
-    /* Remove first previously decoded frame  */
-    
-    struct pbuf_node *curr;
-
-	if (playout_buf->frst->decoded) {
-		pbuf_validate(playout_buf);
+    /* Remove the first decoded frame, together with the frames before  */
+    /* it that were skipped because they never got complete.           */
+    int i;
 
-		curr = playout_buf->frst;
-		if (curr->nxt == NULL){
-			playout_buf->frst = playout_buf->last = NULL;
-		} else {
-			playout_buf->frst = curr->nxt;
-		}
-		free_cdata(curr->cdata);
-		free(curr);
-	
-		pbuf_validate(playout_buf);
-	}
-    return;
+    for (i = 0; i < playout_buf->count; i++) {
+        if (frame_at(playout_buf, i)->decoded) {
+            release_until(playout_buf, i);
+            break;
+        }
+    }
+    pbuf_validate(playout_buf);
 }
 
-static int frame_complete(struct pbuf_node *frame)
+void pbuf_discard_frame(struct pbuf *playout_buf)
 {
-    /* Return non-zero if the list of coded_data represents a    */
-    /* complete frame of video. This might have to be passed the */
-    /* seqnum of the last packet in the previous frame, too?     */
-    /* i dont think that would reflect correctly of weather this */
-    /* frame is complete or not - however we should check for all */
-    /* the packtes of a frame being present - perhaps we should  */
-    /* keep a bit vector in pbuf_node? LG.  */
+    /* Remove the first complete frame, and what is before it */
+    int i;
 
-    return (frame->mbit == 1);
+    for (i = 0; i < playout_buf->count; i++) {
+        if (frame_at(playout_buf, i)->complete) {
+            release_until(playout_buf, i);
+            break;
+        }
+    }
+    pbuf_validate(playout_buf);
 }
 
-int pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
-                             decode_frame_t decode_func, void *data)
+/* First complete frame that has reached it's playout time, linked */
+static struct pbuf_node *due_frame(struct pbuf *playout_buf, struct timeval curr_time)
 {
-    /* Find the first complete frame that has reached it's playout */
-    /* time, and decode it into the framebuffer. Mark the frame as */
-    /* decoded, but otherwise leave it in the playout buffer.      */
     struct pbuf_node *curr;
+    int i;
 
     pbuf_validate(playout_buf);
 
-    curr = playout_buf->frst;
-    while (curr != NULL) {
+    for (i = 0; i < playout_buf->count; i++) {
+        curr = frame_at(playout_buf, i);
         if (!curr->decoded && tv_gt(curr_time, curr->playout_time)) {
-            if (frame_complete(curr)) {
-                int ret = decode_func(curr->cdata, data);
-                curr->decoded = 1;
-                return ret;
+            if (curr->complete) {
+                link_frame(curr);
+                return curr;
             } else {
                 debug_msg("Unable to decode frame due to missing data (RTP TS=%u)\n",
                                  curr->rtp_timestamp);
             }
         }
-        curr = curr->nxt;
     }
 
-    return 0;
+    return NULL;
+}
+
+int pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
+                             decode_frame_t decode_func, void *data)
+{
+    /* Find the first complete frame that has reached it's playout */
+    /* time, and decode it into the framebuffer. Mark the frame as */
+    /* decoded, but otherwise leave it in the playout buffer.      */
+    struct pbuf_node *curr = due_frame(playout_buf, curr_time);
+
+    if (curr == NULL) {
+        return 0;
+    }
+    curr->decoded = 1;
+    return decode_func(curr->cdata, data);
+}
+
+int pbuf_peek(struct pbuf *playout_buf, struct timeval curr_time,
+                             decode_frame_t decode_func, void *data)
+{
+    /* As pbuf_decode, but the frame stays undecoded */
+    struct pbuf_node *curr = due_frame(playout_buf, curr_time);
+
+    if (curr == NULL) {
+        return 0;
+    }
+    return decode_func(curr->cdata, data);
+}
+
+int pbuf_is_empty(struct pbuf *playout_buf)
+{
+        return playout_buf->count == 0;
+}
+
+int pbuf_has_complete_frame(struct pbuf *playout_buf)
+{
+        struct pbuf_node *curr;
+        int i;
+
+        for (i = 0; i < playout_buf->count; i++) {
+                curr = frame_at(playout_buf, i);
+                if (!curr->decoded && curr->complete) {
+                        return TRUE;
+                }
+        }
+        return FALSE;
 }
 
 int pbuf_check_if_complete_frame(struct pbuf *playout_buf, struct timeval curr_time)
 {
-    /* Check if we have a complete frame.      */
+    /* Check if the frame pbuf_decode would decode is due. */
     struct pbuf_node *curr;
+    int i;
 
     pbuf_validate(playout_buf);
 
-    curr = playout_buf->frst;
-    if (curr != NULL && tv_gt(curr_time, curr->playout_time)) {
-        if (frame_complete(curr)) {
-            curr->decoded = 1;
-            return TRUE;
+    for (i = 0; i < playout_buf->count; i++) {
+        curr = frame_at(playout_buf, i);
+        if (!curr->decoded && curr->complete) {
+            return tv_gt(curr_time, curr->playout_time);
         }
     }
 
     return FALSE;
+}
+
+/*
+ * Highest seqno frame i may have: its M bit, else the one before the next
+ * frame, which also covers a lost M bit packet.
+ */
+static uint16_t frame_last_seq(struct pbuf *playout_buf, int i)
+{
+        struct pbuf_node *frame = frame_at(playout_buf, i);
+        uint16_t next;
+
+        if (frame->mbit) {
+                return frame->mbit_seq;
+        }
+        if (i + 1 < playout_buf->count) {
+                next = frame_at(playout_buf, i + 1)->min_seq - 1;
+                if (seq_before(frame->max_seq, next)) {
+                        return next;
+                }
+        }
+        return frame->max_seq;
+}
+
+int pbuf_get_nacks(struct pbuf *playout_buf, struct timeval curr_time,
+                uint16_t *seqs, int max)
+{
+        struct pbuf_node *frame;
+        uint16_t seq, span;
+        int i, n = 0;
+        uint32_t k;
+
+        for (i = 0; i < playout_buf->count && n < max; i++) {
+                frame = frame_at(playout_buf, i);
+                if (frame->complete || frame->decoded || frame->nacks >= PBUF_MAX_NACKS
+                                || (frame->nacks > 0
+                                    && tv_diff(curr_time, frame->nack_time) < PBUF_NACK_INTERVAL)) {
+                        continue;
+                }
+                seq = frame_first_seq(playout_buf, i);
+                span = frame_last_seq(playout_buf, i) - seq;
+                /* Checked in O(1), so frames still arriving cost nothing */
+                if ((int) span + 1 <= frame->received || span >= PBUF_MAX_SLOTS) {
+                        continue;
+                }
+                /* A hole may just be reordering: give it time to fill */
+                if (!frame->gap) {
+                        frame->gap = TRUE;
+                        frame->gap_time = curr_time;
+                }
+                if (frame->nacks == 0
+                    && tv_diff(curr_time, frame->gap_time) < playout_buf->reorder_window) {
+                        continue;
+                }
+
+                for (k = 0; k <= span && n < max; k++, seq++) {
+                        if (seq_before(seq, frame->min_seq) || seq_before(frame->max_seq, seq)
+                                        || !slot_present(frame, seq)) {
+                                seqs[n++] = seq;
+                        }
+                }
+                frame->nacks++;
+                frame->nack_time = curr_time;
+        }
+        return n;
+}
 
+int pbuf_get_frame_info(struct pbuf *playout_buf, int n, struct pbuf_frame_info *info)
+{
+        struct pbuf_node *frame;
+
+        if (n < 0 || n >= playout_buf->count) {
+                return FALSE;
+        }
+
+        frame = frame_at(playout_buf, n);
+        info->rtp_timestamp = frame->rtp_timestamp;
+        info->first_seq = frame_first_seq(playout_buf, n);
+        info->last_seq = frame->mbit ? frame->mbit_seq : frame->max_seq;
+        info->received = frame->received;
+        info->missing = frame_missing(playout_buf, n);
+        info->mbit = frame->mbit;
+        info->complete = frame->complete;
+        info->decoded = frame->decoded;
+        return TRUE;
+}
+
+int pbuf_frame_has_seq(struct pbuf *playout_buf, int n, uint16_t seq)
+{
+        if (n < 0 || n >= playout_buf->count) {
+                return FALSE;
+        }
+
+        return frame_has_seq(frame_at(playout_buf, n), seq);
+}
+
+void pbuf_get_stats(struct pbuf *playout_buf, struct pbuf_stats *stats)
+{
+        *stats = playout_buf->stats;
 }
 
 int audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
@@ -464,25 +960,22 @@ int audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
     /* time, and decode it into the framebuffer. Mark the frame as */
     /* decoded, but otherwise leave it in the playout buffer.      */
     struct pbuf_node *curr;
+    int i;
 
     pbuf_validate(playout_buf);
 
-    curr = playout_buf->frst;
-    while (curr != NULL) {
-        /* WARNING: this one differs from video - we need to push audio immediately, because we do
-        * _not_ know the granularity of audio (typically 256 B for ALSA) which is only small fractal
-        * of frame time. The current RTP library isn't currently able to keep concurrently more frames.
-        */
-        UNUSED(curr_time);
-        if (!curr->decoded // && tv_gt(curr_time, curr->playout_time)
-                    ) {
-            if (frame_complete(curr)) {
-                int ret = decode_func(curr->cdata, data);
-                curr->decoded = 1;
-                return ret;
-            }
+    /* WARNING: this one differs from video - we need to push audio immediately, because we do
+    * _not_ know the granularity of audio (typically 256 B for ALSA) which is only small fractal
+    * of frame time. The current RTP library isn't currently able to keep concurrently more frames.
+    */
+    UNUSED(curr_time);
+    for (i = 0; i < playout_buf->count; i++) {
+        curr = frame_at(playout_buf, i);
+        if (!curr->decoded && curr->complete) {
+            link_frame(curr);
+            curr->decoded = 1;
+            return decode_func(curr->cdata, data);
         }
-        curr = curr->nxt;
     }
     return 0;
 }
@@ -490,33 +983,91 @@ int audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
 int rtp_audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
                              decode_frame_t decode_func, void *data)
 {
-        /* Find the first complete frame that has reached it's playout */
-        /* time, and decode it into the framebuffer. Mark the frame as */
-        /* decoded, but otherwise leave it in the playout buffer.      */
+        /* Find the first frame not decoded yet, complete or not, and  */
+        /* decode it into the framebuffer. Mark the frame as decoded,  */
+        /* but otherwise leave it in the playout buffer.               */
         struct pbuf_node *curr;
+        int i;
 
         pbuf_validate(playout_buf);
 
-        curr = playout_buf->frst;
-        while (curr != NULL) {
-                /* WARNING: this one differs from video - we need to push audio immediately, because we do
-                 * _not_ know the granularity of audio (typically 256 B for ALSA) which is only small fractal
-                 * of frame time. The current RTP library isn't currently able to keep concurrently more frames.
-                 */
-                UNUSED(curr_time);
+        /* WARNING: this one differs from video - we need to push audio immediately, because we do
+         * _not_ know the granularity of audio (typically 256 B for ALSA) which is only small fractal
+         * of frame time. The current RTP library isn't currently able to keep concurrently more frames.
+         */
+        UNUSED(curr_time);
+        for (i = 0; i < playout_buf->count; i++) {
+                curr = frame_at(playout_buf, i);
                 if (!curr->decoded) {
-                        int ret = decode_func(curr->cdata, data);
+                        link_frame(curr);
                         curr->decoded = 1;
-                        return ret;
+                        return decode_func(curr->cdata, data);
                 }
-                curr = curr->nxt;
         }
         return 0;
 }
 
 void pbuf_set_playout_delay(struct pbuf *playout_buf, double playout_delay, double deletion_delay)
 {
+    playout_buf->adaptive = FALSE;
     playout_buf->playout_delay = playout_delay;
     playout_buf->deletion_delay = deletion_delay;
 }
 
+void pbuf_set_adaptive_delay(struct pbuf *playout_buf, double min_delay, double max_delay)
+{
+    playout_buf->adaptive = TRUE;
+    playout_buf->min_delay = min_delay;
+    playout_buf->max_delay = max_delay > min_delay ? max_delay : min_delay;
+    playout_buf->playout_delay = playout_buf->min_delay;
+    playout_buf->deletion_delay = 2 * playout_buf->min_delay;
+}
+
+void pbuf_update_jitter(struct pbuf *playout_buf, double jitter)
+{
+    /* The RFC 3550 estimate is a mean deviation, so a few of them cover */
+    /* nearly every late packet. Incomplete frames get twice as long    */
+    /* before being given up, as their last packets are the late ones.  */
+    double delay;
+
+    playout_buf->reorder_window = jitter / 2 > PBUF_REORDER_MIN ? jitter / 2 : PBUF_REORDER_MIN;
+    if (!playout_buf->adaptive) {
+        return;
+    }
+
+    delay = PBUF_JITTER_FACTOR * jitter;
+    if (delay < playout_buf->min_delay) {
+        delay = playout_buf->min_delay;
+    } else if (delay > playout_buf->max_delay) {
+        delay = playout_buf->max_delay;
+    }
+    playout_buf->playout_delay = delay;
+    playout_buf->deletion_delay = 2 * delay;
+}
+
+double pbuf_get_playout_delay(struct pbuf *playout_buf)
+{
+    return playout_buf->playout_delay;
+}
+
+
+void pbuf_destroy(struct pbuf *playout_buf)
+{
+        int i;
+
+        if (playout_buf == NULL) {
+                return;
+        }
+
+        while (playout_buf->count > 0) {
+                release_first(playout_buf);
+        }
+        for (i = 0; i < playout_buf->fec_count; i++) {
+                rtp_free_packet(playout_buf->fec[i].pkt);
+        }
+        for (i = 0; i < PBUF_MAX_FRAMES; i++) {
+                free(playout_buf->frames[i].slots);
+                free(playout_buf->frames[i].present);
+        }
+        free(playout_buf);
+}
@@ -71,7 +71,7 @@
 #include "audio.h"
 #include "rtp.h"
 
-/* The coded representation of a single frame */
+/* The coded representation of a single frame, in seqno order */
 struct coded_data {
         struct coded_data       *nxt;
         struct coded_data       *prv;
@@ -81,6 +81,27 @@ struct coded_data {
 
 /* The playout buffer */
 struct pbuf;
+
+/* Reception state of a buffered frame, see pbuf_get_frame_info() */
+struct pbuf_frame_info {
+        uint32_t                 rtp_timestamp;
+        uint16_t                 first_seq;     /* Expected seqno of the first packet */
+        uint16_t                 last_seq;      /* Seqno with the M bit, else highest received */
+        int                      received;      /* Packets received */
+        int                      missing;       /* Seqnos missing between first_seq and last_seq */
+        int                      mbit;          /* Last packet received */
+        int                      complete;      /* M bit seen and nothing missing */
+        int                      decoded;
+};
+
+struct pbuf_stats {
+        uint32_t                 received;          /* Packets stored */
+        uint32_t                 duplicates;        /* Packets already stored */
+        uint32_t                 late;              /* Packets of frames already given up */
+        uint32_t                 lost;              /* Holes of the frames given up incomplete */
+        uint32_t                 incomplete_frames; /* Frames given up without being decoded */
+        uint32_t                 recovered;         /* Packets rebuilt from FEC packets */
+};
 struct state_decoder;
 //struct state_audio_decoder;
 
@@ -118,7 +139,16 @@ typedef int decode_frame_t(struct coded_data *cdata, void *decode_data);
  * External interface: 
  */
 struct pbuf	*pbuf_init(void);
-void		 pbuf_insert(struct pbuf *playout_buf, rtp_packet *r);
+/* Must be called from the thread calling pbuf_insert() */
+void		 pbuf_destroy(struct pbuf *playout_buf);
+/* Returns TRUE if r carried the marker bit of its frame, completing it */
+int		 pbuf_insert(struct pbuf *playout_buf, rtp_packet *r);
+/*
+ * Takes a FEC packet (see rtp/fec.h) protecting the source of the buffer,
+ * kept until the packet it may rebuild is received or given up. Returns
+ * TRUE if a rebuilt packet completed a frame, as pbuf_insert().
+ */
+int		 pbuf_insert_fec(struct pbuf *playout_buf, rtp_packet *r);
 int 	 	 audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
                              decode_frame_t decode_func, void *data);
 int 	 	 rtp_audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
@@ -126,10 +156,38 @@ int 	 	 rtp_audio_pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time
 int 	 	 pbuf_decode(struct pbuf *playout_buf, struct timeval curr_time,
                              decode_frame_t decode_func, void *data);
                              //struct video_frame *framebuffer, int i, struct state_decoder *decoder);
+/* Runs decode_func on the frame pbuf_decode would decode, leaving it undecoded */
+int 	 	 pbuf_peek(struct pbuf *playout_buf, struct timeval curr_time,
+                             decode_frame_t decode_func, void *data);
 void		 pbuf_remove(struct pbuf *playout_buf, struct timeval curr_time);
 void		 pbuf_remove_first(struct pbuf *playout_buf);
 void		 pbuf_set_playout_delay(struct pbuf *playout_buf, double playout_delay,
                 double deletion_delay);
+/* Sizes the playout delay from pbuf_update_jitter() within [min_delay, max_delay]
+   seconds, frames are deleted after twice as long */
+void		 pbuf_set_adaptive_delay(struct pbuf *playout_buf, double min_delay,
+                double max_delay);
+/* Interarrival jitter of the sender in seconds, sizes the NACK reorder window
+   and, if adaptive, the delays */
+void		 pbuf_update_jitter(struct pbuf *playout_buf, double jitter);
+double		 pbuf_get_playout_delay(struct pbuf *playout_buf);
+/* Drops the oldest complete frame, and the incomplete ones before it */
+void         pbuf_discard_frame(struct pbuf *playout_buf);
 int          pbuf_check_if_complete_frame(struct pbuf *playout_buf, struct timeval curr_time);
+int          pbuf_is_empty(struct pbuf *playout_buf);
+int          pbuf_has_complete_frame(struct pbuf *playout_buf);
+/* Frame n counting from the oldest, FALSE if there is no such frame */
+int          pbuf_get_frame_info(struct pbuf *playout_buf, int n, struct pbuf_frame_info *info);
+int          pbuf_frame_has_seq(struct pbuf *playout_buf, int n, uint16_t seq);
+/*
+ * Stores in seqs up to max seqnos missing from the incomplete frames, oldest
+ * first, to be requested again. A frame is first reported once its holes
+ * had half the jitter (3 ms at least) to be filled by reordered packets,
+ * a few times at most, and not again until its last request had time to
+ * be answered.
+ */
+int          pbuf_get_nacks(struct pbuf *playout_buf, struct timeval curr_time,
+                uint16_t *seqs, int max);
+void         pbuf_get_stats(struct pbuf *playout_buf, struct pbuf_stats *stats);
 
 
@@ -78,6 +78,10 @@
 #include "crypto/md5.h"
 #include "ntp.h"
 #include "rtp.h"
+#include "utils/object_pool.h"
+#include "rtp/fec.h"
+#include "utils/pacer.h"
+#include "tfrc.h"
 
 /*
  * Encryption stuff.
@@ -97,7 +101,9 @@ static int des_decrypt(struct rtp *session, unsigned char *data,
 static int des_encrypt(struct rtp *session, unsigned char *data,
                        unsigned int size, unsigned char *initVec);
 static void rtp_process_data(struct rtp *session, uint32_t curr_rtp_ts,
-               uint8_t *buffer, rtp_packet *packet, int buflen);
+               uint8_t *buffer, rtp_packet *packet, int buflen,
+               const struct sockaddr_storage *from);
+static void rtp_process_ctrl(struct rtp *session, uint8_t * buffer, int buflen);
 
 #define MAX_DROPOUT    3000
 #define MAX_MISORDER   100
@@ -118,6 +124,12 @@ static void rtp_process_data(struct rtp *session, uint32_t curr_rtp_ts,
 #define RTCP_BYE  203
 #define RTCP_APP  204
 #define RTCP_RX   205
+#define RTCP_RTPFB 205          /* RFC 4585, only sent by sessions without TFRC */
+#define RTCP_PSFB 206
+
+#define RTCP_FB_NACK 1          /* Generic NACK, the FMT of an RTPFB packet */
+#define RTCP_FB_PLI 1           /* Picture Loss Indication, the FMT of a PSFB packet */
+#define RTCP_FB_FIR 4           /* Full Intra Request (RFC 5104), also a PSFB */
 
 typedef struct {
 #ifdef WORDS_BIGENDIAN
@@ -163,6 +175,11 @@ typedef struct {
                         uint8_t name[4];
                         uint8_t data[1];
                 } app;
+                struct {
+                        uint32_t ssrc;          /* source this RTCP packet is coming from */
+                        uint32_t media_ssrc;    /* source the feedback is about */
+                        uint32_t fci[1];        /* variable-length list */
+                } fb;
         } r;
 } rtcp_t;
 
@@ -212,6 +229,7 @@ typedef struct _source {
         int probation;
         uint32_t jitter;
         uint32_t transit;
+        struct sockaddr_storage rtp_addr;       /* Where its RTP comes from, feedback goes there */
         uint32_t magic;         /* For debugging... */
 } source;
 
@@ -235,6 +253,7 @@ typedef struct {
         int wait_for_rtcp;
         int filter_my_packets;
         int reuse_bufs;
+        int nack;
 } options;
 
 /*
@@ -245,6 +264,86 @@ typedef int (*rtp_encrypt_func) (struct rtp *, unsigned char *data,
 typedef int (*rtp_decrypt_func) (struct rtp *, unsigned char *data,
                                  unsigned int size, unsigned char *initvec);
 
+/*
+ * Packets queued between rtp_send_batch_begin() and rtp_send_batch_flush().
+ * Each slot keeps its own copy of the RTP and payload headers, so callers
+ * may reuse their header buffers; the media data is only referenced.
+ */
+
+/* Longest RTP plus payload header that fits in a batch slot. */
+#define RTP_BATCH_HDR_MAX	(20 + 64)
+/* FEC packets are built by the session, so a batch keeps whole copies */
+#define RTP_BATCH_FEC_LEN	(4 * RTP_MAX_PACKET_LEN)
+
+struct rtp_batch_slot {
+        uint8_t buffer[RTP_PACKET_HEADER_SIZE + RTP_BATCH_HDR_MAX];
+#ifdef WIN32
+        WSABUF vector[2];
+#else
+        struct iovec vector[2];
+#endif
+};
+
+struct rtp_batch {
+        int active;
+        int count;
+        struct rtp_batch_slot slots[UDP_MAX_BATCH];
+#ifdef WIN32
+        LPWSABUF vectors[UDP_MAX_BATCH];
+#else
+        struct iovec *vectors[UDP_MAX_BATCH];
+#endif
+        int counts[UDP_MAX_BATCH];
+        uint8_t fec[RTP_BATCH_FEC_LEN];
+        int fec_len;
+};
+
+/*
+ * Copies of the last packets sent, indexed by seqno, to answer generic
+ * NACKs (RFC 4585). Retransmissions spend tokens refilled at budget per
+ * second, so a lossy receiver cannot take more than that from us.
+ */
+struct rtp_history_slot {
+        uint16_t seq;
+        int len;                /* 0 if empty */
+        int size;
+        uint8_t *data;          /* The packet as sent */
+};
+
+struct rtp_history {
+        int size;               /* Power of two */
+        struct rtp_history_slot *slots;
+        double budget;
+        double tokens;
+        struct timeval last_refill;
+        uint32_t retransmitted;
+        uint32_t refused;       /* Not in the history or over budget */
+};
+
+/* Retransmission requests sent by the next rtp_send_ctrl() */
+#define RTP_MAX_NACK_FCI	32
+
+struct rtp_nack_fci {
+        uint32_t ssrc;          /* Media source */
+        uint16_t pid;           /* First lost seqno... */
+        uint16_t blp;           /* ...and the lost ones among the next 16 */
+};
+
+/* Keyframe requests sent by the next rtp_send_ctrl() */
+#define RTP_MAX_KEYFRAME_REQUESTS	16
+
+struct rtp_keyframe_request {
+        uint32_t ssrc;          /* Media source */
+        int fir;                /* FIR if TRUE, PLI otherwise */
+};
+
+/*
+ * Datagrams read per wakeup by rtp_recv_data(). Every slot is a whole
+ * RTP_MAX_PACKET_LEN packet allocated ahead of the read; the ones handed
+ * to the application or discarded are replaced before the next read.
+ */
+#define RTP_RECV_BATCH	32
+
 /*
  * The "struct rtp" defines an RTP session.
  */
@@ -310,9 +409,48 @@ struct rtp {
         } crypto_state;
         rtp_callback callback;
         struct msghdr *mhdr;
+        struct rtp_batch *batch;        /* Allocated by the first rtp_send_batch_begin() */
+        uint32_t hdr_template[3];       /* Fixed RTP header fields, network order, see update_hdr_template() */
+        rtp_packet *rx_slots[RTP_RECV_BATCH];   /* Allocated by rtp_recv_data() */
+        struct object_pool *packet_pool;        /* RTP_MAX_PACKET_LEN packets, see rtp_free_packet() */
+        struct rtp_history *history;    /* See rtp_set_retransmission() */
+        struct rtp_nack_fci nacks[RTP_MAX_NACK_FCI];
+        int nack_count;
+        struct rtp_keyframe_request keyframe_requests[RTP_MAX_KEYFRAME_REQUESTS];
+        int keyframe_request_count;
+        uint8_t fir_seq;        /* Seq nr of the last FIR sent */
+        uint32_t keyframes_requested;   /* PLIs and FIRs received for my_ssrc */
+        struct fec_xor_encoder *fec;    /* See rtp_set_fec() */
+        int fec_pt;
+        int fec_cols;
+        int fec_rows;
+        uint32_t fec_ssrc;
+        uint16_t fec_seq;
+        struct pacer *pacer;            /* See rtp_set_pacing() */
+        struct pacer *shared_pacer;     /* See rtp_set_shared_pacer(), not owned */
+        struct rtp_sr_table *sr_table;  /* See rtp_set_sr_table(), not owned */
+        uint64_t rc_min_rate;           /* See rtp_set_rate_control(), 0 when off */
+        uint64_t rc_max_rate;
+        double rc_rate;                 /* Target sending rate, bits per second, 0 until seeded */
+        uint32_t rc_rtt;                /* usec, 0 until a report echoes one of our SRs */
+        uint64_t rc_bytes_sent;         /* rtp_bytes_sent and rtp_pcount at the last report */
+        uint32_t rc_pcount;
+        struct timeval rc_report_time;
         uint32_t magic;         /* For debugging...  */
 };
 
+/*
+ * Precomputes the words of the RTP header that only change with the SSRC,
+ * so sending a plain packet just patches marker, payload type, sequence
+ * number and timestamp into a copy of it.
+ */
+static void update_hdr_template(struct rtp *session)
+{
+        session->hdr_template[0] = htonl((uint32_t) RTP_VERSION << 30);
+        session->hdr_template[1] = 0;
+        session->hdr_template[2] = htonl(session->my_ssrc);
+}
+
 static inline int filter_event(struct rtp *session, uint32_t ssrc)
 {
         return session->opt->filter_my_packets
@@ -958,6 +1096,7 @@ static void init_opt(struct rtp *session)
         rtp_set_option(session, RTP_OPT_WEAK_VALIDATION, FALSE);
         rtp_set_option(session, RTP_OPT_FILTER_MY_PACKETS, FALSE);
         rtp_set_option(session, RTP_OPT_REUSE_PACKET_BUFS, FALSE);
+        rtp_set_option(session, RTP_OPT_NACK, FALSE);
 }
 
 static void init_rng(const char *s)
@@ -1097,9 +1236,18 @@ struct rtp *rtp_init_if(const char *addr, const char *iface,
                 return NULL;
         }
 
+        session->packet_pool = object_pool_init(RTP_MAX_PACKET_LEN);
+        if (session->packet_pool == NULL) {
+                udp_exit(session->rtp_socket);
+                udp_exit(session->rtcp_socket);
+                free(session);
+                return NULL;
+        }
+
         init_rng(udp_host_addr(session->rtp_socket));
 
         session->my_ssrc = (uint32_t) lrand48();
+        update_hdr_template(session);
         session->callback = callback;
         session->invalid_rtp_count = 0;
         session->invalid_rtcp_count = 0;
@@ -1119,6 +1267,8 @@ struct rtp *rtp_init_if(const char *addr, const char *iface,
         session->rtp_seq = (uint16_t) lrand48();
         session->rtp_pcount = 0;
         session->mhdr = NULL;
+        session->batch = NULL;
+        memset(session->rx_slots, 0, sizeof(session->rx_slots));
         session->tfrc_on = tfrc_on;
         session->rtp_bcount = 0;
         session->rtp_bytes_sent = 0;
@@ -1182,6 +1332,7 @@ int rtp_set_my_ssrc(struct rtp *session, uint32_t ssrc)
         session->db[h] = NULL;
         /* Fill in new ssrc       */
         session->my_ssrc = ssrc;
+        update_hdr_template(session);
         s->ssrc = ssrc;
         h = ssrc_hash(ssrc);
         /* Put source back        */
@@ -1215,6 +1366,9 @@ int rtp_set_option(struct rtp *session, rtp_option optname, int optval)
         case RTP_OPT_REUSE_PACKET_BUFS:
                 session->opt->reuse_bufs = optval;
                 break;
+        case RTP_OPT_NACK:
+                session->opt->nack = optval;
+                break;
         default:
                 debug_msg
                     ("Ignoring unknown option (%d) in call to rtp_set_option().\n",
@@ -1250,6 +1404,9 @@ int rtp_get_option(struct rtp *session, rtp_option optname, int *optval)
         case RTP_OPT_REUSE_PACKET_BUFS:
                 *optval = session->opt->reuse_bufs;
                 break;
+        case RTP_OPT_NACK:
+                *optval = session->opt->nack;
+                break;
         default:
                 *optval = 0;
                 debug_msg
@@ -1358,9 +1515,9 @@ static void compute_loss_intervals(struct rtp *session, rtp_packet * packet)
 
 static void
 process_rtp(struct rtp *session, uint32_t curr_rtp_ts, rtp_packet * packet,
-            source * s)
+            source * s, const struct sockaddr_storage *from)
 {
-        int i, d, transit;
+        int i, d, transit, first;
         rtp_event event;
 
         if (packet->cc > 0) {
@@ -1369,6 +1526,7 @@ process_rtp(struct rtp *session, uint32_t curr_rtp_ts, rtp_packet * packet,
                 }
         }
         /* Update the source database... */
+        first = !s->sender;
         if (s->sender == FALSE) {
                 s->sender = TRUE;
                 session->sender_count++;
@@ -1377,8 +1535,14 @@ process_rtp(struct rtp *session, uint32_t curr_rtp_ts, rtp_packet * packet,
         if (session->tfrc_on)
                 compute_loss_intervals(session, packet);
 
+        if (from != NULL && from->ss_family != AF_UNSPEC) {
+                s->rtp_addr = *from;
+        }
+
+        /* Interarrival jitter, RFC 3550 section 6.4.1. The first packet */
+        /* only sets the transit time, there is nothing to compare with. */
         transit = curr_rtp_ts - packet->ts;
-        d = transit - s->transit;
+        d = first ? 0 : transit - s->transit;
         s->transit = transit;
         if (d < 0) {
                 d = -d;
@@ -1404,43 +1568,94 @@ void rtp_set_recv_iov(struct rtp *session, struct msghdr *m)
 int rtp_recv_push_data(struct rtp *session,
                 char *data, int buflen, uint32_t curr_rtp_ts)
 {
-        rtp_packet *packet = NULL;
-        uint8_t *buffer = NULL;
+        rtp_packet *packet;
+        uint8_t *buffer;
 
-        if (!session->opt->reuse_bufs || (packet == NULL)) {
-                packet = (rtp_packet *) malloc(RTP_MAX_PACKET_LEN);
-                buffer = ((uint8_t *) packet) + RTP_PACKET_HEADER_SIZE;
+        packet = (rtp_packet *) object_pool_get(session->packet_pool);
+        if (packet == NULL) {
+                return 0;
         }
+        buffer = ((uint8_t *) packet) + RTP_PACKET_HEADER_SIZE;
 
         memcpy(buffer, data, buflen);
 
-        rtp_process_data(session, curr_rtp_ts, buffer, packet, buflen);
+        rtp_process_data(session, curr_rtp_ts, buffer, packet, buflen, NULL);
 
         return buflen;
 }
 
-static int rtp_recv_data(struct rtp *session, uint32_t curr_rtp_ts)
+/**
+ * rtp_free_packet:
+ * @packet: packet delivered in an RX_RTP event, or NULL.
+ *
+ * Releases a received packet. Packets come from a per session pool and
+ * are recycled for later receptions instead of being freed, so they must
+ * not be released with free(). Any thread may release a packet, even
+ * after rtp_done().
+ */
+void rtp_free_packet(rtp_packet *packet)
 {
-        int buflen;
-        rtp_packet *packet = NULL;
-        uint8_t *buffer = NULL;
+        object_pool_put(packet);
+}
 
-        if (!session->opt->reuse_bufs || (packet == NULL)) {
-                packet = (rtp_packet *) malloc(RTP_MAX_PACKET_LEN);
-                buffer = ((uint8_t *) packet) + RTP_PACKET_HEADER_SIZE;
+static int rtp_recv_data(struct rtp *session, uint32_t curr_rtp_ts, int *count)
+{
+        /* Reads every queued datagram, up to RTP_RECV_BATCH, and processes */
+        /* them in arrival order. Returns the number of bytes read and, if  */
+        /* count is not NULL, stores the number of datagrams read there.    */
+        char *buffers[RTP_RECV_BATCH];
+        int lens[RTP_RECV_BATCH];
+        struct sockaddr_storage from[RTP_RECV_BATCH];
+        int i, n, bytes = 0;
+
+        for (i = 0; i < RTP_RECV_BATCH; i++) {
+                if (session->rx_slots[i] == NULL) {
+                        session->rx_slots[i] = (rtp_packet *) object_pool_get(session->packet_pool);
+                        if (session->rx_slots[i] == NULL) {
+                                break;
+                        }
+                }
+                buffers[i] = ((char *) session->rx_slots[i]) + RTP_PACKET_HEADER_SIZE;
+        }
+        if (count != NULL) {
+                *count = 0;
+        }
+        if (i == 0) {
+                return 0;
         }
 
-        buflen =
-            udp_recv(session->rtp_socket, (char *)buffer,
-                     RTP_MAX_PACKET_LEN - RTP_PACKET_HEADER_SIZE);
+        n = udp_recv_batch_from(session->rtp_socket, buffers,
+                                RTP_MAX_PACKET_LEN - RTP_PACKET_HEADER_SIZE,
+                                lens, from, i);
 
-        rtp_process_data(session, curr_rtp_ts, buffer, packet, buflen);
+        for (i = 0; i < n; i++) {
+                rtp_packet *packet = session->rx_slots[i];
 
-        return buflen;
+                if (lens[i] <= 0) {
+                        continue;       /* empty datagram, keep the slot */
+                }
+                bytes += lens[i];
+                /* Feedback comes to the RTP port, told apart as in RFC 5761 */
+                if (!session->encryption_enabled && lens[i] >= 8
+                    && (uint8_t) buffers[i][1] >= 192 && (uint8_t) buffers[i][1] <= 223) {
+                        rtp_process_ctrl(session, (uint8_t *) buffers[i], lens[i]);
+                        continue;       /* keep the slot */
+                }
+                /* The packet now belongs to the callback or has been freed */
+                session->rx_slots[i] = NULL;
+                rtp_process_data(session, curr_rtp_ts, (uint8_t *) buffers[i],
+                                 packet, lens[i], &from[i]);
+        }
+        if (count != NULL) {
+                *count = n;
+        }
+
+        return bytes;
 }
 
 static void rtp_process_data(struct rtp *session, uint32_t curr_rtp_ts,
-               uint8_t *buffer, rtp_packet *packet, int buflen)
+               uint8_t *buffer, rtp_packet *packet, int buflen,
+               const struct sockaddr_storage *from)
 {
         /* This routine preprocesses an incoming RTP packet, deciding whether to process it. */
         uint8_t *buffer_vlen = NULL;
@@ -1513,7 +1728,7 @@ static void rtp_process_data(struct rtp *session, uint32_t curr_rtp_ts,
                                                       FALSE);
                                         s = get_source(session, packet->ssrc);
                                 }
-                                process_rtp(session, curr_rtp_ts, packet, s);
+                                process_rtp(session, curr_rtp_ts, packet, s, from);
                                 return; /* We don't free "packet", that's done by the callback function... */
                         }
                         if (s != NULL) {
@@ -1523,7 +1738,7 @@ static void rtp_process_data(struct rtp *session, uint32_t curr_rtp_ts,
                                 }
                                 if (update_seq(s, packet->seq)) {
                                         process_rtp(session, curr_rtp_ts,
-                                                    packet, s);
+                                                    packet, s, from);
                                         return; /* we don't free "packet", that's done by the callback function... */
                                 } else {
                                         /* This source is still on probation... */
@@ -1538,9 +1753,7 @@ static void rtp_process_data(struct rtp *session, uint32_t curr_rtp_ts,
                         debug_msg("Invalid RTP packet discarded\n");
                 }
 
-                if (!session->opt->reuse_bufs) {
-                        free(packet);
-                }
+                rtp_free_packet(packet);
         }
 }
 
@@ -1720,6 +1933,92 @@ static int validate_rtcp(uint8_t * packet, int len)
         return is_okay;
 }
 
+/*
+ * Loss based rate control, in the manner of draft-ietf-rmcat-gcc: the
+ * target grows by 5% per report while the receiver loses less than 2% of
+ * our packets, and shrinks in proportion to losses above 10%. The TCP
+ * throughput equation keeps a drop from going below what TCP would get,
+ * and TFRC feedback, when the receiver sends it, caps the target at twice
+ * the rate it receives.
+ */
+static void update_target_rate(struct rtp *session, rtcp_rr * rr, rtcp_rx * rx)
+{
+        uint32_t ntp_sec, ntp_frac, now_ntp;
+        struct timeval now;
+        double loss, rate, send_rate, elapsed, tcp_rate;
+        int packet_size;
+
+        if (session->rc_min_rate == 0) {
+                return;
+        }
+
+        /* Round-trip time, as in section 6.4.1 of RFC 3550 */
+        if (rr->lsr != 0) {
+                ntp64_time(&ntp_sec, &ntp_frac);
+                now_ntp = ntp64_to_ntp32(ntp_sec, ntp_frac);
+                if (now_ntp - rr->lsr >= rr->dlsr) {
+                        session->rc_rtt = (uint32_t) ((now_ntp - rr->lsr - rr->dlsr)
+                                                      / 65536.0 * 1000000.0);
+                }
+        }
+
+        /* What we sent since the last report */
+        gettimeofday(&now, NULL);
+        send_rate = 0;
+        packet_size = RTP_MAX_PACKET_LEN;
+        if (timerisset(&session->rc_report_time)) {
+                elapsed = tv_diff(now, session->rc_report_time);
+                if (elapsed > 0) {
+                        send_rate = (session->rtp_bytes_sent - session->rc_bytes_sent) * 8
+                                    / elapsed;
+                }
+                if (session->rtp_pcount != session->rc_pcount) {
+                        packet_size = (session->rtp_bytes_sent - session->rc_bytes_sent)
+                                      / (session->rtp_pcount - session->rc_pcount);
+                }
+        }
+        session->rc_report_time = now;
+        session->rc_bytes_sent = session->rtp_bytes_sent;
+        session->rc_pcount = session->rtp_pcount;
+
+        if (session->rc_rate == 0) {
+                /* Reports are judged against what the source sends on */
+                /* its own, known from the second one on.              */
+                if (send_rate == 0) {
+                        return;
+                }
+                session->rc_rate = send_rate;
+        }
+
+        loss = rr->fract_lost / 256.0;
+        rate = session->rc_rate;
+        if (loss > 0.10) {
+                rate *= 1 - 0.5 * loss;
+                tcp_rate = tfrc_calc_x(packet_size, session->rc_rtt, loss) * 8;
+                if (rate < tcp_rate) {
+                        rate = tcp_rate;
+                }
+        } else if (loss < 0.02 && (send_rate == 0 || rate < 1.5 * send_rate)) {
+                /* ...a source that does not use the rate gets no more */
+                rate *= 1.05;
+        }
+        if (rx != NULL && rx->x_recv > 0 && rate > 2.0 * rx->x_recv * 8) {
+                rate = 2.0 * rx->x_recv * 8;
+        }
+
+        if (rate < session->rc_min_rate) {
+                rate = session->rc_min_rate;
+        }
+        if (rate > session->rc_max_rate) {
+                rate = session->rc_max_rate;
+        }
+        if ((uint64_t) rate != (uint64_t) session->rc_rate) {
+                debug_msg("Target rate %.0f bps (loss %.3f, rtt %u usec, sent %.0f bps)\n",
+                          rate, loss, session->rc_rtt, send_rate);
+        }
+        session->rc_rate = rate;
+}
+
 static void process_report_blocks(struct rtp *session, rtcp_t * packet,
                                   uint32_t ssrc, rtcp_rr * rrp, rtcp_rx * rrx)
 {
@@ -1761,6 +2060,12 @@ static void process_report_blocks(struct rtp *session, rtcp_t * packet,
                         /* Store the RR for later use... */
                         insert_rr(session, ssrc, rr, rx);
 
+                        /* ...and adapt to it if it is about our source */
+                        if (rr->ssrc == session->my_ssrc
+                            && ssrc != session->my_ssrc) {
+                                update_target_rate(session, rr, rx);
+                        }
+
                         /* Call the event handler... */
                         if (!filter_event(session, ssrc)) {
                                 event.ssrc = ssrc;
@@ -1772,6 +2077,58 @@ static void process_report_blocks(struct rtp *session, rtcp_t * packet,
         }
 }
 
+/*
+ * Last SR of the sources of sessions that share their RTCP port with
+ * SO_REUSEPORT: the kernel spreads RTCP by its own hash, so the SRs of a
+ * source may reach another session than the one reporting on it. Direct
+ * mapped, a colliding source just takes the entry over.
+ */
+#define RTP_SR_TABLE_SIZE 64
+
+struct rtp_sr_entry {
+        uint32_t ssrc;
+        int valid;
+        uint32_t ntp_sec;       /* NTP timestamp of the SR...           */
+        uint32_t ntp_frac;
+        uint32_t recv_sec;      /* ...and when it arrived               */
+        uint32_t recv_frac;
+};
+
+struct rtp_sr_table {
+        pthread_mutex_t lock;
+        struct rtp_sr_entry entries[RTP_SR_TABLE_SIZE];
+};
+
+static void sr_table_store(struct rtp_sr_table *table, uint32_t ssrc,
+                           rtcp_sr * sr, uint32_t recv_sec, uint32_t recv_frac)
+{
+        struct rtp_sr_entry *e = &table->entries[ssrc % RTP_SR_TABLE_SIZE];
+
+        pthread_mutex_lock(&table->lock);
+        e->ssrc = ssrc;
+        e->valid = TRUE;
+        e->ntp_sec = sr->ntp_sec;
+        e->ntp_frac = sr->ntp_frac;
+        e->recv_sec = recv_sec;
+        e->recv_frac = recv_frac;
+        pthread_mutex_unlock(&table->lock);
+}
+
+static int sr_table_lookup(struct rtp_sr_table *table, uint32_t ssrc,
+                           struct rtp_sr_entry *entry)
+{
+        struct rtp_sr_entry *e = &table->entries[ssrc % RTP_SR_TABLE_SIZE];
+        int found;
+
+        pthread_mutex_lock(&table->lock);
+        found = e->valid && e->ssrc == ssrc;
+        if (found) {
+                *entry = *e;
+        }
+        pthread_mutex_unlock(&table->lock);
+        return found;
+}
+
 static void process_rtcp_sr(struct rtp *session, rtcp_t * packet)
 {
         uint32_t ssrc;
@@ -1809,6 +2166,10 @@ static void process_rtcp_sr(struct rtp *session, rtcp_t * packet)
         ntp64_time(&s->last_sr_sec, &s->last_sr_frac);
         s->last_sr_sec = tmp_sec;
         s->last_sr_frac = tmp_frac;
+        if (session->sr_table != NULL) {
+                sr_table_store(session->sr_table, ssrc, sr,
+                               s->last_sr_sec, s->last_sr_frac);
+        }
 
         /* Call the event handler... */
         if (!filter_event(session, ssrc)) {
@@ -1865,6 +2226,139 @@ static void process_rtcp_rx(struct rtp *session, rtcp_t * packet)
         }
 }
 
+/*
+ * Charges a packet to the pacers of the session. When wait is TRUE and
+ * they are out of tokens, the packets already queued in a batch are sent
+ * and the caller sleeps until the packet may follow them.
+ */
+static void rtp_pace(struct rtp *session, int bytes, int wait)
+{
+        struct pacer *pacer = __atomic_load_n(&session->pacer, __ATOMIC_ACQUIRE);
+        struct pacer *shared = __atomic_load_n(&session->shared_pacer, __ATOMIC_ACQUIRE);
+        uint64_t now, when, shared_when;
+
+        if (pacer == NULL && shared == NULL) {
+                return;
+        }
+
+        now = pacer_now();
+        when = pacer != NULL ? pacer_charge(pacer, bytes, now) : now;
+        if (shared != NULL) {
+                shared_when = pacer_charge(shared, bytes, now);
+                if (shared_when > when) {
+                        when = shared_when;
+                }
+        }
+        if (!wait || !pacer_must_wait(when, now)) {
+                return;
+        }
+
+        if (session->batch != NULL && session->batch->active && session->batch->count > 0) {
+                rtp_send_batch_flush(session);
+                session->batch->active = TRUE;
+        }
+        pacer_sleep_until(when);
+}
+
+static int take_retransmission_token(struct rtp_history *history)
+{
+        struct timeval curr_time;
+
+        gettimeofday(&curr_time, NULL);
+        history->tokens += tv_diff(curr_time, history->last_refill) * history->budget;
+        if (history->tokens > history->budget) {
+                history->tokens = history->budget;      /* One second of burst */
+        }
+        history->last_refill = curr_time;
+
+        if (history->tokens < 1) {
+                return FALSE;
+        }
+        history->tokens -= 1;
+        return TRUE;
+}
+
+static void retransmit(struct rtp *session, uint16_t seq)
+{
+        struct rtp_history *history = session->history;
+        struct rtp_history_slot *slot = &history->slots[seq & (history->size - 1)];
+
+        if (slot->len == 0 || slot->seq != seq || !take_retransmission_token(history)) {
+                history->refused++;
+                return;
+        }
+        /* Answered from the receive path, so the debt is left to the media */
+        rtp_pace(session, slot->len, FALSE);
+        if (udp_send(session->rtp_socket, (char *) slot->data, slot->len) == -1) {
+                perror("retransmitting RTP packet");
+                return;
+        }
+        history->retransmitted++;
+        session->rtp_bytes_sent += slot->len;
+}
+
+static void process_rtcp_rtpfb(struct rtp *session, rtcp_t * packet)
+{
+        /* Generic NACK, RFC 4585 section 6.2.1: every FCI word holds a */
+        /* lost seqno and a bitmask of the lost ones among the next 16. */
+        int words = ntohs(packet->common.length) - 2;
+        uint32_t fci;
+        uint16_t pid, blp;
+        int i, j;
+
+        if (packet->common.count != RTCP_FB_NACK) {
+                debug_msg("RTPFB packet with unknown format (%d) ignored.\n",
+                          packet->common.count);
+                return;
+        }
+        /* Feedback about the other senders of the session is not ours */
+        if (session->history == NULL
+            || ntohl(packet->r.fb.media_ssrc) != session->my_ssrc) {
+                return;
+        }
+
+        for (i = 0; i < words; i++) {
+                fci = ntohl(packet->r.fb.fci[i]);
+                pid = fci >> 16;
+                blp = fci & 0xffff;
+                retransmit(session, pid);
+                for (j = 0; j < 16; j++) {
+                        if (blp & (1 << j)) {
+                                retransmit(session, pid + j + 1);
+                        }
+                }
+        }
+}
+
+static void process_rtcp_psfb(struct rtp *session, rtcp_t * packet)
+{
+        /* A PLI (RFC 4585 section 6.3.1) names the media source in the */
+        /* header, a FIR (RFC 5104 section 4.3.1) in every FCI entry,   */
+        /* together with a seq nr. Either way we owe a keyframe.        */
+        int words = ntohs(packet->common.length) - 2;
+        int i;
+
+        switch (packet->common.count) {
+        case RTCP_FB_PLI:
+                if (ntohl(packet->r.fb.media_ssrc) == session->my_ssrc) {
+                        session->keyframes_requested++;
+                }
+                break;
+        case RTCP_FB_FIR:
+                for (i = 0; i + 1 < words; i += 2) {
+                        if (ntohl(packet->r.fb.fci[i]) == session->my_ssrc) {
+                                session->keyframes_requested++;
+                                break;
+                        }
+                }
+                break;
+        default:
+                debug_msg("PSFB packet with unknown format (%d) ignored.\n",
+                          packet->common.count);
+                break;
+        }
+}
+
 static void process_rtcp_sdes(struct rtp *session, rtcp_t * packet)
 {
         int count = packet->common.count;
@@ -2056,6 +2550,11 @@ static void rtp_process_ctrl(struct rtp *session, uint8_t * buffer, int buflen)
                                         process_rtcp_rr(session, packet);
                                         break;
                                 case RTCP_RX:
+                                        if (!session->tfrc_on) {
+                                                /* ...then it is an RTCP_RTPFB */
+                                                process_rtcp_rtpfb(session, packet);
+                                                break;
+                                        }
                                         /* am not sending up a RX_RTCP_START... */
                                         process_rtcp_rx(session, packet);
                                         if (session->tfrc_on) {
@@ -2070,9 +2569,7 @@ static void rtp_process_ctrl(struct rtp *session, uint8_t * buffer, int buflen)
                                                 /* compute the rtt time */
                                                 compute_rtt(session,
                                                             packet->r.rx.rx);
-                                        } else
-                                                debug_msg
-                                                    ("RTCP_RX received without congestion control?");
+                                        }
                                         break;
                                 case RTCP_SDES:
                                         if (first
@@ -2121,6 +2618,9 @@ static void rtp_process_ctrl(struct rtp *session, uint8_t * buffer, int buflen)
                                         }
                                         process_rtcp_app(session, packet);
                                         break;
+                                case RTCP_PSFB:
+                                        process_rtcp_psfb(session, packet);
+                                        break;
                                 default:
                                         debug_msg
                                             ("RTCP packet with unknown type (%d) ignored.\n",
@@ -2180,7 +2680,7 @@ int rtp_recv(struct rtp *session, struct timeval *timeout, uint32_t curr_rtp_ts)
         udp_fd_set(session->rtcp_socket);
         if (udp_select(timeout) > 0) {
                 if (udp_fd_isset(session->rtp_socket)) {
-                        rtp_recv_data(session, curr_rtp_ts);
+                        rtp_recv_data(session, curr_rtp_ts, NULL);
                 }
                 if (udp_fd_isset(session->rtcp_socket)) {
                         uint8_t buffer[RTP_MAX_PACKET_LEN];
@@ -2211,7 +2711,7 @@ int rtp_recv_r(struct rtp *session, struct timeval *timeout, uint32_t curr_rtp_t
         udp_fd_set_r(session->rtcp_socket, &fd);
         if (udp_select_r(timeout, &fd) > 0) {
                 if (udp_fd_isset_r(session->rtp_socket, &fd)) {
-                        rtp_recv_data(session, curr_rtp_ts);
+                        rtp_recv_data(session, curr_rtp_ts, NULL);
                 }
                 if (udp_fd_isset_r(session->rtcp_socket, &fd)) {
                         uint8_t buffer[RTP_MAX_PACKET_LEN];
@@ -2230,6 +2730,56 @@ int rtp_recv_r(struct rtp *session, struct timeval *timeout, uint32_t curr_rtp_t
 }
 
 
+/**
+ * rtp_recv_nonblock:
+ * @session: the session pointer (returned by rtp_init())
+ * @curr_rtp_ts: the current time expressed in units of the media
+ * timestamp.
+ * @budget: maximum number of RTP batches to read.
+ *
+ * Reads and dispatches the RTP and RTCP packets already queued on the
+ * session sockets, without waiting for more. Meant for event loops that
+ * learn about readable sockets on their own, see rtp_reactor.h.
+ *
+ * Returns: TRUE if RTP packets may still be queued because @budget ran
+ * out, FALSE if the sockets were drained.
+ */
+int rtp_recv_nonblock(struct rtp *session, uint32_t curr_rtp_ts, int budget)
+{
+        uint8_t buffer[RTP_MAX_PACKET_LEN];
+        char *buffers[1] = { (char *) buffer };
+        int buflen;
+        int count = RTP_RECV_BATCH;
+
+        check_database(session);
+        while (budget-- > 0 && count == RTP_RECV_BATCH) {
+                rtp_recv_data(session, curr_rtp_ts, &count);
+        }
+        while (udp_recv_batch(session->rtcp_socket, buffers,
+                              RTP_MAX_PACKET_LEN, &buflen, 1) == 1) {
+                ntp64_time(&tmp_sec, &tmp_frac);
+                rtp_process_ctrl(session, buffer, buflen);
+        }
+        check_database(session);
+
+        return count == RTP_RECV_BATCH;
+}
+
+/**
+ * rtp_get_fds:
+ * @session: the session pointer (returned by rtp_init())
+ * @rtp_fd: receives the descriptor of the RTP socket.
+ * @rtcp_fd: receives the descriptor of the RTCP socket.
+ *
+ * Exposes the session sockets so they can be watched by an external
+ * event loop. They must only be read through rtp_recv_nonblock().
+ */
+void rtp_get_fds(struct rtp *session, int *rtp_fd, int *rtcp_fd)
+{
+        *rtp_fd = udp_fd(session->rtp_socket);
+        *rtcp_fd = udp_fd(session->rtcp_socket);
+}
+
 /**
  * rtp_recv_poll_r:
  * The meaning is as above with except that this function polls for first
@@ -2256,7 +2806,7 @@ int rtp_recv_poll_r(struct rtp **sessions, struct timeval *timeout, uint32_t cur
                 int received_bytes = 0;
                 for(current = sessions; *current != NULL; ++current) {
                         if (udp_fd_isset_r((*current)->rtp_socket, &fd)) {
-                                received_bytes = rtp_recv_data(*current, curr_rtp_ts);
+                                received_bytes = rtp_recv_data(*current, curr_rtp_ts, NULL);
                         }
                         if (udp_fd_isset_r((*current)->rtcp_socket, &fd)) {
                                 uint8_t buffer[RTP_MAX_PACKET_LEN];
@@ -2549,6 +3099,34 @@ const rtcp_rr *rtp_get_rr(struct rtp *session, uint32_t reporter,
  * 
  * Return value: Number of bytes transmitted.
  **/
+static void history_store(struct rtp_history *history, uint16_t seq,
+                          uint8_t *hdr, int hdr_len, char *phdr, int phdr_len,
+                          char *data, int data_len)
+{
+        struct rtp_history_slot *slot = &history->slots[seq & (history->size - 1)];
+        int len = hdr_len + phdr_len + data_len;
+        uint8_t *buffer;
+
+        slot->len = 0;
+        if (slot->size < len) {
+                buffer = (uint8_t *) realloc(slot->data, len);
+                if (buffer == NULL) {
+                        return;
+                }
+                slot->data = buffer;
+                slot->size = len;
+        }
+        memcpy(slot->data, hdr, hdr_len);
+        if (phdr_len > 0) {
+                memcpy(slot->data + hdr_len, phdr, phdr_len);
+        }
+        if (data_len > 0) {
+                memcpy(slot->data + hdr_len + phdr_len, data, data_len);
+        }
+        slot->seq = seq;
+        slot->len = len;
+}
+
 int rtp_send_data(struct rtp *session, uint32_t rtp_ts, char pt, int m,
                   int cc, uint32_t * csrc,
                   char *data, int data_len,
@@ -2558,6 +3136,58 @@ int rtp_send_data(struct rtp *session, uint32_t rtp_ts, char pt, int m,
                                  data, data_len, extn, extn_len, extn_type);
 }
 
+/*
+ * Sends the FEC packets made ready by the last packet. They follow the
+ * packets they protect, in the batch in progress if there is one.
+ */
+static void send_fec(struct rtp *session)
+{
+        uint8_t buffer[RTP_MAX_PACKET_LEN];
+        uint32_t *hdr = (uint32_t *) (void *) buffer;
+        struct rtp_batch *batch = session->batch;
+        struct rtp_batch_slot *slot;
+        uint32_t ts;
+        int len;
+
+        /* The protected SSRC goes in the CSRC list, so FEC packets have */
+        /* a seqno space of their own and never open holes in the media. */
+        while ((len = fec_xor_encoder_pop(session->fec, buffer + 16,
+                                          sizeof(buffer) - 16, &ts)) > 0) {
+                hdr[0] = htonl((2u << 30) | (1u << 24) | ((session->fec_pt & 0x7fu) << 16)
+                               | session->fec_seq++);
+                hdr[1] = htonl(ts);
+                hdr[2] = htonl(session->fec_ssrc);
+                hdr[3] = htonl(session->my_ssrc);
+                rtp_pace(session, 16 + len, TRUE);
+                session->rtp_bytes_sent += 16 + len;
+
+                if (batch == NULL || !batch->active) {
+                        if (udp_send(session->rtp_socket, (char *) buffer, 16 + len) == -1) {
+                                perror("sending FEC packet");
+                        }
+                        continue;
+                }
+                if (batch->count == UDP_MAX_BATCH
+                    || batch->fec_len + 16 + len > RTP_BATCH_FEC_LEN) {
+                        rtp_send_batch_flush(session);
+                        batch->active = TRUE;
+                }
+                slot = &batch->slots[batch->count];
+                memcpy(batch->fec + batch->fec_len, buffer, 16 + len);
+#ifdef WIN32
+                slot->vector[0].buf = (char *) batch->fec + batch->fec_len;
+                slot->vector[0].len = 16 + len;
+#else
+                slot->vector[0].iov_base = batch->fec + batch->fec_len;
+                slot->vector[0].iov_len = 16 + len;
+#endif
+                batch->fec_len += 16 + len;
+                batch->vectors[batch->count] = slot->vector;
+                batch->counts[batch->count] = 1;
+                batch->count++;
+        }
+}
+
 int
 rtp_send_data_hdr(struct rtp *session,
                   uint32_t rtp_ts, char pt, int m,
@@ -2567,15 +3197,20 @@ rtp_send_data_hdr(struct rtp *session,
                   char *extn, uint16_t extn_len, uint16_t extn_type)
 {
         int vlen, buffer_len, i, rc, pad, pad_len;
+        uint16_t seq;
         uint8_t *buffer = NULL;
+        uint8_t *heap_buffer = NULL;
         rtp_packet *packet = NULL;
         uint8_t initVec[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+        /* Room for the header of any packet without a header extension */
+        uint32_t stack_buffer[(RTP_PACKET_HEADER_SIZE + 20 + 4 * 15) / 4];
 #ifdef WIN32
         WSABUF send_vector[3];
 #else
         struct iovec send_vector[3];
 #endif
         int send_vector_len;
+        struct rtp_batch_slot *slot = NULL;
 
         check_database(session);
 
@@ -2617,11 +3252,39 @@ rtp_send_data_hdr(struct rtp *session,
         pad = FALSE;            /* FIXME */
         pad_len = 0;
 
-        /* Allocate memory for the packet... */
+        /* Wait for the pacers before the packet takes a batch slot */
+        rtp_pace(session, buffer_len + (phdr != NULL ? phdr_len : 0) + data_len, TRUE);
+
+        /* Queue the packet if a batch is open and its headers fit a slot... */
+        if (session->batch != NULL && session->batch->active && extn == NULL
+            && buffer_len + (phdr != NULL ? phdr_len : 0) <= RTP_BATCH_HDR_MAX) {
+                if (session->batch->count == UDP_MAX_BATCH) {
+                        rtp_send_batch_flush(session);
+                        session->batch->active = TRUE;
+                }
+                slot = &session->batch->slots[session->batch->count];
+                buffer = slot->buffer;
+                packet = (rtp_packet *) buffer;
+        }
+
+        /* ...otherwise build it on the stack, only extensions may not fit, */
+        /* and send it after the queued packets instead of overtaking them  */
         if (buffer == NULL) {
+                if (session->batch != NULL && session->batch->active
+                    && session->batch->count > 0) {
+                        rtp_send_batch_flush(session);
+                        session->batch->active = TRUE;
+                }
                 assert(buffer_len < RTP_MAX_PACKET_LEN);
-                /* we dont always need 20 (12|16) but this seems to work. LG */
-                buffer = (uint8_t *) malloc(20 + RTP_PACKET_HEADER_SIZE);
+                if (RTP_PACKET_HEADER_SIZE + buffer_len <= (int) sizeof(stack_buffer)) {
+                        buffer = (uint8_t *) stack_buffer;
+                } else {
+                        buffer = heap_buffer = (uint8_t *) malloc(RTP_PACKET_HEADER_SIZE + buffer_len);
+                        if (buffer == NULL) {
+                                debug_msg("Failed to allocate RTP header\n");
+                                return -1;
+                        }
+                }
                 packet = (rtp_packet *) buffer;
         }
 #ifdef WIN32
@@ -2634,26 +3297,31 @@ rtp_send_data_hdr(struct rtp *session,
         send_vector_len = 1;
 
         /* These are internal pointers into the buffer... */
-#ifdef NDEF
         packet->csrc = (uint32_t *) (buffer + RTP_PACKET_HEADER_SIZE + vlen);
         packet->extn =
             (uint8_t *) (buffer + RTP_PACKET_HEADER_SIZE + vlen + (4 * cc));
-        packet->data =
-            (uint8_t *) (buffer + RTP_PACKET_HEADER_SIZE + vlen + (4 * cc));
-        if (extn != NULL) {
-                packet->data += (extn_len + 1) * 4;
-        }
-#endif
+
         /* ...and the actual packet header... */
-        packet->v = 2;
-        packet->p = pad;
-        packet->x = (extn != NULL);
-        packet->cc = cc;
-        packet->m = m;
-        packet->pt = pt;
-        packet->seq = htons(session->rtp_seq++);
-        packet->ts = htonl(rtp_ts);
-        packet->ssrc = htonl(session->my_ssrc);
+        seq = session->rtp_seq;
+        if (cc == 0 && extn == NULL && !pad) {
+                /* The common case: patch the template */
+                uint32_t *hdr = (uint32_t *) (void *) (buffer + RTP_PACKET_HEADER_SIZE);
+
+                hdr[0] = session->hdr_template[0]
+                    | htonl((m ? 1u << 23 : 0) | ((pt & 0x7fu) << 16) | session->rtp_seq++);
+                hdr[1] = htonl(rtp_ts);
+                hdr[2] = session->hdr_template[2];
+        } else {
+                packet->v = 2;
+                packet->p = pad;
+                packet->x = (extn != NULL);
+                packet->cc = cc;
+                packet->m = m;
+                packet->pt = pt;
+                packet->seq = htons(session->rtp_seq++);
+                packet->ts = htonl(rtp_ts);
+                packet->ssrc = htonl(session->my_ssrc);
+        }
 
         /* ... do tfrc stuff... */
         if (session->tfrc_on) {
@@ -2719,24 +3387,119 @@ rtp_send_data_hdr(struct rtp *session,
                                          buffer_len, initVec);
         }
 
-        rc = udp_sendv(session->rtp_socket, send_vector, send_vector_len);
-        if (rc == -1) {
-                perror("sending RTP packet");
+        /* ...keep a copy to answer retransmission requests... */
+        if (session->history != NULL) {
+                history_store(session->history, seq,
+                              buffer + RTP_PACKET_HEADER_SIZE, buffer_len,
+                              phdr, phdr != NULL ? phdr_len : 0, data, data_len);
         }
 
-        free(buffer);
+        if (slot != NULL) {
+                /* ...and queue it, with the payload header right after the RTP header */
+                if (phdr != NULL) {
+                        memcpy(buffer + RTP_PACKET_HEADER_SIZE + buffer_len, phdr, phdr_len);
+                }
+#ifdef WIN32
+                slot->vector[0].buf = buffer + RTP_PACKET_HEADER_SIZE;
+                slot->vector[0].len = buffer_len + (phdr != NULL ? phdr_len : 0);
+                slot->vector[1] = send_vector[send_vector_len - 1];
+                rc = slot->vector[0].len + data_len;
+#else
+                slot->vector[0].iov_base = buffer + RTP_PACKET_HEADER_SIZE;
+                slot->vector[0].iov_len = buffer_len + (phdr != NULL ? phdr_len : 0);
+                slot->vector[1] = send_vector[send_vector_len - 1];
+                rc = slot->vector[0].iov_len + data_len;
+#endif
+                session->batch->vectors[session->batch->count] = slot->vector;
+                session->batch->counts[session->batch->count] = data_len > 0 ? 2 : 1;
+                session->batch->count++;
+        } else {
+                rc = udp_sendv(session->rtp_socket, send_vector, send_vector_len);
+                if (rc == -1) {
+                        perror("sending RTP packet");
+                }
+
+                free(heap_buffer);
+        }
 
         /* Update the RTCP statistics... */
         session->we_sent = TRUE;
         session->rtp_pcount += 1;
         session->rtp_bcount += buffer_len;
         session->rtp_bytes_sent += buffer_len + data_len;
-        gettimeofday(&session->last_rtp_send_time, NULL);
+        if (slot == NULL) {
+                /* Queued packets are stamped once, by rtp_send_batch_flush() */
+                gettimeofday(&session->last_rtp_send_time, NULL);
+        }
+
+        /* ...and protect it, receivers only rebuild plain 12 byte headers */
+        if (session->fec != NULL && buffer_len == 12 && !session->encryption_enabled
+            && fec_xor_encoder_add(session->fec, seq, m, pt, rtp_ts,
+                                   phdr, phdr != NULL ? phdr_len : 0,
+                                   data, data_len) > 0) {
+                send_fec(session);
+        }
 
         check_database(session);
         return rc;
 }
 
+/**
+ * rtp_send_batch_begin:
+ * @session: the session pointer (returned by rtp_init())
+ *
+ * Starts queueing the packets sent with rtp_send_data() and
+ * rtp_send_data_hdr() instead of transmitting each one immediately.
+ * Sequence numbers and statistics are assigned when a packet is queued.
+ * The media data passed to those calls is not copied and must stay valid
+ * until rtp_send_batch_flush(). Queued packets are also flushed whenever
+ * UDP_MAX_BATCH of them are pending.
+ **/
+void rtp_send_batch_begin(struct rtp *session)
+{
+        if (session->batch == NULL) {
+                session->batch = (struct rtp_batch *) calloc(1, sizeof(struct rtp_batch));
+                if (session->batch == NULL) {
+                        debug_msg("rtp_send_batch_begin: malloc error, sending unbatched\n");
+                        return;
+                }
+        }
+        session->batch->active = TRUE;
+}
+
+/**
+ * rtp_send_batch_flush:
+ * @session: the session pointer (returned by rtp_init())
+ *
+ * Transmits the packets queued since rtp_send_batch_begin(), in as few
+ * system calls as possible, and stops queueing.
+ *
+ * Return value: number of packets transmitted, -1 on failure.
+ **/
+int rtp_send_batch_flush(struct rtp *session)
+{
+        struct rtp_batch *batch = session->batch;
+        int rc = 0;
+
+        if (batch == NULL) {
+                return 0;
+        }
+
+        if (batch->count > 0) {
+                rc = udp_sendv_batch(session->rtp_socket, batch->vectors,
+                                     batch->counts, batch->count);
+                if (rc == -1) {
+                        perror("sending RTP packets");
+                }
+                batch->count = 0;
+                batch->fec_len = 0;
+                gettimeofday(&session->last_rtp_send_time, NULL);
+        }
+        batch->active = FALSE;
+
+        return rc;
+}
+
 static int format_report_blocks(rtcp_rr * rrp, int remaining_length,
                                 struct rtp *session)
 {
@@ -2745,6 +3508,7 @@ static int format_report_blocks(rtcp_rr * rrp, int remaining_length,
         source *s;
         uint32_t now_sec;
         uint32_t now_frac;
+        struct rtp_sr_entry sr_entry;
 
         for (h = 0; h < RTP_DB_SIZE; h++) {
                 for (s = session->db[h]; s != NULL; s = s->next) {
@@ -2779,7 +3543,20 @@ static int format_report_blocks(rtcp_rr * rrp, int remaining_length,
                                             expected_interval;
                                 }
 
-                                if (s->sr == NULL) {
+                                if (session->sr_table != NULL
+                                    && sr_table_lookup(session->sr_table, s->ssrc,
+                                                       &sr_entry)) {
+                                        /* The SR may have reached another session */
+                                        ntp64_time(&now_sec, &now_frac);
+                                        lsr =
+                                            ntp64_to_ntp32(sr_entry.ntp_sec,
+                                                           sr_entry.ntp_frac);
+                                        dlsr =
+                                            ntp64_to_ntp32(now_sec,
+                                                           now_frac) -
+                                            ntp64_to_ntp32(sr_entry.recv_sec,
+                                                           sr_entry.recv_frac);
+                                } else if (s->sr == NULL) {
                                         lsr = 0;
                                         dlsr = 0;
                                 } else {
@@ -3057,6 +3834,24 @@ static uint8_t *format_rtcp_app(uint8_t * buffer, int buflen, uint32_t ssrc,
         return buffer + pkt_octets;
 }
 
+/*
+ * The "RTT_" APP packet: the round-trip time the reports of our receivers
+ * measure, in usec, which their TFRC state has no other way to learn.
+ */
+static uint8_t *format_rtcp_rtt(uint8_t * buffer, int buflen, struct rtp *session)
+{
+        uint32_t app_buffer[4];
+        rtcp_app *app = (rtcp_app *) (void *) app_buffer;
+        uint32_t rtt = htonl(session->rc_rtt);
+
+        app->p = 0;
+        app->subtype = 0;
+        app->length = 3;
+        memcpy(app->name, "RTT_", 4);
+        memcpy(app->data, &rtt, 4);
+        return format_rtcp_app(buffer, buflen, rtp_my_ssrc(session), app);
+}
+
 static void send_rtcp(struct rtp *session, uint32_t rtp_ts,
                       rtcp_app_callback appcallback)
 {
@@ -3118,6 +3913,11 @@ static void send_rtcp(struct rtp *session, uint32_t rtp_ts,
                                    session);
         }
 
+        if (session->rc_rtt != 0 && RTP_MAX_PACKET_LEN - (ptr - buffer) >= 16) {
+                lpt = ptr;
+                ptr = format_rtcp_rtt(ptr, RTP_MAX_PACKET_LEN - (ptr - buffer), session);
+        }
+
         /* Finish with as many APP packets as the application will provide. */
         old_ptr = ptr;
         if (appcallback) {
@@ -3173,6 +3973,113 @@ static void send_rtcp(struct rtp *session, uint32_t rtp_ts,
         check_database(session);
 }
 
+static uint8_t *format_rtcp_fb_prefix(struct rtp *session, uint8_t * buffer,
+                                      int buflen)
+{
+        /* Early feedback (RFC 4585 section 3.5) starts with an empty RR */
+        /* and our CNAME, the feedback messages themselves follow.      */
+        rtcp_t *packet = (rtcp_t *) buffer;
+
+        packet->common.version = 2;
+        packet->common.p = 0;
+        packet->common.count = 0;
+        packet->common.pt = RTCP_RR;
+        packet->common.length = htons(1);
+        packet->r.rr.ssrc = htonl(session->my_ssrc);
+        return format_rtcp_sdes(buffer + 8, buflen - 8, session->my_ssrc, session);
+}
+
+static void send_rtcp_nacks(struct rtp *session)
+{
+        /* The generic NACKs, one compound packet per media source, sent */
+        /* where its RTP comes from since we may have no other way.       */
+        uint8_t buffer[RTP_MAX_PACKET_LEN];
+        uint8_t *ptr;
+        rtcp_t *packet;
+        uint32_t ssrc;
+        source *s;
+        int first, n, i;
+
+        for (first = 0; first < session->nack_count; first += n) {
+                ssrc = session->nacks[first].ssrc;
+                for (n = 1; first + n < session->nack_count
+                     && session->nacks[first + n].ssrc == ssrc; n++) {
+                }
+                s = get_source(session, ssrc);
+                if (s == NULL || s->rtp_addr.ss_family == AF_UNSPEC) {
+                        continue;
+                }
+
+                ptr = format_rtcp_fb_prefix(session, buffer, sizeof(buffer) - 12 - 4 * n);
+
+                packet = (rtcp_t *) ptr;
+                packet->common.version = 2;
+                packet->common.p = 0;
+                packet->common.count = RTCP_FB_NACK;
+                packet->common.pt = RTCP_RTPFB;
+                packet->common.length = htons((uint16_t) (2 + n));
+                packet->r.fb.ssrc = htonl(session->my_ssrc);
+                packet->r.fb.media_ssrc = htonl(ssrc);
+                for (i = 0; i < n; i++) {
+                        packet->r.fb.fci[i] = htonl(((uint32_t) session->nacks[first + i].pid << 16)
+                                                    | session->nacks[first + i].blp);
+                }
+                ptr += 12 + 4 * n;
+
+                if (udp_sendto(session->rtcp_socket, (char *) buffer, ptr - buffer,
+                               &s->rtp_addr) == -1) {
+                        perror("sending RTCP NACK");
+                }
+        }
+        session->nack_count = 0;
+}
+
+static void send_rtcp_keyframe_requests(struct rtp *session)
+{
+        /* A PLI or a FIR per media source, sent like the NACKs */
+        uint8_t buffer[RTP_MAX_PACKET_LEN];
+        uint8_t *ptr;
+        rtcp_t *packet;
+        struct rtp_keyframe_request *req;
+        source *s;
+        int i;
+
+        for (i = 0; i < session->keyframe_request_count; i++) {
+                req = &session->keyframe_requests[i];
+                s = get_source(session, req->ssrc);
+                if (s == NULL || s->rtp_addr.ss_family == AF_UNSPEC) {
+                        continue;
+                }
+
+                ptr = format_rtcp_fb_prefix(session, buffer, sizeof(buffer) - 20);
+                packet = (rtcp_t *) ptr;
+                packet->common.version = 2;
+                packet->common.p = 0;
+                packet->common.pt = RTCP_PSFB;
+                packet->r.fb.ssrc = htonl(session->my_ssrc);
+                if (req->fir) {
+                        /* The media source field is unused by a FIR */
+                        packet->common.count = RTCP_FB_FIR;
+                        packet->common.length = htons(4);
+                        packet->r.fb.media_ssrc = 0;
+                        packet->r.fb.fci[0] = htonl(req->ssrc);
+                        packet->r.fb.fci[1] = htonl((uint32_t) ++session->fir_seq << 24);
+                        ptr += 20;
+                } else {
+                        packet->common.count = RTCP_FB_PLI;
+                        packet->common.length = htons(2);
+                        packet->r.fb.media_ssrc = htonl(req->ssrc);
+                        ptr += 12;
+                }
+
+                if (udp_sendto(session->rtcp_socket, (char *) buffer, ptr - buffer,
+                               &s->rtp_addr) == -1) {
+                        perror("sending RTCP keyframe request");
+                }
+        }
+        session->keyframe_request_count = 0;
+}
+
 /**
  * rtp_send_ctrl:
  * @session: the session pointer (returned by rtp_init())
@@ -3185,6 +4092,10 @@ static void send_rtcp(struct rtp *session, uint32_t rtp_ts,
  * whether the local participant is a sender.  This function should be
  * called at least once per second, and can be safely called more
  * frequently.  
+ *
+ * Retransmission and keyframe requests queued with rtp_queue_nack() and
+ * rtp_queue_keyframe_request() are sent right away. A session without
+ * destination only sends those.
  */
 void rtp_send_ctrl(struct rtp *session, uint32_t rtp_ts,
                    rtcp_app_callback appcallback, struct timeval curr_time)
@@ -3192,7 +4103,13 @@ void rtp_send_ctrl(struct rtp *session, uint32_t rtp_ts,
         /* Send an RTCP packet, if one is due... */
 
         check_database(session);
-        if (tv_gt(curr_time, session->next_rtcp_send_time)) {
+        if (session->nack_count > 0) {
+                send_rtcp_nacks(session);
+        }
+        if (session->keyframe_request_count > 0) {
+                send_rtcp_keyframe_requests(session);
+        }
+        if (session->tx_port != 0 && tv_gt(curr_time, session->next_rtcp_send_time)) {
                 /* The RTCP transmission timer has expired. The following */
                 /* implements draft-ietf-avt-rtp-new-02.txt section 6.3.6 */
                 int h;
@@ -3495,6 +4412,17 @@ void rtp_done(struct rtp *session)
          }
          */
 
+        rtp_send_batch_flush(session);
+        free(session->batch);
+        rtp_set_retransmission(session, 0, 0);
+        rtp_set_fec(session, 0, 0, 0);
+        pacer_done(session->pacer);
+        for (i = 0; i < RTP_RECV_BATCH; i++) {
+                rtp_free_packet(session->rx_slots[i]);
+        }
+        /* Packets still held by the application are freed when released */
+        object_pool_done(session->packet_pool);
+
         udp_exit(session->rtp_socket);
         udp_exit(session->rtcp_socket);
         free(session->addr);
@@ -3836,6 +4764,350 @@ uint64_t rtp_get_bytes_sent(struct rtp *session)
         return session->rtp_bytes_sent;
 }
 
+/**
+ * rtp_set_retransmission:
+ * @session: the session pointer (returned by rtp_init())
+ * @history: number of sent packets to keep, rounded up to a power of
+ * two, 0 to stop keeping them.
+ * @budget: packets per second that may be retransmitted.
+ *
+ * Keeps a copy of the packets sent, so that those reported lost by a
+ * generic NACK (RFC 4585) received on the session are sent again with
+ * their original seqno. The session must be read, by rtp_recv_nonblock()
+ * for instance, for the requests to be seen.
+ *
+ * Returns: TRUE on success, FALSE otherwise.
+ */
+int rtp_set_retransmission(struct rtp *session, int history, int budget)
+{
+        struct rtp_history *h = session->history;
+        int i, size;
+
+        if (h != NULL) {
+                for (i = 0; i < h->size; i++) {
+                        free(h->slots[i].data);
+                }
+                free(h->slots);
+                free(h);
+                session->history = NULL;
+        }
+        if (history <= 0) {
+                return TRUE;
+        }
+
+        for (size = 1; size < history && size < RTP_SEQ_MOD; size <<= 1) {
+        }
+        h = (struct rtp_history *) calloc(1, sizeof(struct rtp_history));
+        if (h == NULL) {
+                return FALSE;
+        }
+        h->slots = (struct rtp_history_slot *) calloc(size, sizeof(struct rtp_history_slot));
+        if (h->slots == NULL) {
+                free(h);
+                return FALSE;
+        }
+        h->size = size;
+        h->budget = budget;
+        h->tokens = budget;
+        gettimeofday(&h->last_refill, NULL);
+        session->history = h;
+
+        return TRUE;
+}
+
+uint32_t rtp_get_retransmitted(struct rtp *session)
+{
+        return session->history != NULL ? session->history->retransmitted : 0;
+}
+
+/**
+ * rtp_set_fec:
+ * @session: the session pointer (returned by rtp_init())
+ * @pt: payload type of the FEC packets, 0 to stop sending them.
+ * @cols: packets protected by every row FEC packet.
+ * @rows: rows of a block, protected column by column when more than one.
+ *
+ * Sends XOR parity packets (RFC 5109) after the packets sent on the
+ * session, see fec.h for the layout. They carry @pt, an SSRC and seqnos of
+ * their own, and the SSRC they protect as their only CSRC. Calling it
+ * again with the same parameters keeps the block in progress.
+ *
+ * Returns: TRUE on success, FALSE otherwise.
+ */
+int rtp_set_fec(struct rtp *session, int pt, int cols, int rows)
+{
+        struct fec_xor_encoder *fec = NULL;
+
+        if (pt == 0) {
+                fec_xor_encoder_done(session->fec);
+                session->fec = NULL;
+                session->fec_pt = 0;
+                return TRUE;
+        }
+        if (session->fec != NULL && pt == session->fec_pt
+            && cols == session->fec_cols && rows == session->fec_rows) {
+                return TRUE;
+        }
+
+        fec = fec_xor_encoder_init(cols, rows);
+        if (fec == NULL) {
+                return FALSE;
+        }
+        if (session->fec == NULL) {
+                session->fec_ssrc = (uint32_t) lrand48();
+                session->fec_seq = (uint16_t) lrand48();
+        }
+        fec_xor_encoder_done(session->fec);
+        session->fec = fec;
+        session->fec_pt = pt;
+        session->fec_cols = cols;
+        session->fec_rows = rows;
+
+        return TRUE;
+}
+
+/**
+ * rtp_set_pacing:
+ * @session: the session pointer (returned by rtp_init())
+ * @rate: bits per second the session may send, 0 for no limit.
+ * @burst: bytes that may be sent at once after an idle period.
+ *
+ * Paces the packets sent on the session with a token bucket (see
+ * pacer.h). A sender that runs out of tokens sends what it has batched
+ * and sleeps until it may go on. Retransmissions are charged too, without
+ * waiting. May be called while another thread sends on the session.
+ *
+ * Returns: TRUE on success, FALSE otherwise.
+ */
+int rtp_set_pacing(struct rtp *session, uint64_t rate, uint32_t burst)
+{
+        struct pacer *pacer;
+
+        if (session->pacer != NULL) {
+                pacer_set_rate(session->pacer, rate, burst);
+                return TRUE;
+        }
+        if (rate == 0) {
+                return TRUE;
+        }
+
+        /* Kept until rtp_done(), as the sending thread may be using it */
+        pacer = pacer_init(rate, burst);
+        if (pacer == NULL) {
+                return FALSE;
+        }
+        __atomic_store_n(&session->pacer, pacer, __ATOMIC_RELEASE);
+        return TRUE;
+}
+
+/**
+ * rtp_set_shared_pacer:
+ * @session: the session pointer (returned by rtp_init())
+ * @pacer: pacer the session shares with others, NULL to leave it.
+ *
+ * Charges the packets sent on the session to @pacer as well as to the
+ * one of rtp_set_pacing(), so that several sessions fed by one source
+ * share a rate. @pacer must outlive its use by the session.
+ */
+void rtp_set_shared_pacer(struct rtp *session, struct pacer *pacer)
+{
+        __atomic_store_n(&session->shared_pacer, pacer, __ATOMIC_RELEASE);
+}
+
+/**
+ * rtp_sr_table_init:
+ *
+ * Creates the table where sessions receiving the same sources on a shared
+ * port keep their last sender reports, see rtp_set_sr_table().
+ *
+ * Returns: the table, NULL on allocation failure.
+ */
+struct rtp_sr_table *rtp_sr_table_init(void)
+{
+        struct rtp_sr_table *table;
+
+        table = (struct rtp_sr_table *) calloc(1, sizeof(struct rtp_sr_table));
+        if (table == NULL) {
+                return NULL;
+        }
+        pthread_mutex_init(&table->lock, NULL);
+        return table;
+}
+
+/**
+ * rtp_sr_table_done:
+ * @table: table from rtp_sr_table_init(), no longer used by any session.
+ */
+void rtp_sr_table_done(struct rtp_sr_table *table)
+{
+        if (table == NULL) {
+                return;
+        }
+        pthread_mutex_destroy(&table->lock);
+        free(table);
+}
+
+/**
+ * rtp_set_sr_table:
+ * @session: the session pointer (returned by rtp_init())
+ * @table: table the session shares with others, NULL to leave it.
+ *
+ * Keeps the SRs received on the session in @table, and takes the last SR
+ * of a source from it to fill the LSR and DLSR of the reception reports.
+ * Sessions that bind the same RTCP port with SO_REUSEPORT need it, as the
+ * SRs of a source may be delivered to any of them. Must be called before
+ * the session is read. @table must outlive its use by the session.
+ */
+void rtp_set_sr_table(struct rtp *session, struct rtp_sr_table *table)
+{
+        session->sr_table = table;
+}
+
+/**
+ * rtp_set_rate_control:
+ * @session: the session pointer (returned by rtp_init())
+ * @min_rate: lowest target, in bits per second, 0 to turn rate control off.
+ * @max_rate: highest target, in bits per second.
+ *
+ * Turns the reception reports about our source into a target sending
+ * rate, see rtp_get_target_rate(). The session does not enforce it: the
+ * source is expected to produce data at that rate. The target starts at
+ * the rate the source sends between the first two reports.
+ *
+ * Returns: TRUE on success, FALSE if @max_rate is below @min_rate.
+ */
+int rtp_set_rate_control(struct rtp *session, uint64_t min_rate, uint64_t max_rate)
+{
+        if (min_rate > 0 && max_rate < min_rate) {
+                debug_msg("Rate control bounds %llu > %llu\n",
+                          (unsigned long long) min_rate, (unsigned long long) max_rate);
+                return FALSE;
+        }
+
+        session->rc_min_rate = min_rate;
+        session->rc_max_rate = max_rate;
+        session->rc_rate = 0;
+        timerclear(&session->rc_report_time);
+        return TRUE;
+}
+
+/**
+ * rtp_get_target_rate:
+ * @session: the session pointer (returned by rtp_init())
+ *
+ * The session must be read, by rtp_recv_nonblock() for instance, for the
+ * reports to be seen.
+ *
+ * Returns: rate, in bits per second, the receivers of our source can take
+ * according to their reports, 0 if rate control is off or the reports
+ * do not tell yet.
+ */
+uint64_t rtp_get_target_rate(struct rtp *session)
+{
+        if (session->rc_min_rate == 0 || !timerisset(&session->rc_report_time)) {
+                return 0;
+        }
+        return (uint64_t) session->rc_rate;
+}
+
+/**
+ * rtp_queue_nack:
+ * @session: the session pointer (returned by rtp_init())
+ * @ssrc: source the packet was expected from.
+ * @seq: seqno of the lost packet.
+ *
+ * Asks @ssrc to send a packet again with the next rtp_send_ctrl(). Seqnos
+ * of a source are best queued in ascending order, so that up to 17 of
+ * them share a generic NACK entry.
+ *
+ * Returns: TRUE if queued, FALSE if too many requests are pending.
+ */
+int rtp_queue_nack(struct rtp *session, uint32_t ssrc, uint16_t seq)
+{
+        struct rtp_nack_fci *fci;
+        uint16_t delta;
+
+        if (session->nack_count > 0) {
+                fci = &session->nacks[session->nack_count - 1];
+                delta = seq - fci->pid;
+                if (fci->ssrc == ssrc && delta <= 16) {
+                        if (delta > 0) {
+                                fci->blp |= 1 << (delta - 1);
+                        }
+                        return TRUE;
+                }
+        }
+        if (session->nack_count == RTP_MAX_NACK_FCI) {
+                return FALSE;
+        }
+
+        fci = &session->nacks[session->nack_count++];
+        fci->ssrc = ssrc;
+        fci->pid = seq;
+        fci->blp = 0;
+        return TRUE;
+}
+
+/**
+ * rtp_queue_keyframe_request:
+ * @session: the session pointer (returned by rtp_init())
+ * @ssrc: source whose pictures cannot be decoded.
+ * @fir: TRUE to send a Full Intra Request (RFC 5104), for a decoder that
+ * never got a keyframe of @ssrc, FALSE to send a Picture Loss Indication
+ * (RFC 4585), for one that lost data since.
+ *
+ * Asks @ssrc for a keyframe with the next rtp_send_ctrl(). Repeating the
+ * request until the keyframe arrives is up to the caller.
+ *
+ * Returns: TRUE if queued, FALSE if too many requests are pending.
+ */
+int rtp_queue_keyframe_request(struct rtp *session, uint32_t ssrc, int fir)
+{
+        struct rtp_keyframe_request *req;
+        int i;
+
+        for (i = 0; i < session->keyframe_request_count; i++) {
+                req = &session->keyframe_requests[i];
+                if (req->ssrc == ssrc) {
+                        req->fir |= fir;
+                        return TRUE;
+                }
+        }
+        if (session->keyframe_request_count == RTP_MAX_KEYFRAME_REQUESTS) {
+                return FALSE;
+        }
+
+        req = &session->keyframe_requests[session->keyframe_request_count++];
+        req->ssrc = ssrc;
+        req->fir = fir;
+        return TRUE;
+}
+
+/**
+ * rtp_get_keyframe_requests:
+ * @session: the session pointer (returned by rtp_init())
+ *
+ * The session must be read, by rtp_recv_nonblock() for instance, for the
+ * requests to be seen.
+ *
+ * Returns: number of PLIs and FIRs about our source received so far. A
+ * sender compares it with the value it last acted upon.
+ */
+uint32_t rtp_get_keyframe_requests(struct rtp *session)
+{
+        return session->keyframes_requested;
+}
+
+uint32_t rtp_get_jitter(struct rtp *session, uint32_t ssrc)
+{
+        source *s = get_source(session, ssrc);
+
+        if (s == NULL) {
+                return 0;
+        }
+        return s->jitter / 16;
+}
+
 int rtp_compute_fract_lost(struct rtp *session, uint32_t ssrc)
 {
         int h;
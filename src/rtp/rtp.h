@@ -208,9 +208,12 @@ typedef enum {
         RTP_OPT_PROMISC 	  = 1,
         RTP_OPT_WEAK_VALIDATION	  = 2,
         RTP_OPT_FILTER_MY_PACKETS = 3,
-	RTP_OPT_REUSE_PACKET_BUFS = 4,	/* Each data packet is written into the same buffer, */
-	                                /* rather than malloc()ing a new buffer each time.   */
-	RTP_OPT_PEEK              = 5
+	RTP_OPT_REUSE_PACKET_BUFS = 4,	/* Ignored: data packets always come from a per      */
+	                                /* session pool, see rtp_free_packet().              */
+	RTP_OPT_PEEK              = 5,
+	RTP_OPT_NACK              = 6	/* Set by the application when it queues   */
+	                                /* retransmission requests, see             */
+	                                /* rtp_queue_nack().                        */
 } rtp_option;
 
 /* API */
@@ -241,6 +244,10 @@ int 		 rtp_recv_r(struct rtp *session,
 			  struct timeval *timeout, uint32_t curr_rtp_ts);
 int 		 rtp_recv_poll_r(struct rtp **sessions, 
 			  struct timeval *timeout, uint32_t curr_rtp_ts);
+int 		 rtp_recv_nonblock(struct rtp *session,
+			  uint32_t curr_rtp_ts, int budget);
+void 		 rtp_get_fds(struct rtp *session, int *rtp_fd, int *rtcp_fd);
+void 		 rtp_free_packet(rtp_packet *packet);
 int 		 rtp_recv_push_data(struct rtp *session,
 			  char *buffer, int buffer_len, uint32_t curr_rtp_ts);
 
@@ -255,6 +262,8 @@ int 		 rtp_send_data_hdr(struct rtp *session,
                                char *phdr, int phdr_len, 
                                char *data, int data_len, 
 			       char *extn, uint16_t extn_len, uint16_t extn_type);
+void 		 rtp_send_batch_begin(struct rtp *session);
+int 		 rtp_send_batch_flush(struct rtp *session);
 void 		 rtp_send_ctrl(struct rtp *session, uint32_t rtp_ts, 
 			       rtcp_app_callback appcallback, struct timeval curr_time);
 void 		 rtp_update(struct rtp *session, struct timeval curr_time);
@@ -288,4 +297,33 @@ void             rtp_flush_recv_buf(struct rtp *session);
 int              rtp_change_dest(struct rtp *session, const char *addr);
 uint64_t         rtp_get_bytes_sent(struct rtp *session);
 int              rtp_compute_fract_lost(struct rtp *session, uint32_t ssrc);
+/* Interarrival jitter of ssrc in timestamp units (1/90000 s for video), 0 if unknown */
+uint32_t         rtp_get_jitter(struct rtp *session, uint32_t ssrc);
+
+/* Generic NACK (RFC 4585) retransmission */
+int              rtp_set_retransmission(struct rtp *session, int history, int budget);
+uint32_t         rtp_get_retransmitted(struct rtp *session);
+int              rtp_queue_nack(struct rtp *session, uint32_t ssrc, uint16_t seq);
+
+/* PLI and FIR keyframe requests (RFC 4585, RFC 5104) */
+int              rtp_queue_keyframe_request(struct rtp *session, uint32_t ssrc, int fir);
+uint32_t         rtp_get_keyframe_requests(struct rtp *session);
+
+/* XOR parity FEC (RFC 5109), see fec.h */
+int              rtp_set_fec(struct rtp *session, int pt, int cols, int rows);
+
+/* Token bucket pacing, see utils/pacer.h */
+struct pacer;
+int              rtp_set_pacing(struct rtp *session, uint64_t rate, uint32_t burst);
+void             rtp_set_shared_pacer(struct rtp *session, struct pacer *pacer);
+
+/* Sender reports shared by sessions bound to the same port */
+struct rtp_sr_table;
+struct rtp_sr_table *rtp_sr_table_init(void);
+void             rtp_sr_table_done(struct rtp_sr_table *table);
+void             rtp_set_sr_table(struct rtp *session, struct rtp_sr_table *table);
+
+/* Sending rate control from reception reports and TFRC feedback */
+int              rtp_set_rate_control(struct rtp *session, uint64_t min_rate, uint64_t max_rate);
+uint64_t         rtp_get_target_rate(struct rtp *session);
 #endif /* __RTP_H__ */
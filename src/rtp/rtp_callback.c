@@ -78,6 +78,9 @@ struct iovec iov[10];
 
 uint32_t RTT = 0;
 
+/* Seqnos asked again per received packet at most */
+#define MAX_NACKS_PER_PACKET 64
+
 static void process_rr(struct rtp *session, rtp_event * e)
 {
         float fract_lost, tmp;
@@ -121,6 +124,43 @@ static void process_rr(struct rtp *session, rtp_event * e)
         }
 }
 
+static void
+request_retransmissions(struct rtp *session, struct pdb_e *state,
+                        struct timeval curr_time)
+{
+        /* Ask the sender again for the packets its frames are missing. */
+        /* The requests go out with the next rtp_send_ctrl().           */
+        uint16_t seqs[MAX_NACKS_PER_PACKET];
+        int i, n;
+
+        n = pbuf_get_nacks(state->playout_buffer, curr_time, seqs,
+                           MAX_NACKS_PER_PACKET);
+        for (i = 0; i < n; i++) {
+                if (!rtp_queue_nack(session, state->ssrc, seqs[i])) {
+                        break;
+                }
+        }
+}
+
+static void
+process_fec(struct pdb *participants, rtp_packet * pckt)
+{
+        /* FEC packets name the source they protect as their only CSRC, */
+        /* and are kept by its playout buffer until they can be used.   */
+        struct pdb_e *state = NULL;
+
+        if (pckt->cc == 1) {
+                state = pdb_get(participants, pckt->csrc[0]);
+        }
+        if (state == NULL || state->playout_buffer == NULL) {
+                rtp_free_packet(pckt);
+                return;
+        }
+        if (pbuf_insert_fec(state->playout_buffer, pckt)) {
+                pdb_push_ready(participants, state);
+        }
+}
+
 static void
 process_sdes(struct pdb *participants, uint32_t ssrc, rtcp_sdes_item * d)
 {
@@ -198,15 +238,29 @@ void rtp_recv_callback(struct rtp *session, rtp_event * e)
         struct pdb *participants = (struct pdb *)rtp_get_userdata(session);
         struct pdb_e *state = pdb_get(participants, e->ssrc);
         struct timeval curr_time;
+        int nack;
 
         switch (e->type) {
         case RX_RTP:
-                if (pckt_rtp->data_len > 0) {   /* Only process packets that contain data... */
-                        pbuf_insert(state->playout_buffer, pckt_rtp);
+                if (pckt_rtp->pt == PT_ULPFEC) {
+                        process_fec(participants, pckt_rtp);
+                        break;
                 }
                 gettimeofday(&curr_time, NULL);
                 tfrc_recv_data(state->tfrc_state, curr_time, pckt_rtp->seq,
                                pckt_rtp->data_len + 40);
+                if (pckt_rtp->data_len > 0) {   /* Only process packets that contain data... */
+                        pbuf_update_jitter(state->playout_buffer,
+                                        rtp_get_jitter(session, e->ssrc) / 90000.0);
+                        if (pbuf_insert(state->playout_buffer, pckt_rtp)) {
+                                pdb_push_ready(participants, state);
+                        }
+                        if (rtp_get_option(session, RTP_OPT_NACK, &nack) && nack) {
+                                request_retransmissions(session, state, curr_time);
+                        }
+                } else {
+                        rtp_free_packet(pckt_rtp);
+                }
                 break;
         case RX_TFRC_RX:
                 /* compute TCP friendly data rate */
@@ -227,12 +281,14 @@ void rtp_recv_callback(struct rtp *session, rtp_event * e)
                 break;
         case RX_APP:
                 pckt_app = (rtcp_app *) e->data;
-                if (strncmp(pckt_app->name, "RTT_", 4) == 0) {
-                        assert(pckt_app->length == 3);
-                        assert(pckt_app->subtype == 0);
+                /* Sent by rtp.c along the reports of a rate controlled source */
+                if (strncmp(pckt_app->name, "RTT_", 4) == 0 && pckt_app->length == 3
+                    && pckt_app->subtype == 0 && state != NULL && state->tfrc_state != NULL) {
                         gettimeofday(&curr_time, NULL);
-//                      tfrc_recv_rtt(state->tfrc_state, curr_time, ntohl(*((int *) pckt_app->data)));
+                        tfrc_recv_rtt(state->tfrc_state, curr_time,
+                                      ntohl(*((uint32_t *) (void *) pckt_app->data)));
                 }
+                free(pckt_app);
                 break;
         case RX_BYE:
                 break;
@@ -243,6 +299,10 @@ void rtp_recv_callback(struct rtp *session, rtp_event * e)
                                 if (pdb_item->decoder_state_deleter) {
                                         pdb_item->decoder_state_deleter(pdb_item->decoder_state);
                                 }
+                                pbuf_destroy(pdb_item->playout_buffer);
+                                pdb_item->playout_buffer = NULL;
+                                tfrc_done(pdb_item->tfrc_state);
+                                pdb_item->tfrc_state = NULL;
                         }
                 }
                 break;
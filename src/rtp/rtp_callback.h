@@ -52,6 +52,7 @@
 #define PT_ENCRYPT_AUDIO    25
 #define PT_H264             96
 #define PT_DynRTP_Type97    97 /* mU-law stereo amongst others */
+#define PT_ULPFEC           127 /* XOR parity of another SSRC, see rtp/fec.h */
 
 /*
  * Video payload
@@ -0,0 +1,347 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#include "config_unix.h"
+#include "config_win32.h"
+#endif
+
+#include <sys/epoll.h>
+#include "debug.h"
+#include "tv.h"
+#include "rtp/rtp_reactor.h"
+
+#define REACTOR_EVENTS 64
+
+struct reactor_thread;
+
+struct reactor_entry {
+        struct rtp *session;            ///< NULL once removed
+        rtp_reactor_cb cb;
+        void *arg;
+        struct reactor_thread *thread;
+        int pending;                    ///< in the pending list
+        struct reactor_entry *next;     ///< in entries, then in dead
+        struct reactor_entry *pending_next;
+};
+
+struct reactor_thread {
+        struct rtp_reactor *reactor;
+        pthread_t thread;
+        int running;
+        int epfd;
+        int count;
+        pthread_mutex_t lock;           ///< held while serving sessions
+        struct reactor_entry *entries;
+        /* Removed entries, freed before the next epoll_wait may return them */
+        struct reactor_entry *dead;
+        /* Sessions that still had packets when their budget ran out */
+        struct reactor_entry *pending_first;
+        struct reactor_entry *pending_last;
+        struct timeval last_tick;
+};
+
+struct rtp_reactor {
+        int run;
+        int thread_count;
+        pthread_mutex_t lock;           ///< serializes add and remove
+        struct reactor_thread *threads;
+};
+
+static void *reactor_thread_run(void *arg);
+
+static void push_pending(struct reactor_thread *t, struct reactor_entry *e)
+{
+        e->pending = TRUE;
+        e->pending_next = NULL;
+        if (t->pending_last == NULL) {
+                t->pending_first = e;
+        } else {
+                t->pending_last->pending_next = e;
+        }
+        t->pending_last = e;
+}
+
+static struct reactor_entry *pop_pending(struct reactor_thread *t)
+{
+        struct reactor_entry *e = t->pending_first;
+
+        if (e != NULL) {
+                t->pending_first = e->pending_next;
+                if (t->pending_first == NULL) {
+                        t->pending_last = NULL;
+                }
+                e->pending = FALSE;
+        }
+        return e;
+}
+
+static void unlink_pending(struct reactor_thread *t, struct reactor_entry *e)
+{
+        struct reactor_entry **prev;
+
+        for (prev = &t->pending_first; *prev != NULL; prev = &(*prev)->pending_next) {
+                if (*prev == e) {
+                        *prev = e->pending_next;
+                        break;
+                }
+        }
+        t->pending_last = NULL;
+        for (e = t->pending_first; e != NULL; e = e->pending_next) {
+                t->pending_last = e;
+        }
+}
+
+static void serve(struct reactor_thread *t, struct reactor_entry *e,
+                struct timeval curr_time, uint32_t curr_rtp_ts)
+{
+        int more = rtp_recv_nonblock(e->session, curr_rtp_ts, RTP_REACTOR_BUDGET);
+
+        e->cb(e->session, curr_time, e->arg);
+        if (more && !e->pending) {
+                push_pending(t, e);
+        }
+}
+
+static void *reactor_thread_run(void *arg)
+{
+        struct reactor_thread *t = (struct reactor_thread *) arg;
+        struct epoll_event events[REACTOR_EVENTS];
+        struct reactor_entry *e;
+        struct timeval curr_time;
+        uint32_t curr_rtp_ts;
+        int i, n, pending, timeout_ms;
+
+        gettimeofday(&t->last_tick, NULL);
+
+        while (__atomic_load_n(&t->reactor->run, __ATOMIC_ACQUIRE)) {
+                pthread_mutex_lock(&t->lock);
+                while (t->dead != NULL) {
+                        e = t->dead;
+                        t->dead = e->next;
+                        free(e);
+                }
+                timeout_ms = t->pending_first != NULL ? 0 : RTP_REACTOR_TICK_US / 1000;
+                pthread_mutex_unlock(&t->lock);
+
+                n = epoll_wait(t->epfd, events, REACTOR_EVENTS, timeout_ms);
+                if (n < 0 && errno != EINTR) {
+                        error_msg("rtp_reactor: epoll_wait failed\n");
+                        break;
+                }
+
+                pthread_mutex_lock(&t->lock);
+                gettimeofday(&curr_time, NULL);
+                curr_rtp_ts = get_local_mediatime();
+
+                for (i = 0; i < n; i++) {
+                        e = (struct reactor_entry *) events[i].data.ptr;
+                        if (e->session != NULL) {
+                                serve(t, e, curr_time, curr_rtp_ts);
+                        }
+                }
+
+                // Sessions queued during this round wait for the next one
+                pending = 0;
+                for (e = t->pending_first; e != NULL; e = e->pending_next) {
+                        pending++;
+                }
+                while (pending-- > 0 && (e = pop_pending(t)) != NULL) {
+                        serve(t, e, curr_time, curr_rtp_ts);
+                }
+
+                if (tv_diff_usec(curr_time, t->last_tick) >= RTP_REACTOR_TICK_US) {
+                        t->last_tick = curr_time;
+                        for (e = t->entries; e != NULL; e = e->next) {
+                                rtp_update(e->session, curr_time);
+                                e->cb(e->session, curr_time, e->arg);
+                        }
+                }
+                pthread_mutex_unlock(&t->lock);
+        }
+
+        return NULL;
+}
+
+struct rtp_reactor *rtp_reactor_init(int threads)
+{
+        struct rtp_reactor *reactor;
+        int i;
+
+        if (threads < 1) {
+                threads = 1;
+        }
+
+        reactor = calloc(1, sizeof(struct rtp_reactor));
+        if (reactor == NULL) {
+                error_msg("rtp_reactor_init: malloc error\n");
+                return NULL;
+        }
+        reactor->threads = calloc(threads, sizeof(struct reactor_thread));
+        if (reactor->threads == NULL) {
+                error_msg("rtp_reactor_init: malloc error\n");
+                free(reactor);
+                return NULL;
+        }
+        pthread_mutex_init(&reactor->lock, NULL);
+        reactor->run = TRUE;
+
+        for (i = 0; i < threads; i++) {
+                struct reactor_thread *t = &reactor->threads[i];
+
+                t->reactor = reactor;
+                t->epfd = epoll_create1(EPOLL_CLOEXEC);
+                if (t->epfd < 0) {
+                        error_msg("rtp_reactor_init: epoll_create1 failed\n");
+                        break;
+                }
+                pthread_mutex_init(&t->lock, NULL);
+                reactor->thread_count++;
+                if (pthread_create(&t->thread, NULL, reactor_thread_run, t) != 0) {
+                        error_msg("rtp_reactor_init: cannot create thread\n");
+                        break;
+                }
+                t->running = TRUE;
+        }
+
+        if (i < threads) {
+                rtp_reactor_done(reactor);
+                return NULL;
+        }
+
+        return reactor;
+}
+
+static int watch_fd(int epfd, int op, int fd, struct reactor_entry *e)
+{
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = e;
+        return epoll_ctl(epfd, op, fd, &ev);
+}
+
+int rtp_reactor_add(struct rtp_reactor *reactor, struct rtp *session,
+                rtp_reactor_cb cb, void *arg)
+{
+        struct reactor_thread *t;
+        struct reactor_entry *e;
+        int rtp_fd, rtcp_fd;
+        int i;
+
+        e = calloc(1, sizeof(struct reactor_entry));
+        if (e == NULL) {
+                error_msg("rtp_reactor_add: malloc error\n");
+                return FALSE;
+        }
+        e->session = session;
+        e->cb = cb;
+        e->arg = arg;
+        rtp_get_fds(session, &rtp_fd, &rtcp_fd);
+
+        pthread_mutex_lock(&reactor->lock);
+        t = &reactor->threads[0];
+        for (i = 1; i < reactor->thread_count; i++) {
+                if (reactor->threads[i].count < t->count) {
+                        t = &reactor->threads[i];
+                }
+        }
+        e->thread = t;
+
+        pthread_mutex_lock(&t->lock);
+        if (watch_fd(t->epfd, EPOLL_CTL_ADD, rtp_fd, e) != 0) {
+                pthread_mutex_unlock(&t->lock);
+                pthread_mutex_unlock(&reactor->lock);
+                error_msg("rtp_reactor_add: cannot watch RTP socket\n");
+                free(e);
+                return FALSE;
+        }
+        if (watch_fd(t->epfd, EPOLL_CTL_ADD, rtcp_fd, e) != 0) {
+                epoll_ctl(t->epfd, EPOLL_CTL_DEL, rtp_fd, NULL);
+                pthread_mutex_unlock(&t->lock);
+                pthread_mutex_unlock(&reactor->lock);
+                error_msg("rtp_reactor_add: cannot watch RTCP socket\n");
+                free(e);
+                return FALSE;
+        }
+        e->next = t->entries;
+        t->entries = e;
+        t->count++;
+        // Packets queued before the sockets were watched raise no edge
+        push_pending(t, e);
+        pthread_mutex_unlock(&t->lock);
+        pthread_mutex_unlock(&reactor->lock);
+
+        return TRUE;
+}
+
+int rtp_reactor_remove(struct rtp_reactor *reactor, struct rtp *session)
+{
+        struct reactor_entry **prev;
+        struct reactor_entry *e;
+        struct reactor_thread *t;
+        int rtp_fd, rtcp_fd;
+        int i;
+
+        rtp_get_fds(session, &rtp_fd, &rtcp_fd);
+
+        pthread_mutex_lock(&reactor->lock);
+        for (i = 0; i < reactor->thread_count; i++) {
+                t = &reactor->threads[i];
+                pthread_mutex_lock(&t->lock);
+                for (prev = &t->entries; *prev != NULL; prev = &(*prev)->next) {
+                        if ((*prev)->session != session) {
+                                continue;
+                        }
+                        e = *prev;
+                        *prev = e->next;
+                        t->count--;
+                        epoll_ctl(t->epfd, EPOLL_CTL_DEL, rtp_fd, NULL);
+                        epoll_ctl(t->epfd, EPOLL_CTL_DEL, rtcp_fd, NULL);
+                        if (e->pending) {
+                                unlink_pending(t, e);
+                        }
+                        // Events already fetched may still point to it
+                        e->session = NULL;
+                        e->next = t->dead;
+                        t->dead = e;
+                        pthread_mutex_unlock(&t->lock);
+                        pthread_mutex_unlock(&reactor->lock);
+                        return TRUE;
+                }
+                pthread_mutex_unlock(&t->lock);
+        }
+        pthread_mutex_unlock(&reactor->lock);
+
+        return FALSE;
+}
+
+void rtp_reactor_done(struct rtp_reactor *reactor)
+{
+        struct reactor_entry *e;
+        int i;
+
+        __atomic_store_n(&reactor->run, FALSE, __ATOMIC_RELEASE);
+
+        for (i = 0; i < reactor->thread_count; i++) {
+                struct reactor_thread *t = &reactor->threads[i];
+
+                if (t->running) {
+                        pthread_join(t->thread, NULL);
+                }
+                close(t->epfd);
+                while (t->entries != NULL) {
+                        e = t->entries;
+                        t->entries = e->next;
+                        free(e);
+                }
+                while (t->dead != NULL) {
+                        e = t->dead;
+                        t->dead = e->next;
+                        free(e);
+                }
+                pthread_mutex_destroy(&t->lock);
+        }
+
+        pthread_mutex_destroy(&reactor->lock);
+        free(reactor->threads);
+        free(reactor);
+}
@@ -0,0 +1,75 @@
+#ifndef RTP_REACTOR_H_
+#define RTP_REACTOR_H_
+
+#include "rtp/rtp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Serves the sockets of many RTP sessions from a fixed set of threads.
+ * Every thread owns an edge triggered epoll set; a session is assigned to
+ * the least loaded thread when added and always served by it, so its
+ * playout buffers are never touched by two reactor threads.
+ *
+ * When a session becomes readable its thread drains the RTP and RTCP
+ * sockets (see rtp_recv_nonblock) and then runs the session callback once.
+ * A session with more queued packets than RTP_REACTOR_BUDGET batches is
+ * put back behind the other ready sessions instead of starving them.
+ * Every RTP_REACTOR_TICK_US each session also gets rtp_update and a
+ * callback, so timeouts progress without traffic.
+ *
+ * usage:
+ * struct rtp_reactor *reactor = rtp_reactor_init(2);
+ * rtp_reactor_add(reactor, session, callback, arg);
+ * ...
+ * rtp_reactor_remove(reactor, session);
+ * rtp_reactor_done(reactor);
+ */
+
+#define RTP_REACTOR_TICK_US 10000
+#define RTP_REACTOR_BUDGET 8
+
+/**
+ * @param session Session that was drained or whose tick expired.
+ * @param curr_time Time of the wakeup.
+ * @param arg Argument given to rtp_reactor_add.
+ */
+typedef void (*rtp_reactor_cb)(struct rtp *session, struct timeval curr_time, void *arg);
+
+struct rtp_reactor;
+
+/**
+ * @param threads Number of serving threads, at least 1.
+ * @return Running reactor, NULL on error.
+ */
+struct rtp_reactor *rtp_reactor_init(int threads);
+
+/**
+ * Starts serving a session. The session must not be read by anybody else
+ * until rtp_reactor_remove returns.
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int rtp_reactor_add(struct rtp_reactor *reactor, struct rtp *session,
+                rtp_reactor_cb cb, void *arg);
+
+/**
+ * Stops serving a session. When it returns the callback of the session
+ * is not running and will not run again. Must not be called from a
+ * reactor callback.
+ * @return TRUE if succeeded, FALSE if session was not served by reactor.
+ */
+int rtp_reactor_remove(struct rtp_reactor *reactor, struct rtp *session);
+
+/**
+ * Stops the threads and frees the reactor. Sessions still added are
+ * left alone and remain owned by the caller.
+ */
+void rtp_reactor_done(struct rtp_reactor *reactor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif// RTP_REACTOR_H_
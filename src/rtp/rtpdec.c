@@ -12,181 +12,214 @@
 
 static const uint8_t start_sequence[] = { 0, 0, 0, 1 };
 
-int fill_coded_frame_from_sps(video_data_frame_t *rx_data, unsigned char *data, int *data_len);
+static int parse_sps(const uint8_t *nal, int nal_len, uint32_t *width, uint32_t *height);
 
-int decode_frame_h264(struct coded_data *cdata, void *rx_data) {
-	rtp_packet *pckt = NULL;
-	struct coded_data *orig = cdata;
+/* Annex-B bytes a packet may produce: STAP-A grows 2 byte sizes to start codes */
+static uint32_t h264_packet_bound(rtp_packet *pckt)
+{
+	if ((pckt->data[0] & 0x1f) == 24) {
+		return 2 * pckt->data_len;
+	}
+	return sizeof(start_sequence) + pckt->data_len;
+}
 
-	uint8_t nal;
-	uint8_t type;
-	uint8_t nri;
+static void update_frame_type(frame_type_t *frame_type, uint8_t nal)
+{
+	uint8_t type = nal & 0x1f;
+
+	if (type == 5) {
+		*frame_type = INTRA;
+	} else if (type >= 1 && type <= 4 && (nal & 0x60) != 0
+			&& *frame_type == BFRAME) {
+		// A reference slice
+		*frame_type = OTHER;
+	}
+}
 
-	int pass;
-	int total_length = 0;
+static void update_sps(struct h264_rx_state *state, const uint8_t *nal, int len)
+{
+	uint32_t width, height;
 
-	unsigned char *dst = NULL;
-	int src_len;
+	if (len == state->sps_len && memcmp(state->sps, nal, len) == 0) {
+		return;
+	}
+	if (parse_sps(nal, len, &width, &height) != 0) {
+		return;
+	}
 
-	video_data_frame_t *frame = (video_data_frame_t *) rx_data;
+	state->width = width;
+	state->height = height;
+	if (len <= H264_MAX_SPS) {
+		memcpy(state->sps, nal, len);
+		state->sps_len = len;
+	} else {
+		state->sps_len = 0;
+	}
+}
 
-	for (pass = 0; pass < 2; pass++) {
+static uint8_t *put_nal(struct h264_rx_data *rx, uint8_t *dst, const uint8_t *nal, int len)
+{
+	update_frame_type(&rx->frame->frame_type, nal[0]);
+	if ((nal[0] & 0x1f) == 7) {
+		update_sps(rx->state, nal, len);
+	}
 
-		if (pass > 0) {
-			cdata = orig;
-			frame->buffer_len = total_length;
-			dst = frame->buffer + total_length;
-            frame->frame_type = BFRAME;
-		}
+	memcpy(dst, start_sequence, sizeof(start_sequence));
+	memcpy(dst + sizeof(start_sequence), nal, len);
+	return dst + sizeof(start_sequence) + len;
+}
 
-		while (cdata != NULL) {
-			pckt = cdata->data;
+int decode_frame_h264(struct coded_data *cdata, void *rx_data) {
+	struct h264_rx_data *rx = (struct h264_rx_data *) rx_data;
+	video_data_frame_t *frame = rx->frame;
+	struct coded_data *curr;
+	rtp_packet *pckt;
 
-			if (pckt->pt != PT_H264) {
-				error_msg("Wrong Payload type: %u\n", pckt->pt);
-				return FALSE;
-			}
+	const uint8_t *src;
+	int src_len;
+	uint16_t nal_size;
+	uint8_t nal;
+	uint8_t fu_header;
 
-			nal = (uint8_t) pckt->data[0];
-			type = nal & 0x1f;
-			nri = nal & 0x60;
-
-            if (type == 7){
-                fill_coded_frame_from_sps(frame, (unsigned char*) pckt->data, &pckt->data_len);
-            }
-			
-			if (type >= 1 && type <= 23) {
-                if(frame->frame_type != INTRA && type == 5){
-                    frame->frame_type = INTRA;
-                } else if (frame->frame_type == BFRAME && nri != 0){
-                    frame->frame_type = OTHER;
-                }
+	uint8_t *buffer;
+	uint8_t *dst;
+	uint32_t bound = 0;
 
-				type = 1;
-			}
+	// Only packet lengths are read here, the payload is copied once below
+	for (curr = cdata; curr != NULL; curr = curr->nxt) {
+		bound += h264_packet_bound(curr->data);
+	}
+	buffer = reserve_coded_frame_data(frame, bound);
+	if (buffer == NULL) {
+		return FALSE;
+	}
+	dst = buffer;
+	frame->frame_type = BFRAME;
 
-			const uint8_t *src = NULL;
-
-			switch (type) {
-			case 0:
-			case 1:
-				if (pass == 0) {
-					debug_msg("NAL type 1\n");
-					total_length += sizeof(start_sequence) + pckt->data_len;
-				} else {
-					dst -= pckt->data_len + sizeof(start_sequence);
-					memcpy(dst, start_sequence, sizeof(start_sequence));
-					memcpy(dst + sizeof(start_sequence), pckt->data, pckt->data_len);
-				}
-				break;
-			case 24:
-				src = (const uint8_t *) pckt->data;
-				src_len = pckt->data_len;
-
-				src++;
-				src_len--;
-
-				while (src_len > 2) {
-					//TODO: Not properly tested
-					//TODO: bframes and iframes detection
-					uint16_t nal_size;
-					memcpy(&nal_size, src, sizeof(uint16_t));
-
-					src += 2;
-					src_len -= 2;
-
-					if (nal_size <= src_len) {
-						if (pass == 0) {
-							total_length += sizeof(start_sequence) + nal_size;
-						} else {
-							dst -= nal_size + sizeof(start_sequence);
-							memcpy(dst, start_sequence, sizeof(start_sequence));
-							memcpy(dst + sizeof(start_sequence), src, nal_size);
-						}
-					} else {
-						error_msg("NAL size exceeds length: %u %d\n", nal_size, src_len);
-						return FALSE;
-					}
-					src += nal_size;
-					src_len -= nal_size;
-
-					if (src_len < 0) {
-						error_msg("Consumed more bytes than we got! (%d)\n", src_len);
-						return FALSE;
-					}
-				}
-				break;
+	for (; cdata != NULL; cdata = cdata->nxt) {
+		pckt = cdata->data;
 
-			case 25:
-			case 26:
-			case 27:
-			case 29:
-				error_msg("Unhandled NAL type\n");
-				return FALSE;
-			case 28:
-				src = (const uint8_t *) pckt->data;
-				src_len = pckt->data_len;
-
-				src++;
-				src_len--;
-
-				if (src_len > 1) {
-					uint8_t fu_header = *src;
-					uint8_t start_bit = fu_header >> 7;
-					//uint8_t end_bit 		= (fu_header & 0x40) >> 6;
-					uint8_t nal_type = fu_header & 0x1f;
-					uint8_t reconstructed_nal;
-
-                    if(frame->frame_type != INTRA && nal_type == 5){
-                        frame->frame_type = INTRA;
-                    } else if (frame->frame_type == BFRAME && nri != 0){
-                        frame->frame_type = OTHER;
-                    } 
-
-					// Reconstruct this packet's true nal; only the data follows.
-					/* The original nal forbidden bit and NRI are stored in this
-					 * packet's nal. */
-					reconstructed_nal = nal & 0xe0;
-					reconstructed_nal |= nal_type;
-
-					// skip the fu_header
-					src++;
-					src_len--;
-
-					if (pass == 0) {
-						if (start_bit) {
-							total_length += sizeof(start_sequence) + sizeof(reconstructed_nal) + src_len;
-						} else {
-							total_length += src_len;
-						}
-					} else {
-						if (start_bit) {
-							dst -= sizeof(start_sequence) + sizeof(reconstructed_nal) + src_len;
-							memcpy(dst, start_sequence, sizeof(start_sequence));
-							memcpy(dst + sizeof(start_sequence), &reconstructed_nal, sizeof(reconstructed_nal));
-							memcpy(dst + sizeof(start_sequence) + sizeof(reconstructed_nal), src, src_len);
-						} else {
-							dst -= src_len;
-							memcpy(dst, src, src_len);
-						}
-					}
-				} else {
-					error_msg("Too short data for FU-A H264 RTP packet\n");
+		if (pckt->pt != PT_H264) {
+			error_msg("Wrong Payload type: %u\n", pckt->pt);
+			return FALSE;
+		}
+
+		src = (const uint8_t *) pckt->data;
+		src_len = pckt->data_len;
+		nal = src[0];
+
+		switch (nal & 0x1f) {
+		case 24:
+			src++;
+			src_len--;
+
+			while (src_len > 2) {
+				nal_size = (src[0] << 8) | src[1];
+				src += 2;
+				src_len -= 2;
+
+				if (nal_size == 0 || nal_size > src_len) {
+					error_msg("NAL size exceeds length: %u %d\n", nal_size, src_len);
 					return FALSE;
 				}
-				break;
-			default:
-				error_msg("Unknown NAL type\n");
+				dst = put_nal(rx, dst, src, nal_size);
+				src += nal_size;
+				src_len -= nal_size;
+			}
+			break;
+
+		case 25:
+		case 26:
+		case 27:
+		case 29:
+			error_msg("Unhandled NAL type\n");
+			return FALSE;
+
+		case 28:
+			if (src_len < 3) {
+				error_msg("Too short data for FU-A H264 RTP packet\n");
 				return FALSE;
 			}
-			cdata = cdata->nxt;
+			fu_header = src[1];
+
+			if (fu_header & 0x80) {
+				// Reconstruct the fragmented nal: forbidden bit and NRI
+				// come from the FU indicator, the type from the header
+				nal = (nal & 0xe0) | (fu_header & 0x1f);
+				update_frame_type(&frame->frame_type, nal);
+				memcpy(dst, start_sequence, sizeof(start_sequence));
+				dst += sizeof(start_sequence);
+				*dst++ = nal;
+			}
+			memcpy(dst, src + 2, src_len - 2);
+			dst += src_len - 2;
+			break;
+
+		case 30:
+		case 31:
+			error_msg("Unknown NAL type\n");
+			return FALSE;
+
+		default:
+			dst = put_nal(rx, dst, src, src_len);
+			break;
 		}
 	}
+
+	frame->coded->len = frame->buffer_len = dst - buffer;
+	frame->codec = H264;
+	if (rx->state->width != 0) {
+		frame->width = rx->state->width;
+		frame->height = rx->state->height;
+	}
 	return TRUE;
 }
 
+int frame_type_h264(struct coded_data *cdata, void *frame_type)
+{
+	frame_type_t *type = (frame_type_t *) frame_type;
+	rtp_packet *pckt;
+	const uint8_t *src;
+	int src_len;
+	uint16_t nal_size;
+
+	*type = BFRAME;
+	for (; cdata != NULL; cdata = cdata->nxt) {
+		pckt = cdata->data;
+		src = (const uint8_t *) pckt->data;
+		src_len = pckt->data_len;
+		if (pckt->pt != PT_H264 || src_len < 1) {
+			return FALSE;
+		}
 
-
+		switch (src[0] & 0x1f) {
+		case 24:
+			src++;
+			src_len--;
+			while (src_len > 2) {
+				nal_size = (src[0] << 8) | src[1];
+				src += 2;
+				src_len -= 2;
+				if (nal_size == 0 || nal_size > src_len) {
+					return FALSE;
+				}
+				update_frame_type(type, src[0]);
+				src += nal_size;
+				src_len -= nal_size;
+			}
+			break;
+		case 28:
+			if (src_len >= 2 && (src[1] & 0x80)) {
+				update_frame_type(type, (src[0] & 0xe0) | (src[1] & 0x1f));
+			}
+			break;
+		default:
+			update_frame_type(type, src[0]);
+			break;
+		}
+	}
+	return TRUE;
+}
 
 int decode_frame(struct coded_data *cdata, void *rx_data)
 {
@@ -410,37 +443,34 @@ cleanup:
         return ret;
 }
 
-int fill_coded_frame_from_sps(video_data_frame_t *rx_data, unsigned char *data, int *data_len){
-    uint32_t width, height;
-    sps_t* sps = (sps_t*)malloc(sizeof(sps_t));
-    uint8_t* rbsp_buf = (uint8_t*)malloc(*data_len);
-    if (nal_to_rbsp(data, data_len, rbsp_buf, data_len) < 0){
-        free(rbsp_buf);
-        free(sps);
+static int parse_sps(const uint8_t *nal, int nal_len, uint32_t *width, uint32_t *height){
+    sps_t sps;
+    int rbsp_len = nal_len;
+    uint8_t *rbsp_buf = malloc(nal_len);
+    bs_t *b;
+    int ret = -1;
+
+    if (rbsp_buf == NULL){
         return -1;
     }
-    bs_t* b = bs_new(rbsp_buf, *data_len);
-    if(read_seq_parameter_set_rbsp(sps,b) < 0){
-        bs_free(b);
+    if (nal_to_rbsp(nal, &nal_len, rbsp_buf, &rbsp_len) < 0){
         free(rbsp_buf);
-        free(sps);
         return -1;
     }
-    width = (sps->pic_width_in_mbs_minus1 + 1) * 16;
-    height = (2 - sps->frame_mbs_only_flag) * (sps->pic_height_in_map_units_minus1 + 1) * 16; 
-    //NOTE: frame_mbs_only_flag = 1 --> only progressive frames 
-    //      frame_mbs_only_flag = 0 --> some type of interlacing (there are 3 types contemplated in the standard)
-    if (sps->frame_cropping_flag){
-        width -= (sps->frame_crop_left_offset*2 + sps->frame_crop_right_offset*2);
-        height -= (sps->frame_crop_top_offset*2 + sps->frame_crop_bottom_offset*2);
-    }
-
-    if((width != rx_data->width) || (height != rx_data->height)){
-        set_video_data_frame(rx_data, H264, width, height);
+    b = bs_new(rbsp_buf, rbsp_len);
+    if (read_seq_parameter_set_rbsp(&sps, b) >= 0){
+        *width = (sps.pic_width_in_mbs_minus1 + 1) * 16;
+        *height = (2 - sps.frame_mbs_only_flag) * (sps.pic_height_in_map_units_minus1 + 1) * 16; 
+        //NOTE: frame_mbs_only_flag = 1 --> only progressive frames 
+        //      frame_mbs_only_flag = 0 --> some type of interlacing (there are 3 types contemplated in the standard)
+        if (sps.frame_cropping_flag){
+            *width -= (sps.frame_crop_left_offset*2 + sps.frame_crop_right_offset*2);
+            *height -= (sps.frame_crop_top_offset*2 + sps.frame_crop_bottom_offset*2);
+        }
+        ret = 0;
     }
 
     bs_free(b);
     free(rbsp_buf);
-    free(sps);
-
+    return ret;
 }
@@ -4,4 +4,33 @@
 
 int decode_frame(struct coded_data *cdata, void *decode_data);
 
-int decode_frame_h264(struct coded_data *cdata, void *rx_data);
\ No newline at end of file
+/* SPS bytes remembered to skip parsing repeated ones */
+#define H264_MAX_SPS 64
+
+struct video_frame_data;
+
+/* Per participant state of decode_frame_h264 */
+struct h264_rx_state {
+        uint8_t sps[H264_MAX_SPS];
+        int sps_len;
+        uint32_t width;
+        uint32_t height;
+};
+
+/* decode_data of decode_frame_h264 */
+struct h264_rx_data {
+        struct video_frame_data *frame;
+        struct h264_rx_state *state;
+};
+
+/*
+ * Writes the Annex-B bitstream of a frame into rx_data->frame in a single
+ * pass over the packets, in seqno order.
+ */
+int decode_frame_h264(struct coded_data *cdata, void *rx_data);
+
+/*
+ * Stores in *frame_type (a frame_type_t) what decode_frame_h264 would set,
+ * reading only the NAL headers.
+ */
+int frame_type_h264(struct coded_data *cdata, void *frame_type);
\ No newline at end of file
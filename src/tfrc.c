@@ -82,6 +82,17 @@ struct tfrc {
         int ii;                 /* index for loss    -1<=ii<=10 */
         double W_tot;
         double weight[N + 5];   /* Weights for loss event calculation. In the RFC, the numbering is the other way around */
+        uint16_t last_seq;      /* state of save_arrival() */
+        uint32_t ext_last_ack;
+        int last_ack_jj;
+        struct {
+                uint32_t seq;
+                uint32_t ts;
+        } arrival[MAX_HISTORY];
+        struct {
+                uint32_t seq;
+                uint32_t ts;
+        } loss[MAX_HISTORY];
         uint32_t magic;         /* For debugging */
 };
 
@@ -96,21 +107,10 @@ static void validate_tfrc_state(struct tfrc *state)
 #endif
 }
 
-static struct {
-        uint32_t seq;
-        uint32_t ts;
-} arrival[MAX_HISTORY];
-
-static struct {
-        uint32_t seq;
-        uint32_t ts;
-} loss[MAX_HISTORY];
-
-#ifdef NDEF
-static double transfer_rate(double p)
+static double transfer_rate(int s, uint32_t RTT, double p)
 {
         double t, t1, t2, t3, t4, rtt, tRTO;
-        if (p == 0) {
+        if (p == 0 || RTT == 0) {
                 return 0;
         }
 
@@ -127,17 +127,7 @@ static double transfer_rate(double p)
         return (t);
 }
 
-static void compute_transfer_rate(void)
-{
-        double t1;
-        struct timeval now;
-
-        t1 = transfer_rate(p);
-        gettimeofday(&now, NULL);
-}
-#endif
-
-static int set_zero(int first, int last, uint16_t u)
+static int set_zero(struct tfrc *state, int first, int last, uint16_t u)
 {
         int i, count = 0;;
 
@@ -151,19 +141,19 @@ static int set_zero(int first, int last, uint16_t u)
 
         if (first < last) {
                 for (i = first + 1; i < last; i++) {
-                        arrival[i].seq = 0;
-                        arrival[i].ts = 0;
+                        state->arrival[i].seq = 0;
+                        state->arrival[i].ts = 0;
                         count++;
                 }
         } else {
                 for (i = first + 1; i < MAX_HISTORY; i++) {
-                        arrival[i].seq = 0;
-                        arrival[i].ts = 0;
+                        state->arrival[i].seq = 0;
+                        state->arrival[i].ts = 0;
                         count++;
                 }
                 for (i = 0; i < last; i++) {
-                        arrival[i].seq = 0;
-                        arrival[i].ts = 0;
+                        state->arrival[i].seq = 0;
+                        state->arrival[i].ts = 0;
                         count++;
                 }
         }
@@ -171,7 +161,7 @@ static int set_zero(int first, int last, uint16_t u)
         return (count);
 }
 
-static int arrived(int first, int last)
+static int arrived(struct tfrc *state, int first, int last)
 {
         int i, count = 0;
 
@@ -185,16 +175,16 @@ static int arrived(int first, int last)
 
         if (first < last) {
                 for (i = first; i <= last; i++) {
-                        if (arrival[i].seq != 0)
+                        if (state->arrival[i].seq != 0)
                                 count++;
                 }
         } else {
                 for (i = first; i < MAX_HISTORY; i++) {
-                        if (arrival[i].seq != 0)
+                        if (state->arrival[i].seq != 0)
                                 count++;
                 }
                 for (i = 0; i <= last; i++) {
-                        if (arrival[i].seq != 0)
+                        if (state->arrival[i].seq != 0)
                                 count++;
                 }
         }
@@ -217,12 +207,12 @@ record_loss(struct tfrc *state, uint32_t s1, uint32_t s2, uint32_t ts1,
         if (state->ii <= -1) {
                 /* first loss! */
                 state->ii++;
-                loss[state->ii].seq = seq;
-                loss[state->ii].ts = est;
+                state->loss[state->ii].seq = seq;
+                state->loss[state->ii].ts = est;
                 return;
         }
 
-        if (est - loss[state->ii].ts <= state->RTT) {   /* not a new event */
+        if (est - state->loss[state->ii].ts <= state->RTT) {   /* not a new event */
                 return;
         }
 
@@ -233,15 +223,34 @@ record_loss(struct tfrc *state, uint32_t s1, uint32_t s2, uint32_t ts1,
 
         if (state->ii >= (N + 1)) {     /* shift */
                 for (i = 0; i < (N + 1); i++) {
-                        loss[i].seq = loss[i + 1].seq;
-                        loss[i].ts = loss[i + 1].ts;
+                        state->loss[i].seq = state->loss[i + 1].seq;
+                        state->loss[i].ts = state->loss[i + 1].ts;
                 }
                 state->ii = N;
         }
 
         state->ii++;
-        loss[state->ii].seq = seq;
-        loss[state->ii].ts = est;
+        state->loss[state->ii].seq = seq;
+        state->loss[state->ii].ts = est;
+}
+
+/* Forgets the arrivals and losses, as before the first packet */
+static void restart_history(struct tfrc *state)
+{
+        int i;
+
+        state->jj = -1;
+        state->ii = -1;
+        state->cycles = 0;
+        state->last_seq = 0;
+        state->ext_last_ack = 0;
+        state->last_ack_jj = 0;
+        for (i = 0; i < MAX_HISTORY; i++) {
+                state->arrival[i].seq = 0;
+                state->arrival[i].ts = 0;
+                state->loss[i].seq = 0;
+                state->loss[i].ts = 0;
+        }
 }
 
 static void
@@ -251,76 +260,77 @@ save_arrival(struct tfrc *state, struct timeval curr_time, uint16_t seq)
         uint16_t udelta;
         uint32_t now;
         uint32_t ext_seq;
-        static uint16_t last_seq;
-        static uint32_t ext_last_ack;
-        static int last_ack_jj = 0;
 
         gettimeofday(&curr_time, NULL);
         now = tv_diff_usec(curr_time, state->start_time);
 
+        udelta = seq - state->last_seq;
+        if (state->jj != -1 && udelta >= MAX_DROPOUT
+            && udelta <= RTP_SEQ_MOD - MAX_MISORDER) {
+                /* The source restarted or jumped, its history is void */
+                debug_msg("TFRC seqno jump %u -> %u, history restarted\n",
+                          state->last_seq, seq);
+                restart_history(state);
+        }
+
         if (state->jj == -1) {
                 /* first packet arrival */
                 state->jj = 0;
-                last_seq = seq;
-                ext_last_ack = seq;
-                last_ack_jj = 0;
-                arrival[state->jj].seq = seq;
-                arrival[state->jj].ts = now;
+                state->last_seq = seq;
+                state->ext_last_ack = seq;
+                state->last_ack_jj = 0;
+                state->arrival[state->jj].seq = seq;
+                state->arrival[state->jj].ts = now;
                 return;
         }
 
-        udelta = seq - last_seq;
-
         state->total_pckts++;
         if (udelta < MAX_DROPOUT) {
                 /* in order, with permissible gap */
-                if (seq < last_seq) {
+                if (seq < state->last_seq) {
                         state->cycles++;
                 }
                 /* record arrival */
                 last_jj = state->jj;
                 state->jj = (state->jj + udelta) % MAX_HISTORY;
-                set_zero(last_jj, state->jj, udelta);
+                set_zero(state, last_jj, state->jj, udelta);
                 ext_seq = seq + state->cycles * RTP_SEQ_MOD;
-                last_seq = seq;
-                arrival[state->jj].seq = ext_seq;
-                arrival[state->jj].ts = now;
+                state->last_seq = seq;
+                state->arrival[state->jj].seq = ext_seq;
+                state->arrival[state->jj].ts = now;
                 if (udelta < 10)
                         state->gap[udelta - 1]++;
 
-                if ((ext_seq - ext_last_ack) == 1) {
+                if ((ext_seq - state->ext_last_ack) == 1) {
                         /* We got two consecutive packets, no loss */
-                        ext_last_ack = ext_seq;
-                        last_ack_jj = state->jj;
+                        state->ext_last_ack = ext_seq;
+                        state->last_ack_jj = state->jj;
                 } else {
                         /* Sequence number jumped, we've missed a packet for some reason */
-                        if (arrived(last_ack_jj, state->jj) >= 4) {
-                                record_loss(state, ext_last_ack, ext_seq,
-                                            arrival[last_ack_jj].ts, now);
-                                ext_last_ack = ext_seq;
-                                last_ack_jj = state->jj;
+                        if (arrived(state, state->last_ack_jj, state->jj) >= 4) {
+                                record_loss(state, state->ext_last_ack, ext_seq,
+                                            state->arrival[state->last_ack_jj].ts, now);
+                                state->ext_last_ack = ext_seq;
+                                state->last_ack_jj = state->jj;
                         }
                 }
-        } else if (udelta <= RTP_SEQ_MOD - MAX_MISORDER) {
-                printf(" -- seq:%u last seq:%u  ", seq, arrival[state->jj].seq);
-                abort();        /* FIXME */
         } else {
                 /* duplicate or reordered packet */
                 ext_seq = seq + state->cycles * RTP_SEQ_MOD;
                 state->ooo++;
-                if (ext_seq > ext_last_ack) {
-                        inc = ext_seq - arrival[state->jj].seq;
+                if (ext_seq > state->ext_last_ack) {
+                        inc = ext_seq - state->arrival[state->jj].seq;
 
-                        kk = (state->jj + inc) % MAX_HISTORY;
-                        if (arrival[kk].seq == 0) {
-                                arrival[kk].seq = ext_seq;
-                                arrival[kk].ts = (arrival[last_ack_jj].ts + now) / 2;   /* NOT the best interpolation */
+                        kk = ((state->jj + inc) % MAX_HISTORY + MAX_HISTORY) % MAX_HISTORY;
+                        if (state->arrival[kk].seq == 0) {
+                                state->arrival[kk].seq = ext_seq;
+                                state->arrival[kk].ts = (state->arrival[state->last_ack_jj].ts + now) / 2;   /* NOT the best interpolation */
                         }
-                        while (arrival[last_ack_jj + 1].seq != 0
-                               && last_ack_jj < state->jj) {
-                                last_ack_jj = (last_ack_jj + 1) % MAX_HISTORY;
+                        while (state->arrival[(state->last_ack_jj + 1) % MAX_HISTORY].seq != 0
+                               && state->last_ack_jj < state->jj) {
+                                state->last_ack_jj = (state->last_ack_jj + 1) % MAX_HISTORY;
                         }
-                        ext_last_ack = arrival[last_ack_jj].seq;
+                        state->ext_last_ack = state->arrival[state->last_ack_jj].seq;
                 }
         }
 }
@@ -337,15 +347,15 @@ static double compute_loss_event(struct tfrc *state)
         }
 
         for (i = state->ii - N; i < state->ii; i++) {
-                temp = loss[i + 1].seq - loss[i].seq;
+                temp = state->loss[i + 1].seq - state->loss[i].seq;
                 I_tot0 = I_tot0 + temp * state->weight[i];
                 if (i >= (state->ii - N + 1)) {
                         I_tot1 = I_tot1 + temp * state->weight[i - 1];
                 }
         }
         I_tot1 =
-            I_tot1 + (arrival[state->jj].seq -
-                      loss[state->ii].seq) * state->weight[N - 1];
+            I_tot1 + (state->arrival[state->jj].seq -
+                      state->loss[state->ii].seq) * state->weight[N - 1];
 
         I_tot = (I_tot1 > I_tot0) ? I_tot1 : I_tot0;
         I_mean = I_tot / state->W_tot;
@@ -402,13 +412,8 @@ struct tfrc *tfrc_init(struct timeval curr_time)
                 for (i = 0; i < N; i++) {
                         state->W_tot = state->W_tot + state->weight[i];
                 }
-        }
 
-        for (i = 0; i < MAX_HISTORY; i++) {
-                arrival[i].seq = 0;
-                arrival[i].ts = 0;
-                loss[i].seq = 0;
-                loss[i].ts = 0;
+                restart_history(state);
         }
         return state;
 }
@@ -417,17 +422,21 @@ void tfrc_done(struct tfrc *state)
 {
         int i;
 
+        if (state == NULL) {
+                return;
+        }
         validate_tfrc_state(state);
 
         for (i = 0; i < 10; i++) {
-                printf("\n%2d %8d", i, state->gap[i]);
+                debug_msg("%2d %8d\n", i, state->gap[i]);
         }
-        printf("\n");
-        printf("\nLost:       %8d", state->loss_count);
-        printf("\nIntervals:  %8d", state->interval_count);
-        printf("\nTotal:      %8d", state->total_pckts);
-        printf("\nooo:        %8d -- %7.5f\n\n", state->ooo,
-               (state->ooo * 100) / (double)state->total_pckts);
+        debug_msg("Lost:       %8d\n", state->loss_count);
+        debug_msg("Intervals:  %8d\n", state->interval_count);
+        debug_msg("Total:      %8d\n", state->total_pckts);
+        debug_msg("ooo:        %8d\n", state->ooo);
+
+        state->magic = 0;
+        free(state);
 }
 
 void
@@ -448,7 +457,6 @@ tfrc_recv_data(struct tfrc *state, struct timeval curr_time, uint16_t seqnum,
                         gettimeofday(&(state->feedback_timer), NULL);
                         tv_add(&(state->feedback_timer),
                                (unsigned int)state->RTT);
-                        compute_transfer_rate();
                 }
 #endif
         }
@@ -465,7 +473,7 @@ void tfrc_recv_rtt(struct tfrc *state, struct timeval curr_time, uint32_t rtt)
 
         if (state->RTT == 0) {
                 state->feedback_timer = curr_time;
-                tv_add(&(state->feedback_timer), rtt);
+                tv_add_usec(&(state->feedback_timer), rtt);
         }
         state->RTT = rtt;
 }
@@ -493,11 +501,15 @@ double tfrc_feedback_txrate(struct tfrc *state, struct timeval curr_time)
 
         state->feedback_timer.tv_sec = curr_time.tv_sec;
         state->feedback_timer.tv_usec = curr_time.tv_usec;
-        tv_add(&(state->feedback_timer), state->RTT);
+        tv_add_usec(&(state->feedback_timer), state->RTT);
         state->p = compute_loss_event(state);
-        //compute_transfer_rate ();
-        if (state->ii >= N) {
-                abort();        /* FIXME */
-        }
-        return 0.0;             /* FIXME */
+        return transfer_rate(state->s, state->RTT, state->p);
+}
+
+double tfrc_calc_x(int s, uint32_t rtt, double p)
+{
+        /* TCP throughput equation (RFC 5348, section 3.1), in bytes per */
+        /* second, for packets of s bytes, rtt usec and loss event rate  */
+        /* p. Zero when there is no loss or the rtt is unknown.          */
+        return transfer_rate(s, rtt, p);
 }
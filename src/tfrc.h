@@ -53,3 +53,6 @@ void         tfrc_recv_rtt       (struct tfrc *state, struct timeval curr_time,
 double       tfrc_feedback_txrate(struct tfrc *state, struct timeval curr_time);
 int          tfrc_feedback_is_due(struct tfrc *state, struct timeval curr_time);
 
+/* Sending rate allowed by the TCP throughput equation, in bytes per second */
+double       tfrc_calc_x(int s, uint32_t rtt, double p);
+
@@ -67,6 +67,7 @@
 //#include "rtp/ldgm.h"
 #include "rtp/rtp.h"
 #include "rtp/rtp_callback.h"
+#include "rtp/fec.h"
 #include "rtp/audio_frame2.h"
 #include "tv.h"
 #include "tv_std.h"
@@ -83,33 +84,22 @@ long packet_rate;
 enum fec_scheme_t {
         FEC_NONE,
         FEC_MULT,
-        FEC_LDGM
+        FEC_LDGM,
+        FEC_XOR
 };
 
 #define FEC_MAX_MULT 10
-
-#ifdef HAVE_MACOSX
-#define GET_STARTTIME gettimeofday(&start, NULL)
-#define GET_STOPTIME gettimeofday(&stop, NULL)
-#define GET_DELTA delta = (stop.tv_usec - start.tv_usec) * 1000L
-#elif defined HAVE_LINUX
-#define GET_STARTTIME clock_gettime(CLOCK_REALTIME, &start)
-#define GET_STOPTIME clock_gettime(CLOCK_REALTIME, &stop)
-#define GET_DELTA delta = stop.tv_nsec - start.tv_nsec
-#else // Windows
-#define GET_STARTTIME {QueryPerformanceFrequency(&freq); QueryPerformanceCounter(&start); }
-#define GET_STOPTIME { QueryPerformanceCounter(&stop); }
-#define GET_DELTA delta = (long)((double)(stop.QuadPart - start.QuadPart) * 1000 * 1000 * 1000 / freq.QuadPart);
-#endif
+// Row only XOR parity unless "xor:<cols>:<rows>" says otherwise, see rtp/fec.h
+#define FEC_XOR_DEFAULT_COLS 10
 
 
 #define RTPENC_H264_MAX_NALS 1024*2*2*2
 #define RTPENC_H264_PT 96
 
-// Mulaw audio memory reservation
+// Mulaw audio memory reservation, grown to hold every packet of a frame
 #define BUFFER_MTU_SIZE 1500
 static char *data_buffer_mulaw;
-static int buffer_mulaw_init = 0;
+static int buffer_mulaw_size = 0;
 
 struct rtp_nal_t {
         uint8_t *data;
@@ -158,20 +148,32 @@ struct tx {
         enum fec_scheme_t fec_scheme;
         void *fec_state;
         int mult_count;
+        int fec_cols;
+        int fec_rows;
 
         int last_fragment;
 
         platform_spin_t spin;
 
         struct openssl_encrypt *encryption;
+
+        struct tx_h264_packets *h264_packets;   ///< scratch for tx_send_h264
 };
 
 // Mulaw audio memory reservation
-static void init_tx_mulaw_buffer() {
-    if (!buffer_mulaw_init) {
-        data_buffer_mulaw = malloc(BUFFER_MTU_SIZE);
-        buffer_mulaw_init = 1;
+static bool init_tx_mulaw_buffer(int size) {
+    if (size < BUFFER_MTU_SIZE) {
+        size = BUFFER_MTU_SIZE;
     }
+    if (buffer_mulaw_size < size) {
+        char *tmp = realloc(data_buffer_mulaw, size);
+        if (tmp == NULL) {
+            return false;
+        }
+        data_buffer_mulaw = tmp;
+        buffer_mulaw_size = size;
+    }
+    return true;
 }
 
 static bool fec_is_ldgm(struct tx *tx)
@@ -278,14 +280,20 @@ static struct response *fec_change_callback(struct module *mod, struct message *
 
         platform_spin_lock(&tx->spin);
         void *old_fec_state = tx->fec_state;
+        enum fec_scheme_t old_fec_scheme = tx->fec_scheme;
+        int old_fec_cols = tx->fec_cols;
+        int old_fec_rows = tx->fec_rows;
         tx->fec_state = NULL;
-//         if(set_fec(tx, data->fec)) {
+        if(set_fec(tx, data->fec) && tx->fec_scheme != FEC_LDGM) {
 //                 ldgm_encoder_destroy(old_fec_state);
-//                 response = new_response(RESPONSE_OK, NULL);
-//         } else {
-        tx->fec_state = old_fec_state;
-        response = new_response(RESPONSE_BAD_REQUEST, NULL);
-//         }
+                response = new_response(RESPONSE_OK, NULL);
+        } else {
+                tx->fec_state = old_fec_state;
+                tx->fec_scheme = old_fec_scheme;
+                tx->fec_cols = old_fec_cols;
+                tx->fec_rows = old_fec_rows;
+                response = new_response(RESPONSE_BAD_REQUEST, NULL);
+        }
         platform_spin_unlock(&tx->spin);
 
         free_message(msg);
@@ -328,6 +336,26 @@ static bool set_fec(struct tx *tx, const char *fec_const)
                         }
                         tx->fec_scheme = FEC_LDGM;
                 }
+        } else if(strcasecmp(fec, "xor") == 0) {
+                int cols = FEC_XOR_DEFAULT_COLS, rows = 1;
+                if(fec_cfg) {
+                        char *rows_cfg = strchr(fec_cfg, ':');
+                        cols = atoi(fec_cfg);
+                        if(rows_cfg) {
+                                rows = atoi(rows_cfg + 1);
+                        }
+                }
+                if(cols < 2 || cols > FEC_XOR_MAX_SPAN || rows < 1
+                                || (rows - 1) * cols + 1 > FEC_XOR_MAX_SPAN) {
+                        fprintf(stderr, "Unsupported XOR FEC matrix %dx%d, "
+                                        "a column may span %d packets.\n",
+                                        cols, rows, FEC_XOR_MAX_SPAN);
+                        ret = false;
+                } else {
+                        tx->fec_scheme = FEC_XOR;
+                        tx->fec_cols = cols;
+                        tx->fec_rows = rows;
+                }
         } else {
                 fprintf(stderr, "Unknown FEC: %s\n", fec);
                 ret = false;
@@ -337,12 +365,41 @@ static bool set_fec(struct tx *tx, const char *fec_const)
         return ret;
 }
 
+/*
+ * XOR parity is computed by the RTP session over the packets it sends, so
+ * FEC follows whichever session the tx sends to.
+ */
+static void tx_apply_fec(struct tx *tx, struct rtp *rtp_session)
+{
+        if(tx->fec_scheme == FEC_XOR) {
+                if(!rtp_set_fec(rtp_session, PT_ULPFEC, tx->fec_cols, tx->fec_rows)) {
+                        error_msg("Unable to initialize XOR FEC\n");
+                }
+        } else {
+                rtp_set_fec(rtp_session, 0, 0, 0);
+        }
+}
+
+/*
+ * packet_rate, the nanoseconds between two packets, used to be honoured by
+ * spinning after every packet. It is now the rate of the pacer of the
+ * session, with room for a single packet.
+ */
+static void tx_apply_packet_rate(struct tx *tx, struct rtp *rtp_session)
+{
+        if(packet_rate > 0) {
+                rtp_set_pacing(rtp_session, (uint64_t) tx->mtu * 8 * 1000000000ULL / packet_rate,
+                                tx->mtu);
+        }
+}
+
 static void tx_done(struct module *mod)
 {
         struct tx *tx = (struct tx *) mod->priv_data;
         assert(tx->magic == TRANSMIT_MAGIC);
 //         ldgm_encoder_destroy(tx->fec_state);
         pthread_spin_destroy(&tx->spin);
+        tx_h264_packets_done(tx->h264_packets);
         free(tx);
 }
 
@@ -355,7 +412,7 @@ tx_send(struct tx *tx, struct video_frame *frame, struct rtp *rtp_session)
         unsigned int i;
         uint32_t ts = 0;
 
-        assert(!frame->fragment || tx->fec_scheme == FEC_NONE); // currently no support for FEC with fragments
+        assert(!frame->fragment || tx->fec_scheme == FEC_NONE || tx->fec_scheme == FEC_XOR); // only XOR parity supports fragments
         assert(!frame->fragment || frame->tile_count); // multiple tile are not currently supported for fragmented send
 
         platform_spin_lock(&tx->spin);
@@ -398,7 +455,7 @@ tx_send_tile(struct tx *tx, struct video_frame *frame, int pos, struct rtp *rtp_
         uint32_t ts = 0;
         int fragment_offset = 0;
 
-        assert(!frame->fragment || tx->fec_scheme == FEC_NONE); // currently no support for FEC with fragments
+        assert(!frame->fragment || tx->fec_scheme == FEC_NONE || tx->fec_scheme == FEC_XOR); // only XOR parity supports fragments
         assert(!frame->fragment || frame->tile_count); // multiple tile are not currently supported for fragmented send
         
         platform_spin_lock(&tx->spin);
@@ -462,14 +519,6 @@ tx_send_base(struct tx *tx, struct tile *tile, struct rtp *rtp_session,
         int pt = PT_VIDEO;            /* A value specified in our packet format */
         char *data;
         unsigned int pos;
-#ifdef HAVE_LINUX
-        struct timespec start, stop;
-#elif defined HAVE_MACOSX
-        struct timeval start, stop;
-#else // Windows
-	LARGE_INTEGER start, stop, freq;
-#endif
-        long delta;
         uint32_t tmp;
 //         int mult_pos[FEC_MAX_MULT];
 //         int mult_index = 0;
@@ -583,6 +632,18 @@ tx_send_base(struct tx *tx, struct tile *tile, struct rtp *rtp_session,
                 hdr_offset = video_hdr + 1;
 //         }
 
+        /*
+         * Packets are queued and sent together unless their data lives in
+         * the per packet encryption buffer. The pacer of the session sends
+         * what is queued whenever it has to wait.
+         */
+        int batch = !tx->encryption;
+        if (batch) {
+                rtp_send_batch_begin(rtp_session);
+        }
+        tx_apply_fec(tx, rtp_session);
+        tx_apply_packet_rate(tx, rtp_session);
+
         do {
 //                 if(tx->fec_scheme == FEC_MULT) {
 //                         pos = mult_pos[mult_index];
@@ -602,7 +663,6 @@ tx_send_base(struct tx *tx, struct tile *tile, struct rtp *rtp_session,
                         data_len = data_to_send_len - pos;
                 }
                 pos += data_len;
-                GET_STARTTIME;
                 if(data_len) { /* check needed for FEC_MULT */
                         char encrypted_data[data_len + MAX_CRYPTO_EXCEED];
 
@@ -634,13 +694,6 @@ tx_send_base(struct tx *tx, struct tile *tile, struct rtp *rtp_session,
 //                                         mult_index = (mult_index + 1) % tx->mult_count;
 //                 }
 
-                do {
-                        GET_STOPTIME;
-                        GET_DELTA;
-                        if (delta < 0)
-                                delta += 1000000000L;
-                } while (packet_rate - delta > 0);
-
                 /* when trippling, we need all streams goes to end */
 //                 if(tx->fec_scheme == FEC_MULT) {
 //                         pos = mult_pos[tx->mult_count - 1];
@@ -648,6 +701,10 @@ tx_send_base(struct tx *tx, struct tile *tile, struct rtp *rtp_session,
 
         } while (pos < (unsigned int) data_to_send_len);
 
+        if (batch) {
+                rtp_send_batch_flush(rtp_session);
+        }
+
 //         if(fec_is_ldgm(tx)) {
 //                ldgm_encoder_free_buffer(tx->fec_state, data_to_send);
 //         }
@@ -671,20 +728,13 @@ void audio_tx_send(struct tx* tx, struct rtp *rtp_session, audio_frame2 * buffer
         uint32_t *audio_hdr = hdr_data;
         uint32_t *crypto_hdr = audio_hdr + sizeof(audio_payload_hdr_t) / sizeof(uint32_t);
         uint32_t timestamp;
-#ifdef HAVE_LINUX
-        struct timespec start, stop;
-#elif defined HAVE_MACOSX
-        struct timeval start, stop;
-#else // Windows
-	LARGE_INTEGER start, stop, freq;
-#endif
-        long delta;
         int mult_pos[FEC_MAX_MULT];
         int mult_index = 0;
         int mult_first_sent = 0;
         int rtp_hdr_len;
 
         platform_spin_lock(&tx->spin);
+        tx_apply_packet_rate(tx, rtp_session);
 
         timestamp = get_local_mediatime();
         perf_record(UVP_SEND, timestamp);
@@ -739,9 +789,7 @@ void audio_tx_send(struct tx* tx, struct rtp *rtp_session, audio_frame2 * buffer
                         }
                         audio_hdr[1] = htonl(pos);
                         pos += data_len;
-                        
-                        GET_STARTTIME;
-                        
+
                         if(data_len) { /* check needed for FEC_MULT */
                                 char encrypted_data[data_len + MAX_CRYPTO_EXCEED];
                                 if(tx->encryption) {
@@ -767,13 +815,6 @@ void audio_tx_send(struct tx* tx, struct rtp *rtp_session, audio_frame2 * buffer
                                                 mult_index = (mult_index + 1) % tx->mult_count;
                         }
 
-                        do {
-                                GET_STOPTIME;
-                                GET_DELTA;
-                                if (delta < 0)
-                                        delta += 1000000000L;
-                        } while (packet_rate - delta > 0);
-
                         /* when trippling, we need all streams goes to end */
                         if(tx->fec_scheme == FEC_MULT) {
                                 pos = mult_pos[tx->mult_count - 1];
@@ -798,6 +839,7 @@ void audio_tx_send_mulaw(struct tx* tx, struct rtp *rtp_session, audio_frame2 *
     uint32_t timestamp;
 
     platform_spin_lock(&tx->spin);
+    tx_apply_packet_rate(tx, rtp_session);
 
     // Configure the right Payload type,
     // 8000 Hz, 1 channel is the ITU-T G.711 standard
@@ -813,12 +855,20 @@ void audio_tx_send_mulaw(struct tx* tx, struct rtp *rtp_session, audio_frame2 *
 
     int data_len = buffer->data_len[0] * buffer->ch_count;  /* Number of samples to send (bps=1)*/
     int data_remainig = data_len;
-    int payload_size = tx->mtu - 40;                        /* Max size of an RTP payload field */
+    int payload_size = (tx->mtu - 40) / buffer->ch_count * buffer->ch_count; /* Max size of an RTP payload field, whole samples */
     int packets = data_len / payload_size;                  
     if (data_len % payload_size != 0) packets++;            /* Number of RTP packets needed */
 
-    init_tx_mulaw_buffer();
+    if (!init_tx_mulaw_buffer(data_len)) {
+        error_msg("audio_tx_send_mulaw: malloc error\n");
+        platform_spin_unlock(&tx->spin);
+        return;
+    }
     char *curr_sample = data_buffer_mulaw;
+    int first_sample = 0;
+
+    // Each packet has its own region of data_buffer_mulaw, so they can go out together
+    rtp_send_batch_begin(rtp_session);
 
     // For each interval that fits in an RTP payload field.
     for (int p = 0 ; p < packets ; p++) {
@@ -834,8 +884,10 @@ void audio_tx_send_mulaw(struct tx* tx, struct rtp *rtp_session, audio_frame2 *
             data_to_send = data_remainig;
         }
 
+        char *packet_data = curr_sample;
+
         // Interleave the samples
-        for (int ch_sample = 0 ; ch_sample < samples_per_packet ; ch_sample++){
+        for (int ch_sample = first_sample ; ch_sample < first_sample + samples_per_packet ; ch_sample++){
             for (int ch = 0 ; ch < buffer->ch_count ; ch++) {
                 memcpy(curr_sample, (char *)(buffer->data[ch] + ch_sample), sizeof(uint8_t)); 
                 curr_sample += sizeof(uint8_t);
@@ -849,10 +901,14 @@ void audio_tx_send_mulaw(struct tx* tx, struct rtp *rtp_session, audio_frame2 *
         // Send the packet
         rtp_send_data(rtp_session, timestamp, pt, 0, 0,        /* contributing sources */
                 0,        /* contributing sources length */
-                data_buffer_mulaw, data_to_send,
+                packet_data, data_to_send,
                 0, 0, 0);
+
+        first_sample += samples_per_packet;
     }
 
+    rtp_send_batch_flush(rtp_session);
+
     tx->buffer ++;
 
     platform_spin_unlock(&tx->spin);
@@ -1016,179 +1072,221 @@ int rtpenc_h264_parse_nal_units(uint8_t *buf_in, int size,
         return size;
 }
 
-static void tx_send_base_h264(struct tx *tx, struct tile *tile, struct rtp *rtp_session, uint32_t ts,
-                int send_m, codec_t color_spec, double input_fps,
-                enum interlacing_t interlacing, unsigned int substream,
-                int fragment_offset)
+struct tx_h264_packets *tx_h264_packets_init(void)
 {
+        return (struct tx_h264_packets *) calloc(1, sizeof(struct tx_h264_packets));
+}
 
-        UNUSED(color_spec);
-        UNUSED(input_fps);
-        UNUSED(interlacing);
-        UNUSED(substream);
-        UNUSED(fragment_offset);
-
-        assert(tx->magic == TRANSMIT_MAGIC);
-        tx_update(tx, tile);
+void tx_h264_packets_done(struct tx_h264_packets *pkts)
+{
+        if (pkts == NULL) {
+                return;
+        }
+        free(pkts->packets);
+        free(pkts);
+}
 
-        uint8_t *data = (uint8_t *) tile->data;
-        int data_len = tile->data_len;
+static struct tx_h264_packet *tx_h264_packets_add(struct tx_h264_packets *pkts)
+{
+        if (pkts->count == pkts->size) {
+                int size = pkts->size == 0 ? 64 : pkts->size * 2;
+                struct tx_h264_packet *packets = (struct tx_h264_packet *)
+                        realloc(pkts->packets, size * sizeof(struct tx_h264_packet));
+                if (packets == NULL) {
+                        return NULL;
+                }
+                pkts->packets = packets;
+                pkts->size = size;
+        }
+        return &pkts->packets[pkts->count++];
+}
 
+int tx_packetize_h264(struct tx_h264_packets *pkts, uint8_t *data, int data_len,
+                unsigned mtu, int send_m)
+{
+        struct tx_h264_packet *pkt;
         struct rtp_nal_t nals[RTPENC_H264_MAX_NALS];
         int nnals = 0;
+        int nal_max_size = mtu - 40;
+
+        pkts->count = 0;
+        pkts->mtu = mtu;
+        pkts->data_len = data_len;
+
         rtpenc_h264_parse_nal_units(data, data_len, nals, &nnals);
 
         rtpenc_h264_nals_recv += nnals;
         debug_msg("%d NAL units found in buffer\n", nnals);
 
-        char pt = RTPENC_H264_PT;
-        int cc = 0;
-        uint32_t csrc = 0;
-
-        char *extn = 0;
-        uint16_t extn_len = 0;
-        uint16_t extn_type = 0;
-
         int i;
         for (i = 0; i < nnals; i++) {
                 struct rtp_nal_t nal = nals[i];
 
-                int fragmentation = 0;
-                int nal_max_size = tx->mtu - 40;
-                if (nal.size > nal_max_size) {
-                        debug_msg("RTP packet size exceeds the MTU size\n");
-                        fragmentation = 1;
-                }
-
-                uint8_t *nal_header = nal.data;
-
 // skip startcode
                 int startcode_size = 0;
-                uint8_t *p = nal_header;
+                uint8_t *p = nal.data;
                 while ((*(p++)) == (uint8_t)0) {
                         startcode_size++;
                 }
                 startcode_size++;
 
-                nal_header += startcode_size;
+                uint8_t *nal_header = nal.data + startcode_size;
                 int nal_header_size = 1;
 
-                uint8_t *nal_payload = nal.data + nal_header_size + startcode_size; // nal.data + nal_header_size;
-                int nal_payload_size = nal.size - (int)(nal_header_size + startcode_size); //nal.size - nal_header_size;
-
-//rtpenc_h264_debug_print_nal_recv_info(nal_header, nal_header_size + nal_payload_size);
+                uint8_t *nal_payload = nal_header + nal_header_size;
+                int nal_payload_size = nal.size - (nal_header_size + startcode_size);
 
-                const char type = (char) (*nal_header & 0x1f);
-                const char nri = (char) ((*nal_header & 0x60) >> 5);
+                const uint8_t type = *nal_header & 0x1f;
+                const uint8_t nri = (*nal_header & 0x60) >> 5;
 
-                char info_type;
-                if (type >= 1 && type <= 23) {
-                        info_type = 1;
-                } else {
-                        info_type = type;
+                if (type == 0 || type > 23) {
+                        error_msg("Non expected NAL type %d\n", (int)type);
+                        pkts->count = 0;
+                        return FALSE; // TODO maybe just warn and don't fail?
                 }
 
-                switch (info_type) {
-                        case 0:
-                        case 1:
-                                debug_msg("Unfragmented or reconstructed NAL type\n");
-                                break;
-                        default:
-                                error_msg("Non expected NAL type %d\n", (int)info_type);
-                                return; // TODO maybe just warn and don't fail?
-                                break;
+                // The start code is not sent, so only header and payload count
+                if (nal_header_size + nal_payload_size <= nal_max_size) {
+                        // Single NAL unit packet: the NAL header goes with the payload
+                        pkt = tx_h264_packets_add(pkts);
+                        if (pkt == NULL) {
+                                pkts->count = 0;
+                                return FALSE;
+                        }
+                        pkt->phdr_len = 0;
+                        pkt->data = nal_header;
+                        pkt->data_len = nal_header_size + nal_payload_size;
+                        pkt->m = (i == nnals - 1) ? send_m : 0;
+                        pkt->last_of_nal = 1;
+                        pkt->fragment = 0;
+                        continue;
                 }
 
-                int m = 0;
-                if (!fragmentation) {
+                debug_msg("RTP packet size exceeds the MTU size\n");
 
-                        if (i == nnals - 1) {
-                                m = send_m;
-                                debug_msg("NAL with M bit\n");
-                        }
+                uint8_t *frag_payload = nal_payload;
+                int frag_payload_size = nal_max_size - 2;
+                int remaining_payload_size = nal_payload_size;
+                int first = 1;
+
+                while (remaining_payload_size > 0) {
+                        int last = remaining_payload_size + 2 <= nal_max_size;
 
-                        int err = rtp_send_data_hdr(rtp_session, ts, pt, m, cc, &csrc,
-                                        (char *)nal_header, nal_header_size,
-                                        (char *)nal_payload, nal_payload_size, extn, extn_len,
-                                        extn_type);
-
-                        /*unsigned char *dst = (unsigned char *)(nal.data);
-                          unsigned char *end = (unsigned char *)(nal.data + nal.size);
-                          debug_msg("\n\nFirst four bytes: %02x %02x %02x %02x\n", dst[0], dst[1], dst[2], dst[3]);
-                          debug_msg("Last four bytes: %02x %02x %02x %02x\n",
-                          end[-4],
-                          end[-3],
-                          end[-2],
-                          end[-1]);
-                          debug_msg("NAL size: %d\n\n", nal.size); // - startcode_size); */
-
-                        if (err < 0) {
-                                error_msg("There was a problem sending the RTP packet\n");
+                        pkt = tx_h264_packets_add(pkts);
+                        if (pkt == NULL) {
+                                pkts->count = 0;
+                                return FALSE;
                         }
-                        else {
-                                rtpenc_h264_nals_sent_nofrag++;
-                                rtpenc_h264_nals_sent++;
-//rtpenc_h264_debug_print_nal_sent_info(nal_header, nal_payload_size + nal_header_size);
+                        pkt->phdr[0] = 28 | (nri << 5); // fu_indicator, new type, same nri
+                        pkt->phdr[1] = type;            // fu_header
+                        if (first) {
+                                pkt->phdr[1] |= 1 << 7; // start
+                        }
+                        if (last) {
+                                pkt->phdr[1] |= 1 << 6; // end
                         }
+                        pkt->phdr_len = 2;
+                        pkt->data = frag_payload;
+                        pkt->data_len = last ? remaining_payload_size : frag_payload_size;
+                        pkt->m = (last && i == nnals - 1) ? send_m : 0;
+                        pkt->last_of_nal = last;
+                        pkt->fragment = 1;
+
+                        remaining_payload_size -= pkt->data_len;
+                        frag_payload += pkt->data_len;
+                        first = 0;
                 }
-                else {
+        }
 
-                        uint8_t frag_header[2];
-                        int frag_header_size = 2;
+        return TRUE;
+}
 
-                        frag_header[0] = 28 | (nri << 5); // fu_indicator, new type, same nri
-                        frag_header[1] = type | (1 << 7);// start, initial fu_header
+static void tx_send_h264_packets(struct tx *tx, struct tx_h264_packets *pkts,
+                struct rtp *rtp_session, uint32_t ts)
+{
+        rtp_send_batch_begin(rtp_session);
+        tx_apply_fec(tx, rtp_session);
+        tx_apply_packet_rate(tx, rtp_session);
+
+        for (int i = 0; i < pkts->count; i++) {
+                struct tx_h264_packet *pkt = &pkts->packets[i];
+
+                int err = rtp_send_data_hdr(rtp_session, ts, RTPENC_H264_PT, pkt->m, 0, NULL,
+                                pkt->phdr_len ? (char *) pkt->phdr : NULL, pkt->phdr_len,
+                                (char *) pkt->data, pkt->data_len, NULL, 0, 0);
+                if (err < 0) {
+                        error_msg("There was a problem sending the RTP packet\n");
+                        continue;
+                }
 
-                        uint8_t *frag_payload = nal_payload;
-                        int frag_payload_size = nal_max_size - frag_header_size;
+                rtpenc_h264_nals_sent++;
+                if (pkt->last_of_nal) {
+                        // Each fragmented NAL has one E (end) NAL fragment
+                        if (pkt->fragment) {
+                                rtpenc_h264_nals_sent_frag++;
+                        } else {
+                                rtpenc_h264_nals_sent_nofrag++;
+                        }
+                }
+        }
 
-                        int remaining_payload_size = nal_payload_size;
+        if (rtp_send_batch_flush(rtp_session) < 0) {
+                error_msg("There was a problem sending the RTP packets\n");
+        }
+}
 
-                        while (remaining_payload_size + 2 > nal_max_size) {
+void tx_send_packetized_h264(struct tx *tx, struct tx_h264_packets *pkts,
+                struct rtp *rtp_session, uint32_t ts)
+{
+        struct tile tile;
 
-//rtpenc_h264_debug_print_payload_bytes(frag_payload);
+        assert(tx->magic == TRANSMIT_MAGIC);
 
-                                int err = rtp_send_data_hdr(rtp_session, ts, pt, m, cc, &csrc,
-                                                (char *)frag_header, frag_header_size,
-                                                (char *)frag_payload, frag_payload_size, extn, extn_len,
-                                                extn_type);
-                                if (err < 0) {
-                                        error_msg("There was a problem sending the RTP packet\n");
-                                }
-                                else {
-                                        rtpenc_h264_nals_sent++;
-//rtpenc_h264_debug_print_fragment_sent_info(frag_header, frag_payload_size + frag_header_size);
-                                }
+        platform_spin_lock(&tx->spin);
 
-                                remaining_payload_size -= frag_payload_size;
-                                frag_payload += frag_payload_size;
+        tile.data_len = pkts->data_len;
+        tx_update(tx, &tile);
+        tx->last_frame_fragment_id = -1;
+        tx->last_ts = ts;
 
-                                frag_header[1] = type;
-                        }
+        // Only sequence number, timestamp and SSRC differ between sessions
+        tx_send_h264_packets(tx, pkts, rtp_session, ts);
+        tx->buffer++;
 
-                        if (i == nnals - 1) {
-                                m = send_m;
-                                debug_msg("NAL fragment (E) with M bit\n");
-                        }
+        platform_spin_unlock(&tx->spin);
+}
 
-                        frag_header[1] = type | (1 << 6); // end
+unsigned tx_get_mtu(struct tx *tx)
+{
+        return tx->mtu;
+}
 
-//rtpenc_h264_debug_print_payload_bytes(frag_payload);
+static void tx_send_base_h264(struct tx *tx, struct tile *tile, struct rtp *rtp_session, uint32_t ts,
+                int send_m, codec_t color_spec, double input_fps,
+                enum interlacing_t interlacing, unsigned int substream,
+                int fragment_offset)
+{
+        UNUSED(color_spec);
+        UNUSED(input_fps);
+        UNUSED(interlacing);
+        UNUSED(substream);
+        UNUSED(fragment_offset);
 
-                        int err = rtp_send_data_hdr(rtp_session, ts, pt, m, cc, &csrc,
-                                        (char *)frag_header, frag_header_size,
-                                        (char *)frag_payload, remaining_payload_size, extn, extn_len,
-                                        extn_type);
-                        if (err < 0) {
-                                error_msg("There was a problem sending the RTP packet\n");
-                        }
-                        else {
-                                rtpenc_h264_nals_sent_frag++; // Each fragmented NAL has one E (end) NAL fragment
-                                rtpenc_h264_nals_sent++;
-//rtpenc_h264_debug_print_fragment_sent_info(frag_header, remaining_payload_size + frag_header_size);
-                        }
+        assert(tx->magic == TRANSMIT_MAGIC);
+        tx_update(tx, tile);
+
+        if (tx->h264_packets == NULL) {
+                tx->h264_packets = tx_h264_packets_init();
+                if (tx->h264_packets == NULL) {
+                        error_msg("tx_send_base_h264: malloc error\n");
+                        return;
                 }
         }
+
+        if (tx_packetize_h264(tx->h264_packets, (uint8_t *) tile->data, tile->data_len,
+                                tx->mtu, send_m)) {
+                tx_send_h264_packets(tx, tx->h264_packets, rtp_session, ts);
+        }
 }
 
 /*
@@ -1200,7 +1298,7 @@ tx_send_h264(struct tx *tx, struct video_frame *frame, struct rtp *rtp_session,
         unsigned int i;
        
 
-        assert(!frame->fragment || tx->fec_scheme == FEC_NONE); // currently no support for FEC with fragments
+        assert(!frame->fragment || tx->fec_scheme == FEC_NONE || tx->fec_scheme == FEC_XOR); // only XOR parity supports fragments
         assert(!frame->fragment || frame->tile_count); // multiple tile are not currently supported for fragmented send
 
         platform_spin_lock(&tx->spin);
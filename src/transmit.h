@@ -78,6 +78,46 @@ struct tx *tx_init_h264(struct module *parent, unsigned mtu, enum tx_media_type
 
 void tx_send_h264(struct tx *tx_session, struct video_frame *frame, struct rtp *rtp_session, uint32_t ts);
 
+/**
+ * One RTP payload of an H.264 frame: an optional payload header (FU
+ * indicator and FU header) followed by a slice of the Annex-B buffer.
+ */
+struct tx_h264_packet {
+        uint8_t phdr[2];
+        int phdr_len;
+        uint8_t *data;
+        int data_len;
+        int m;
+        int last_of_nal;
+        int fragment;
+};
+
+/**
+ * RTP payloads of a whole H.264 frame. Built once with tx_packetize_h264,
+ * they point into the coded buffer, which must outlive them, and can be
+ * sent to any number of sessions with tx_send_packetized_h264.
+ */
+struct tx_h264_packets {
+        unsigned mtu;
+        int data_len;
+        int count;
+        int size;
+        struct tx_h264_packet *packets;
+};
+
+struct tx_h264_packets *tx_h264_packets_init(void);
+void tx_h264_packets_done(struct tx_h264_packets *pkts);
+
+/**
+ * Splits an Annex-B buffer in RTP payloads (single NAL units or FU-A).
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int tx_packetize_h264(struct tx_h264_packets *pkts, uint8_t *data, int data_len,
+                unsigned mtu, int send_m);
+void tx_send_packetized_h264(struct tx *tx_session, struct tx_h264_packets *pkts,
+                struct rtp *rtp_session, uint32_t ts);
+unsigned tx_get_mtu(struct tx *tx_session);
+
 void rtpenc_h264_stats_print(void);
 
 #endif // TRANSMIT_H_
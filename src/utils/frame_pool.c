@@ -0,0 +1,252 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#include "config_unix.h"
+#include "config_win32.h"
+#endif
+
+#include <sys/mman.h>
+#include "debug.h"
+#include "utils/frame_pool.h"
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+// Cached buffers per key beyond which returned buffers are freed
+#define FRAME_POOL_MAX_FREE 32
+
+struct frame_class;
+
+/* Lives in the FRAME_POOL_ALIGN bytes preceding every buffer */
+struct frame_header {
+        struct frame_header *next;
+        struct frame_class *class;
+        size_t capacity;        ///< usable bytes after the header
+        size_t mapped;          ///< mmap length, 0 if from posix_memalign
+        uint32_t refs;
+};
+
+struct frame_class {
+        codec_t codec;
+        uint32_t width;
+        uint32_t height;
+        struct frame_header *free;
+        int free_count;
+        struct frame_class *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct frame_class *classes = NULL;
+static int use_hugepages = FALSE;
+
+static struct frame_header *buffer_header(uint8_t *buffer)
+{
+        return (struct frame_header *) (void *) (buffer - FRAME_POOL_ALIGN);
+}
+
+static uint8_t *header_buffer(struct frame_header *header)
+{
+        return (uint8_t *) header + FRAME_POOL_ALIGN;
+}
+
+static struct frame_class *find_class(codec_t codec, uint32_t width, uint32_t height)
+{
+        struct frame_class *c;
+
+        for (c = classes; c != NULL; c = c->next) {
+                if (c->codec == codec && c->width == width && c->height == height) {
+                        return c;
+                }
+        }
+
+        c = calloc(1, sizeof(struct frame_class));
+        if (c == NULL) {
+                return NULL;
+        }
+        c->codec = codec;
+        c->width = width;
+        c->height = height;
+        c->next = classes;
+        classes = c;
+
+        return c;
+}
+
+static struct frame_header *alloc_buffer(size_t capacity)
+{
+        struct frame_header *header = NULL;
+        size_t total = FRAME_POOL_ALIGN + capacity;
+        size_t mapped = 0;
+        void *mem;
+
+        if (use_hugepages && total >= HUGEPAGE_SIZE) {
+                total = (total + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+                mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (mem != MAP_FAILED) {
+                        header = mem;
+                        mapped = total;
+                }
+#endif
+                // No reserved hugepages: ask for transparent ones instead
+                if (header == NULL && posix_memalign(&mem, HUGEPAGE_SIZE, total) == 0) {
+                        header = mem;
+#ifdef MADV_HUGEPAGE
+                        madvise(mem, total, MADV_HUGEPAGE);
+#endif
+                }
+        } else if (posix_memalign(&mem, FRAME_POOL_ALIGN, total) == 0) {
+                header = mem;
+        }
+
+        if (header == NULL) {
+                return NULL;
+        }
+
+        header->next = NULL;
+        header->capacity = total - FRAME_POOL_ALIGN;
+        header->mapped = mapped;
+
+        return header;
+}
+
+static void free_buffer(struct frame_header *header)
+{
+        if (header->mapped != 0) {
+                munmap(header, header->mapped);
+        } else {
+                free(header);
+        }
+}
+
+void frame_pool_set_hugepages(int enable)
+{
+        pthread_mutex_lock(&pool_lock);
+        use_hugepages = enable;
+        pthread_mutex_unlock(&pool_lock);
+}
+
+static uint8_t *class_get(struct frame_class *c, size_t capacity)
+{
+        struct frame_header *header;
+        struct frame_header **prev;
+
+        pthread_mutex_lock(&pool_lock);
+
+        for (prev = &c->free; *prev != NULL; prev = &(*prev)->next) {
+                if ((*prev)->capacity >= capacity) {
+                        header = *prev;
+                        *prev = header->next;
+                        c->free_count--;
+                        pthread_mutex_unlock(&pool_lock);
+                        header->refs = 1;
+                        return header_buffer(header);
+                }
+        }
+
+        header = alloc_buffer(capacity);
+        pthread_mutex_unlock(&pool_lock);
+
+        if (header == NULL) {
+                error_msg("frame_pool_get: cannot allocate %zu bytes", capacity);
+                return NULL;
+        }
+        header->class = c;
+        header->refs = 1;
+
+        return header_buffer(header);
+}
+
+uint8_t *frame_pool_get(codec_t codec, uint32_t width, uint32_t height, uint32_t size)
+{
+        struct frame_class *c;
+        size_t capacity = ((size_t) size + FRAME_POOL_ALIGN - 1) & ~((size_t) FRAME_POOL_ALIGN - 1);
+
+        pthread_mutex_lock(&pool_lock);
+        c = find_class(codec, width, height);
+        pthread_mutex_unlock(&pool_lock);
+
+        if (c == NULL) {
+                error_msg("frame_pool_get: malloc error");
+                return NULL;
+        }
+
+        return class_get(c, capacity);
+}
+
+uint8_t *frame_pool_get_same(uint8_t *buffer)
+{
+        struct frame_header *header = buffer_header(buffer);
+
+        return class_get(header->class, header->capacity);
+}
+
+uint8_t *frame_pool_ref(uint8_t *buffer)
+{
+        __atomic_add_fetch(&buffer_header(buffer)->refs, 1, __ATOMIC_RELAXED);
+        return buffer;
+}
+
+int frame_pool_shared(uint8_t *buffer)
+{
+        return __atomic_load_n(&buffer_header(buffer)->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+void frame_pool_put(uint8_t *buffer)
+{
+        struct frame_header *header;
+        struct frame_class *c;
+
+        if (buffer == NULL) {
+                return;
+        }
+
+        header = buffer_header(buffer);
+        c = header->class;
+
+        // Release our accesses; the last owner acquires all the others
+        if (__atomic_sub_fetch(&header->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+                return;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        if (c->free_count < FRAME_POOL_MAX_FREE) {
+                header->next = c->free;
+                c->free = header;
+                c->free_count++;
+                header = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        if (header != NULL) {
+                free_buffer(header);
+        }
+}
+
+int frame_pool_match(uint8_t *buffer, codec_t codec, uint32_t width, uint32_t height)
+{
+        struct frame_class *c;
+
+        if (buffer == NULL) {
+                return FALSE;
+        }
+
+        // Classes are never freed, so no lock is needed to read their key
+        c = buffer_header(buffer)->class;
+        return c->codec == codec && c->width == width && c->height == height;
+}
+
+void frame_pool_trim(void)
+{
+        struct frame_class *c;
+        struct frame_header *header;
+
+        pthread_mutex_lock(&pool_lock);
+        for (c = classes; c != NULL; c = c->next) {
+                while (c->free != NULL) {
+                        header = c->free;
+                        c->free = header->next;
+                        free_buffer(header);
+                }
+                c->free_count = 0;
+        }
+        pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,78 @@
+#ifndef FRAME_POOL_H_
+#define FRAME_POOL_H_
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Process wide pool of video frame buffers keyed by (codec, width, height).
+ * Buffers are 64 byte aligned and recycled across streams, so participants
+ * joining and leaving do not hit the allocator.
+ *
+ * Buffers are reference counted so one frame can be read by several
+ * consumers without copying it; the last frame_pool_put recycles it.
+ *
+ * usage:
+ * uint8_t *buffer = frame_pool_get(RGB, 1920, 1080, size);
+ * ...
+ * frame_pool_put(buffer);
+ */
+
+#define FRAME_POOL_ALIGN 64
+
+/**
+ * Chooses the backing of new buffers.
+ * @param enable TRUE to back big buffers with hugepages (MAP_HUGETLB,
+ * falling back to transparent hugepages), FALSE for regular pages.
+ */
+void frame_pool_set_hugepages(int enable);
+
+/**
+ * @param codec Buffer format.
+ * @param width Frame width.
+ * @param height Frame height.
+ * @param size Bytes needed.
+ * @return Buffer of at least size bytes, NULL on error.
+ */
+uint8_t *frame_pool_get(codec_t codec, uint32_t width, uint32_t height, uint32_t size);
+
+/**
+ * @return New buffer with the same key and capacity as buffer, NULL on error.
+ */
+uint8_t *frame_pool_get_same(uint8_t *buffer);
+
+/**
+ * Takes an additional reference to a buffer obtained with frame_pool_get.
+ * @return buffer
+ */
+uint8_t *frame_pool_ref(uint8_t *buffer);
+
+/**
+ * @retval TRUE if somebody else holds a reference to buffer
+ */
+int frame_pool_shared(uint8_t *buffer);
+
+/**
+ * Drops a reference to a buffer obtained with frame_pool_get or
+ * frame_pool_ref. NULL is ignored.
+ */
+void frame_pool_put(uint8_t *buffer);
+
+/**
+ * @retval TRUE if buffer was obtained with frame_pool_get for this key
+ */
+int frame_pool_match(uint8_t *buffer, codec_t codec, uint32_t width, uint32_t height);
+
+/**
+ * Frees every cached buffer not currently in use.
+ */
+void frame_pool_trim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif// FRAME_POOL_H_
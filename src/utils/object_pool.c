@@ -0,0 +1,123 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#include "config_unix.h"
+#include "config_win32.h"
+#endif
+
+#include "debug.h"
+#include "utils/object_pool.h"
+
+#define OBJECT_HEADER_SIZE 16
+
+/* Lives in the OBJECT_HEADER_SIZE bytes preceding every object */
+struct object_header {
+        struct object_header *next;
+        struct object_pool *pool;
+};
+
+struct object_pool {
+        size_t size;
+        struct object_header *free;     ///< owner only
+        struct object_header *returned; ///< lock-free stack, pushed by object_pool_put
+        uint32_t refs;                  ///< one for the owner plus one per object in use
+};
+
+static struct object_header *object_header(void *object)
+{
+        return (struct object_header *) (void *) ((uint8_t *) object - OBJECT_HEADER_SIZE);
+}
+
+static void *header_object(struct object_header *header)
+{
+        return (uint8_t *) header + OBJECT_HEADER_SIZE;
+}
+
+static void free_list(struct object_header *header)
+{
+        struct object_header *next;
+
+        while (header != NULL) {
+                next = header->next;
+                free(header);
+                header = next;
+        }
+}
+
+static void object_pool_unref(struct object_pool *pool)
+{
+        if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+                return;
+        }
+
+        free_list(pool->returned);
+        free(pool);
+}
+
+struct object_pool *object_pool_init(size_t size)
+{
+        struct object_pool *pool = calloc(1, sizeof(struct object_pool));
+
+        if (pool == NULL) {
+                error_msg("object_pool_init: malloc error\n");
+                return NULL;
+        }
+        pool->size = size;
+        pool->refs = 1;
+
+        return pool;
+}
+
+void *object_pool_get(struct object_pool *pool)
+{
+        struct object_header *header;
+
+        if (pool->free == NULL) {
+                pool->free = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+        }
+
+        header = pool->free;
+        if (header != NULL) {
+                pool->free = header->next;
+        } else {
+                header = malloc(OBJECT_HEADER_SIZE + pool->size);
+                if (header == NULL) {
+                        error_msg("object_pool_get: malloc error\n");
+                        return NULL;
+                }
+                header->pool = pool;
+        }
+        __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+
+        return header_object(header);
+}
+
+void object_pool_put(void *object)
+{
+        struct object_header *header;
+        struct object_pool *pool;
+
+        if (object == NULL) {
+                return;
+        }
+
+        header = object_header(object);
+        pool = header->pool;
+
+        header->next = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&pool->returned, &header->next, header,
+                                TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+
+        object_pool_unref(pool);
+}
+
+void object_pool_done(struct object_pool *pool)
+{
+        if (pool == NULL) {
+                return;
+        }
+
+        free_list(pool->free);
+        pool->free = NULL;
+        object_pool_unref(pool);
+}
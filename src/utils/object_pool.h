@@ -0,0 +1,58 @@
+#ifndef OBJECT_POOL_H_
+#define OBJECT_POOL_H_
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Pool of fixed size objects with one allocating thread (the owner) and
+ * any number of releasing threads. Released objects go to a lock-free
+ * stack that the owner takes over as a whole when its private free list
+ * runs out, so neither side ever waits for the other and the ABA problem
+ * of a shared pop cannot arise.
+ *
+ * The pool outlives object_pool_done until its last object is released,
+ * so objects may still be in flight when the owner goes away.
+ *
+ * usage:
+ * struct object_pool *pool = object_pool_init(sizeof(struct item));
+ * struct item *item = object_pool_get(pool);     // owner thread
+ * ...
+ * object_pool_put(item);                          // any thread
+ * object_pool_done(pool);                         // owner thread
+ */
+
+struct object_pool;
+
+/**
+ * @param size Bytes of every object.
+ * @return New pool, NULL on error.
+ */
+struct object_pool *object_pool_init(size_t size);
+
+/**
+ * Owner thread only.
+ * @return Object of the pool size, NULL on error.
+ */
+void *object_pool_get(struct object_pool *pool);
+
+/**
+ * Returns an object obtained with object_pool_get to its pool.
+ * Any thread. NULL is ignored.
+ */
+void object_pool_put(void *object);
+
+/**
+ * Owner thread only. Frees the cached objects; the ones still in use are
+ * freed when released.
+ */
+void object_pool_done(struct object_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif// OBJECT_POOL_H_
@@ -0,0 +1,118 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#include "config_unix.h"
+#include "config_win32.h"
+#endif
+
+#include <time.h>
+#include "debug.h"
+#include "utils/pacer.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+struct pacer {
+        pthread_mutex_t lock;
+        uint64_t rate;          ///< bits per second, 0 for no limit
+        int64_t burst;          ///< bytes
+        int64_t tokens;         ///< bytes, negative while in debt
+        uint64_t last;          ///< time tokens were refilled last
+};
+
+struct pacer *pacer_init(uint64_t rate, uint32_t burst)
+{
+        struct pacer *pacer = calloc(1, sizeof(struct pacer));
+
+        if (pacer == NULL) {
+                error_msg("pacer_init: malloc error\n");
+                return NULL;
+        }
+        pthread_mutex_init(&pacer->lock, NULL);
+        pacer->rate = rate;
+        pacer->burst = burst;
+        pacer->tokens = burst;
+        pacer->last = pacer_now();
+
+        return pacer;
+}
+
+void pacer_done(struct pacer *pacer)
+{
+        if (pacer == NULL) {
+                return;
+        }
+
+        pthread_mutex_destroy(&pacer->lock);
+        free(pacer);
+}
+
+void pacer_set_rate(struct pacer *pacer, uint64_t rate, uint32_t burst)
+{
+        pthread_mutex_lock(&pacer->lock);
+        pacer->rate = rate;
+        pacer->burst = burst;
+        if (pacer->tokens > pacer->burst) {
+                pacer->tokens = pacer->burst;
+        }
+        pthread_mutex_unlock(&pacer->lock);
+}
+
+uint64_t pacer_charge(struct pacer *pacer, uint32_t bytes, uint64_t now)
+{
+        uint64_t elapsed, when = now;
+
+        pthread_mutex_lock(&pacer->lock);
+        if (pacer->rate == 0) {
+                pacer->last = now;
+                pthread_mutex_unlock(&pacer->lock);
+                return now;
+        }
+
+        // Whole bytes only, the remainder stays in the time not accounted
+        if (now > pacer->last) {
+                elapsed = now - pacer->last;
+                if (elapsed >= NS_PER_SEC) {
+                        pacer->tokens = pacer->burst;
+                        pacer->last = now;
+                } else {
+                        uint64_t refill = (double) elapsed * pacer->rate / (8 * NS_PER_SEC);
+
+                        pacer->tokens += refill;
+                        pacer->last += (double) refill * 8 * NS_PER_SEC / pacer->rate;
+                        if (pacer->tokens >= pacer->burst) {
+                                pacer->tokens = pacer->burst;
+                                pacer->last = now;
+                        }
+                }
+        }
+
+        pacer->tokens -= bytes;
+        if (pacer->tokens < 0) {
+                when = pacer->last + (double) -pacer->tokens * 8 * NS_PER_SEC / pacer->rate;
+        }
+        pthread_mutex_unlock(&pacer->lock);
+
+        return when;
+}
+
+int pacer_must_wait(uint64_t when, uint64_t now)
+{
+        return when > now + PACER_MIN_SLEEP_NS;
+}
+
+uint64_t pacer_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void pacer_sleep_until(uint64_t when)
+{
+        struct timespec ts;
+
+        ts.tv_sec = when / NS_PER_SEC;
+        ts.tv_nsec = when % NS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+}
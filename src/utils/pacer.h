@@ -0,0 +1,77 @@
+#ifndef PACER_H_
+#define PACER_H_
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Token bucket pacing egress to a rate, on CLOCK_MONOTONIC.
+ *
+ * The bucket holds up to burst bytes, refilled at rate. Every packet is
+ * charged when it is sent, and when the bucket runs dry the sender learns
+ * when the debt is paid and sleeps until then instead of spinning. Debts
+ * shorter than PACER_MIN_SLEEP_NS are carried over to the next packets,
+ * so sleeps never go below the timer resolution and the rate still holds
+ * on average.
+ *
+ * A pacer may be shared by the threads sending to several destinations,
+ * a stream and its participants for instance, charging each packet to
+ * every bucket it goes through.
+ *
+ * usage:
+ * struct pacer *pacer = pacer_init(100000000, 64 * 1024);
+ * ...
+ * now = pacer_now();
+ * when = pacer_charge(pacer, len, now);
+ * if (pacer_must_wait(when, now)) {
+ *         pacer_sleep_until(when);
+ * }
+ * send(...);
+ * ...
+ * pacer_done(pacer);
+ */
+
+#define PACER_MIN_SLEEP_NS      100000
+
+struct pacer;
+
+/**
+ * @param rate Bits per second, 0 for no limit.
+ * @param burst Bytes that may leave at once after an idle period.
+ * @return New pacer, NULL on error.
+ */
+struct pacer *pacer_init(uint64_t rate, uint32_t burst);
+void pacer_done(struct pacer *pacer);
+
+/**
+ * Changes the rate and the burst, keeping the debt. Any thread.
+ */
+void pacer_set_rate(struct pacer *pacer, uint64_t rate, uint32_t burst);
+
+/**
+ * Charges bytes to the bucket. Any thread.
+ * @param now As given by pacer_now().
+ * @return Time at which the bytes may leave, now if they may right away.
+ */
+uint64_t pacer_charge(struct pacer *pacer, uint32_t bytes, uint64_t now);
+
+/**
+ * @return TRUE if the bytes charged must wait until when.
+ */
+int pacer_must_wait(uint64_t when, uint64_t now);
+
+/**
+ * @return CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t pacer_now(void);
+
+void pacer_sleep_until(uint64_t when);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif// PACER_H_
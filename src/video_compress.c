@@ -291,9 +291,10 @@ static struct response *compress_change_callback(struct module *receiver, struct
                 (struct msg_change_compress_data *) msg;
         compress_state_proxy *proxy = receiver->priv_data;
 
-        /* In this case we are only changing some parameter of compression.
-         * This means that we pass the parameter to compress driver. */
-        if(data->what == CHANGE_PARAMS) {
+        /* In this case we are only changing some parameter of compression
+         * or asking for a keyframe.
+         * This means that we pass the message to compress driver. */
+        if(data->what == CHANGE_PARAMS || data->what == FORCE_KEYFRAME) {
                 platform_spin_lock(&proxy->spin);
                 struct response *resp = NULL;
                 for(unsigned int i = 0; i < proxy->ptr->state_count; ++i) {
@@ -247,6 +247,12 @@ static struct response *compress_change_callback(struct module *mod, struct mess
         struct msg_change_compress_data *data =
                 (struct msg_change_compress_data *) msg;
 
+        /* Every JPEG frame is a keyframe */
+        if(data->what == FORCE_KEYFRAME) {
+                free_message(msg);
+                return new_response(RESPONSE_OK, NULL);
+        }
+
         platform_spin_lock(&s->spin);
         parse_fmt(s, data->config_string);
         ret = new_response(RESPONSE_OK, NULL);
@@ -136,6 +136,9 @@ struct state_video_compress_libav {
         codec_t             out_codec;
         char               *preset;
 
+        // set by a FORCE_KEYFRAME message, cleared by the next frame
+        bool                force_keyframe;
+
         platform_spin_t     spin;
         void               *message_subscription;
 };
@@ -251,6 +254,7 @@ struct module * libavcodec_compress_init(struct module *parent, char * fmt)
         s->selected_codec_id = DEFAULT_CODEC;
         s->subsampling = s->requested_subsampling = 0;
         s->preset = NULL;
+        s->force_keyframe = false;
 
         s->requested_bitrate = -1;
 
@@ -594,6 +598,12 @@ struct tile * libavcodec_compress_tile(struct module *mod, struct tile *tx, stru
         }
 
         s->in_frame->pts = frame_seq++;
+        if(s->force_keyframe) {
+                s->in_frame->pict_type = AV_PICTURE_TYPE_I;
+                s->force_keyframe = false;
+        } else {
+                s->in_frame->pict_type = AV_PICTURE_TYPE_NONE;
+        }
 #ifdef HAVE_AVCODEC_ENCODE_VIDEO2
         av_free_packet(&s->pkt[buffer_idx]);
         av_init_packet(&s->pkt[buffer_idx]);
@@ -803,6 +813,9 @@ static void setparam_h264(AVCodecContext *codec_ctx, struct setparam_param *para
         codec_ctx->refs = 1;
         av_opt_set(codec_ctx->priv_data, "intra-refresh", "1", 0);
 #endif // defined DISABLE_H264_INTRA_REFRESH
+        // with intra refresh an I frame is not an IDR unless forced, and
+        // FORCE_KEYFRAME needs one for the receiver to resync
+        av_opt_set(codec_ctx->priv_data, "forced-idr", "1", 0);
 }
 
 static void setparam_vp8(AVCodecContext *codec_ctx, struct setparam_param *param)
@@ -823,12 +836,28 @@ static struct response *compress_change_callback(struct module *mod, struct mess
                 (struct msg_change_compress_data *) msg;
 
         platform_spin_lock(&s->spin);
+        if(data->what == FORCE_KEYFRAME) {
+                s->force_keyframe = true;
+                platform_spin_unlock(&s->spin);
+                free_message(msg);
+                return new_response(RESPONSE_OK, NULL);
+        }
         if(parse_fmt(s, data->config_string) == 0) {
                 ret = new_response(RESPONSE_OK, NULL);
         } else {
                 ret = new_response(RESPONSE_BAD_REQUEST, strdup("(Module libavcodec)"));
         }
-        memset(&s->saved_desc, 0, sizeof(s->saved_desc));
+        if(s->codec_ctx && s->requested_bitrate > 0 &&
+                        strncasecmp("bitrate=", data->config_string, strlen("bitrate=")) == 0 &&
+                        strchr(data->config_string, ':') == NULL) {
+                // A bare bitrate change is taken by the open encoder (libx264
+                // reconfigures itself on the next frame), reopening it would
+                // cost an IDR frame
+                s->codec_ctx->bit_rate = s->requested_bitrate;
+                s->codec_ctx->bit_rate_tolerance = s->codec_ctx->bit_rate / 4;
+        } else {
+                memset(&s->saved_desc, 0, sizeof(s->saved_desc));
+        }
         platform_spin_unlock(&s->spin);
 
         free_message(msg);
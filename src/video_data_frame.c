@@ -1,15 +1,66 @@
 #include "debug.h"
 #include <errno.h>
 #include "video_data_frame.h"
+#include "utils/frame_pool.h"
 
 video_data_frame_t *init_video_data_frame();
 int destroy_video_data_frame(video_data_frame_t *frame);
 int set_video_data_frame(video_data_frame_t *frame, codec_t codec, uint32_t width, uint32_t height);
 
+// Extra room so a slightly bigger frame does not force a new allocation
+#define CODED_BUFFER_SLACK 4096
+
+coded_buffer_t *coded_buffer_alloc(uint32_t size){
+    coded_buffer_t *coded = malloc(sizeof(coded_buffer_t));
+    if (coded == NULL){
+        error_msg("coded_buffer_alloc: malloc error");
+        return NULL;
+    }
+
+    coded->data = malloc(size);
+    if (coded->data == NULL){
+        error_msg("coded_buffer_alloc: malloc error");
+        free(coded);
+        return NULL;
+    }
+    coded->len = 0;
+    coded->size = size;
+    coded->refs = 1;
+
+    return coded;
+}
+
+coded_buffer_t *coded_buffer_ref(coded_buffer_t *coded){
+    __atomic_add_fetch(&coded->refs, 1, __ATOMIC_RELAXED);
+    return coded;
+}
+
+void coded_buffer_unref(coded_buffer_t *coded){
+    if (coded == NULL){
+        return;
+    }
+    // Release our accesses; the last owner acquires all the others
+    if (__atomic_sub_fetch(&coded->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        free(coded->data);
+        free(coded);
+    }
+}
+
+static void release_frame_buffer(video_data_frame_t *frame){
+    if (frame->coded != NULL){
+        coded_buffer_unref(frame->coded);
+        frame->coded = NULL;
+    } else {
+        frame_pool_put(frame->buffer);
+    }
+    frame->buffer = NULL;
+}
+
 video_data_frame_t *init_video_data_frame(){
     video_data_frame_t *frame = malloc(sizeof(video_data_frame_t));
 
     frame->buffer = NULL;
+    frame->coded = NULL;
     frame->seqno = 0;
     frame->frame_type = BFRAME;
 
@@ -17,7 +68,7 @@ video_data_frame_t *init_video_data_frame(){
 }
 
 int destroy_video_data_frame(video_data_frame_t *frame){
-    free(frame->buffer);
+    release_frame_buffer(frame);
     free(frame);
     return TRUE;
 }
@@ -33,7 +84,14 @@ int set_video_data_frame(video_data_frame_t *frame, codec_t codec, uint32_t widt
     }
     
     frame->buffer_len = width*height*3; 
-    frame->buffer = realloc(frame->buffer, frame->buffer_len);
+
+    // Reconfiguring to the same format keeps the buffer we already have
+    if (frame->coded == NULL && frame_pool_match(frame->buffer, codec, width, height)){
+        return TRUE;
+    }
+
+    release_frame_buffer(frame);
+    frame->buffer = frame_pool_get(codec, width, height, frame->buffer_len);
 
     if (frame->buffer == NULL) {
         error_msg("set_stream_video_data: malloc error");
@@ -43,29 +101,124 @@ int set_video_data_frame(video_data_frame_t *frame, codec_t codec, uint32_t widt
     return TRUE;
 }
 
-video_frame_cq_t *init_video_frame_cq(uint8_t max){
-    video_frame_cq_t* frame_cq = malloc(sizeof(video_frame_cq_t));
+uint8_t *reserve_coded_frame_data(video_data_frame_t *frame, uint32_t size){
+    coded_buffer_t *coded = frame->coded;
+
+    // refs is only raised by consumers while the frame is queued, and this
+    // frame is owned by the producer now, so a single reference is ours
+    if (coded == NULL 
+            || __atomic_load_n(&coded->refs, __ATOMIC_ACQUIRE) != 1 
+            || coded->size < size){
+        coded = coded_buffer_alloc(size + CODED_BUFFER_SLACK);
+        if (coded == NULL){
+            return NULL;
+        }
+        release_frame_buffer(frame);
+        frame->coded = coded;
+    }
+
+    coded->len = 0;
+    frame->buffer = coded->data;
+    frame->buffer_len = 0;
+
+    return coded->data;
+}
+
+int set_coded_frame_data(video_data_frame_t *frame, uint8_t *data, uint32_t len){
+    uint8_t *buffer = reserve_coded_frame_data(frame, len);
+
+    if (buffer == NULL){
+        return FALSE;
+    }
+
+    memcpy(buffer, data, len);
+    frame->coded->len = len;
+    frame->buffer_len = len;
+
+    return TRUE;
+}
+
+int share_video_data_frame(video_data_frame_t *dst, video_data_frame_t *src){
+    if (dst->buffer != src->buffer){
+        release_frame_buffer(dst);
+        if (src->coded != NULL){
+            dst->coded = coded_buffer_ref(src->coded);
+            dst->buffer = dst->coded->data;
+        } else if (src->buffer != NULL){
+            dst->buffer = frame_pool_ref(src->buffer);
+        }
+    }
+
+    dst->buffer_len = src->buffer_len;
+    dst->curr_seqno = src->curr_seqno;
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->media_time = src->media_time;
+    dst->seqno = src->seqno;
+    dst->frame_type = src->frame_type;
+    dst->codec = src->codec;
+
+    return TRUE;
+}
+
+// Producers overwrite the buffer, so it must not be shared with a consumer
+// of another queue anymore
+static video_data_frame_t *own_video_data_frame(video_data_frame_t *frame){
+    uint8_t *buffer;
+
+    if (frame->coded != NULL || frame->buffer == NULL || !frame_pool_shared(frame->buffer)){
+        return frame;
+    }
+
+    buffer = frame_pool_get_same(frame->buffer);
+    if (buffer == NULL){
+        return NULL;
+    }
+    frame_pool_put(frame->buffer);
+    frame->buffer = buffer;
+
+    return frame;
+}
+
+video_frame_cq_t *init_video_frame_cq(uint8_t max, cq_policy_t policy){
+    pthread_condattr_t attr;
     
     if (max <= 1){
         error_msg("video frame queue must have at least 2 positions");
         return NULL;
     }
     
+    video_frame_cq_t* frame_cq = malloc(sizeof(video_frame_cq_t));
+    if (frame_cq == NULL){
+        error_msg("init_video_frame_cq: malloc error");
+        return NULL;
+    }
+    
     frame_cq->rear = 0;
     frame_cq->front = 0;
     frame_cq->max = max;
-    frame_cq->state = CQ_EMPTY;
+    frame_cq->policy = policy;
+    memset(&frame_cq->counters, 0, sizeof(cq_counters_t));
     frame_cq->in_process = FALSE;
     frame_cq->out_process = FALSE;
     frame_cq->delay_sum = 0;
     frame_cq->delay = 0;
     frame_cq->remove_counter = 0;
+    frame_cq->waiters = 0;
+    frame_cq->ready_cb = NULL;
+    frame_cq->ready_arg = NULL;
     frame_cq->frames = malloc(sizeof(video_data_frame_t*)*max);
     
     frame_cq->fps = 0.0;
     frame_cq->put_counter = 0;
     frame_cq->fps_sum = 0;
     frame_cq->last_frame_time = 0;
+
+    pthread_mutex_init(&frame_cq->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&frame_cq->cond, &attr);
+    pthread_condattr_destroy(&attr);
     
     for(int i = 0; i < max; i++){
         frame_cq->frames[i] = init_video_data_frame();
@@ -78,6 +231,9 @@ int destroy_video_frame_cq(video_frame_cq_t* frame_cq){
     for(uint8_t i = 0; i < frame_cq->max; i++){
        destroy_video_data_frame(frame_cq->frames[i]);
     }
+    pthread_cond_destroy(&frame_cq->cond);
+    pthread_mutex_destroy(&frame_cq->lock);
+    free(frame_cq->frames);
     free(frame_cq);
     return TRUE;
 }
@@ -92,33 +248,278 @@ int set_video_frame_cq(video_frame_cq_t *frame_cq, codec_t codec, uint32_t width
     return TRUE;
 }
 
-video_data_frame_t* curr_in_frame(video_frame_cq_t *frame_cq){
-    
-    while (frame_cq->state == CQ_FULL){
+int resize_video_frame_cq(video_frame_cq_t *frame_cq, uint8_t max){
+    video_data_frame_t **frames;
+    video_data_frame_t *model;
+
+    if (max <= 1){
+        error_msg("video frame queue must have at least 2 positions");
+        return FALSE;
+    }
+
+    for(uint8_t i = max; i < frame_cq->max; i++){
+        destroy_video_data_frame(frame_cq->frames[i]);
+    }
+
+    frames = realloc(frame_cq->frames, sizeof(video_data_frame_t*)*max);
+    if (frames == NULL){
+        error_msg("resize_video_frame_cq: realloc error");
+        return FALSE;
+    }
+    frame_cq->frames = frames;
+
+    model = frame_cq->frames[0];
+    for(uint8_t i = frame_cq->max; i < max; i++){
+        frame_cq->frames[i] = init_video_data_frame();
+        if (model->buffer != NULL 
+                && !set_video_data_frame(frame_cq->frames[i], model->codec, model->width, model->height)){
+            frame_cq->max = i + 1;
+            return FALSE;
+        }
+    }
+
+    frame_cq->max = max;
+    frame_cq->rear = 0;
+    frame_cq->front = 0;
+    frame_cq->in_process = FALSE;
+    frame_cq->out_process = FALSE;
+
+    return TRUE;
+}
+
+void set_video_frame_cq_ready_cb(video_frame_cq_t *frame_cq, void (*ready_cb)(void *), void *ready_arg){
+    __atomic_store_n(&frame_cq->ready_cb, NULL, __ATOMIC_RELEASE);
+    frame_cq->ready_arg = ready_arg;
+    // The producer loads ready_cb first, so it never sees a stale ready_arg
+    __atomic_store_n(&frame_cq->ready_cb, ready_cb, __ATOMIC_RELEASE);
+}
+
+void set_video_frame_cq_policy(video_frame_cq_t *frame_cq, cq_policy_t policy){
+    __atomic_store_n(&frame_cq->policy, policy, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t cq_next(video_frame_cq_t *frame_cq, uint32_t pos){
+    return (pos + 1) % (2 * frame_cq->max);
+}
+
+static inline uint32_t cq_level(video_frame_cq_t *frame_cq, uint32_t rear, uint32_t front){
+    return (rear + 2 * frame_cq->max - (front >> 1)) % (2 * frame_cq->max);
+}
+
+static void cq_notify(video_frame_cq_t *frame_cq){
+    // Only pay for the mutex when the other side is actually sleeping
+    if (__atomic_load_n(&frame_cq->waiters, __ATOMIC_SEQ_CST) == 0){
+        return;
+    }
+    pthread_mutex_lock(&frame_cq->lock);
+    pthread_cond_broadcast(&frame_cq->cond);
+    pthread_mutex_unlock(&frame_cq->lock);
+}
+
+static video_data_frame_t *cq_wait(video_frame_cq_t *frame_cq, 
+        video_data_frame_t *(*get_frame)(video_frame_cq_t *), uint32_t timeout_us){
+    video_data_frame_t *frame;
+    struct timespec deadline;
+
+    frame = get_frame(frame_cq);
+    if (frame != NULL || timeout_us == 0){
+        return frame;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    // Announce ourselves before re-checking so put/remove cannot miss us
+    __atomic_add_fetch(&frame_cq->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&frame_cq->lock);
+    while ((frame = get_frame(frame_cq)) == NULL){
+        if (pthread_cond_timedwait(&frame_cq->cond, &frame_cq->lock, &deadline) == ETIMEDOUT){
+            frame = get_frame(frame_cq);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&frame_cq->lock);
+    __atomic_sub_fetch(&frame_cq->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return frame;
+}
+
+// Free slot for the producer as it is, NULL only if the queue is full
+static video_data_frame_t *cq_in_slot(video_frame_cq_t *frame_cq){
+    uint32_t front;
+
+    // Acquire pairs with the consumer release in remove_frame: the slot is free to reuse
+    front = __atomic_load_n(&frame_cq->front, __ATOMIC_ACQUIRE);
+    if (cq_level(frame_cq, frame_cq->rear, front) == frame_cq->max){
         return NULL;
     }
     frame_cq->in_process = TRUE;
 
-    return frame_cq->frames[frame_cq->rear];
+    return frame_cq->frames[frame_cq->rear % frame_cq->max];
+}
+
+// Gives a slot from cq_in_slot a buffer the producer can write to. A
+// failure leaves the slot free, and is no reason to drop queued frames
+static video_data_frame_t *own_in_slot(video_frame_cq_t *frame_cq, video_data_frame_t *frame){
+    if (frame == NULL){
+        return NULL;
+    }
+    if (own_video_data_frame(frame) == NULL){
+        error_msg("own_in_slot: no buffer for the incoming frame");
+        frame_cq->in_process = FALSE;
+        frame_cq->counters.alloc_failed++;
+        return NULL;
+    }
+    return frame;
+}
+
+video_data_frame_t* curr_in_frame(video_frame_cq_t *frame_cq){
+    return own_in_slot(frame_cq, cq_in_slot(frame_cq));
+}
+
+video_data_frame_t* wait_in_frame(video_frame_cq_t *frame_cq, uint32_t timeout_us){
+    return own_in_slot(frame_cq, cq_wait(frame_cq, cq_in_slot, timeout_us));
+}
+
+static video_data_frame_t *drop_incoming(video_frame_cq_t *frame_cq, frame_type_t type){
+    frame_cq->counters.dropped_newest++;
+    if (type == INTRA){
+        frame_cq->counters.dropped_intra++;
+    }
+    return NULL;
+}
+
+// Time an incoming INTRA waits at a time for the consumer to release the
+// frame it holds, see cq_intra_slot
+#define CQ_INTRA_WAIT_US 10000
+
+// A new INTRA frame supersedes the queued GOP: drops every queued frame
+// the consumer has not claimed, oldest first. FALSE if none could be
+static int flush_gop(video_frame_cq_t *frame_cq){
+    uint32_t front;
+    frame_type_t type;
+    int dropped = FALSE;
+
+    front = __atomic_load_n(&frame_cq->front, __ATOMIC_ACQUIRE);
+    while (!(front & 1) && cq_level(frame_cq, frame_cq->rear, front) > 0){
+        type = frame_cq->frames[(front >> 1) % frame_cq->max]->frame_type;
+        // Fails, updating front, if the consumer claimed it meanwhile
+        if (__atomic_compare_exchange_n(&frame_cq->front, &front, 
+                    cq_next(frame_cq, front >> 1) << 1,
+                    FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            frame_cq->counters.dropped_oldest++;
+            if (type == INTRA){
+                frame_cq->counters.dropped_intra++;
+            }
+            front = cq_next(frame_cq, front >> 1) << 1;
+            dropped = TRUE;
+        }
+    }
+
+    return dropped;
+}
+
+// Slot for an incoming INTRA of a CQ_DROP_GOP queue, NULL while the
+// consumer holds the only frame that could make room
+static video_data_frame_t *cq_intra_slot(video_frame_cq_t *frame_cq){
+    video_data_frame_t *frame;
+
+    frame = cq_in_slot(frame_cq);
+    if (frame == NULL && flush_gop(frame_cq)){
+        frame = cq_in_slot(frame_cq);
+    }
+    return frame;
+}
+
+// get_in_frame on the bare slots: NULL always means no room
+static video_data_frame_t *get_in_slot(video_frame_cq_t *frame_cq, frame_type_t type, uint32_t timeout_us){
+    video_data_frame_t *frame;
+    uint32_t front;
+
+    frame = cq_in_slot(frame_cq);
+    if (frame != NULL){
+        return frame;
+    }
+
+    switch (__atomic_load_n(&frame_cq->policy, __ATOMIC_RELAXED)){
+        case CQ_DROP_OLDEST:
+            if (flush_frames(frame_cq)){
+                return cq_in_slot(frame_cq);
+            }
+            // The consumer is processing the oldest frame, wait for it
+            break;
+        case CQ_DROP_NEWEST:
+            return drop_incoming(frame_cq, type);
+        case CQ_BLOCK:
+            break;
+        case CQ_DROP_GOP:
+            if (type == INTRA){
+                // Never dropped: consumers release their frame promptly,
+                // so wait for it however long the caller was ready to
+                frame = cq_intra_slot(frame_cq);
+                while (frame == NULL){
+                    frame_cq->counters.blocked++;
+                    frame = cq_wait(frame_cq, cq_intra_slot, 
+                            timeout_us != 0 ? timeout_us : CQ_INTRA_WAIT_US);
+                }
+                return frame;
+            }
+            if (type == BFRAME){
+                return drop_incoming(frame_cq, type);
+            }
+            // The oldest frame can only be dropped if nobody references it
+            front = __atomic_load_n(&frame_cq->front, __ATOMIC_ACQUIRE);
+            if (!(front & 1) 
+                    && frame_cq->frames[(front >> 1) % frame_cq->max]->frame_type != INTRA
+                    && flush_frames(frame_cq)){
+                return cq_in_slot(frame_cq);
+            }
+            return drop_incoming(frame_cq, type);
+    }
+
+    if (timeout_us != 0){
+        frame_cq->counters.blocked++;
+    }
+    frame = cq_wait(frame_cq, cq_in_slot, timeout_us);
+    if (frame == NULL){
+        return drop_incoming(frame_cq, type);
+    }
+    return frame;
+}
+
+video_data_frame_t* get_in_frame(video_frame_cq_t *frame_cq, frame_type_t type, uint32_t timeout_us){
+    return own_in_slot(frame_cq, get_in_slot(frame_cq, type, timeout_us));
+}
+
+video_data_frame_t* get_in_frame_to_share(video_frame_cq_t *frame_cq, frame_type_t type, uint32_t timeout_us){
+    return get_in_slot(frame_cq, type, timeout_us);
 }
 
 int put_frame(video_frame_cq_t *frame_cq){
-    uint8_t r;
+    void (*ready_cb)(void *);
+#ifdef STATS
     uint32_t local_time;
+#endif
     
     if (! frame_cq->in_process){
         return FALSE;
     }
     
     frame_cq->in_process = FALSE;
-    
-    r =  (frame_cq->rear + 1) % frame_cq->max;
-    if (r == frame_cq->front) {
-        frame_cq->state = CQ_FULL;
-    } else {
-        frame_cq->state = CQ_OK;
+
+    // Publishes the frame contents to the consumer
+    __atomic_store_n(&frame_cq->rear, cq_next(frame_cq, frame_cq->rear), __ATOMIC_SEQ_CST);
+    cq_notify(frame_cq);
+    ready_cb = __atomic_load_n(&frame_cq->ready_cb, __ATOMIC_ACQUIRE);
+    if (ready_cb != NULL){
+        ready_cb(frame_cq->ready_arg);
     }
-    frame_cq->rear = r;
+    frame_cq->counters.put++;
 
 #ifdef STATS
     frame_cq->put_counter++;
@@ -137,16 +538,32 @@ int put_frame(video_frame_cq_t *frame_cq){
 }
 
 video_data_frame_t* curr_out_frame(video_frame_cq_t *frame_cq){
-    
-    while (frame_cq->state == CQ_EMPTY){
-        return NULL;
-    }
+    uint32_t front, rear;
+
+    front = __atomic_load_n(&frame_cq->front, __ATOMIC_ACQUIRE);
+    do {
+        if (front & 1){
+            // Already claimed by a previous call
+            break;
+        }
+        rear = __atomic_load_n(&frame_cq->rear, __ATOMIC_ACQUIRE);
+        if (cq_level(frame_cq, rear, front) == 0){
+            return NULL;
+        }
+        // Claim the front frame, fails if flush_frames dropped it meanwhile
+    } while (!__atomic_compare_exchange_n(&frame_cq->front, &front, front | 1, 
+                FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
     frame_cq->out_process = TRUE;
-    return frame_cq->frames[frame_cq->front];
+    return frame_cq->frames[(front >> 1) % frame_cq->max];
+}
+
+video_data_frame_t* wait_out_frame(video_frame_cq_t *frame_cq, uint32_t timeout_us){
+    return cq_wait(frame_cq, curr_out_frame, timeout_us);
 }
 
 int remove_frame(video_frame_cq_t *frame_cq){
-    uint8_t f;
+    uint32_t f;
     
     if (! frame_cq->out_process){
         return FALSE;
@@ -154,19 +571,11 @@ int remove_frame(video_frame_cq_t *frame_cq){
     
     frame_cq->out_process = FALSE;
 
-#ifdef STATS
-    video_data_frame_t* frame = frame_cq->frames[frame_cq->front];
-#endif
-    
-    f =  (frame_cq->front + 1) % frame_cq->max;
-    if (f == frame_cq->rear) {
-        frame_cq->state = CQ_EMPTY;
-    } else {
-        frame_cq->state = CQ_OK;
-    }
-    frame_cq->front = f;
+    // The claim bit is set, so the producer does not touch front until we release it
+    f = __atomic_load_n(&frame_cq->front, __ATOMIC_RELAXED) >> 1;
 
 #ifdef STATS
+    video_data_frame_t* frame = frame_cq->frames[f % frame_cq->max];
     frame_cq->delay_sum += get_local_mediatime_us() - frame->media_time;
     frame_cq->remove_counter++;
     if (frame_cq->remove_counter == MAX_COUNTER){
@@ -176,18 +585,32 @@ int remove_frame(video_frame_cq_t *frame_cq){
     }
 #endif
     
+    __atomic_store_n(&frame_cq->front, cq_next(frame_cq, f) << 1, __ATOMIC_SEQ_CST);
+    cq_notify(frame_cq);
+    
     return TRUE;
 }
 
-
 int flush_frames(video_frame_cq_t *frame_cq){
-    uint8_t r;
+    uint32_t front;
+    frame_type_t type;
 
-    if (frame_cq->state == CQ_FULL){
-        frame_cq->front = (frame_cq->front + (frame_cq->max - 1)) % frame_cq->max;
-        frame_cq->state = CQ_OK;
+    front = __atomic_load_n(&frame_cq->front, __ATOMIC_ACQUIRE);
+    while (cq_level(frame_cq, frame_cq->rear, front) == frame_cq->max){
+        if (front & 1){
+            return FALSE;
+        }
+        type = frame_cq->frames[(front >> 1) % frame_cq->max]->frame_type;
+        if (__atomic_compare_exchange_n(&frame_cq->front, &front, 
+                    cq_next(frame_cq, front >> 1) << 1,
+                    FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            frame_cq->counters.dropped_oldest++;
+            if (type == INTRA){
+                frame_cq->counters.dropped_intra++;
+            }
+            break;
+        }
     }
     
     return TRUE;
 }
-
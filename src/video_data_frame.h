@@ -16,8 +16,50 @@ typedef enum frame_type {
     OTHER
 } frame_type_t;
 
+/**
+ * What a producer does when it finds its queue full.
+ * CQ_DROP_OLDEST discards the oldest queued frame, CQ_DROP_NEWEST discards
+ * the incoming one, CQ_BLOCK waits for the consumer and CQ_DROP_GOP never
+ * discards a queued INTRA frame, dropping non reference and then dependent
+ * frames instead, until an INTRA frame comes in: that one is never
+ * discarded and supersedes the queued GOP, whose unclaimed frames go.
+ */
+typedef enum cq_policy {
+    CQ_DROP_OLDEST,
+    CQ_DROP_NEWEST,
+    CQ_BLOCK,
+    CQ_DROP_GOP
+} cq_policy_t;
+
+typedef struct cq_counters {
+    uint32_t put;               // frames published
+    uint32_t dropped_oldest;    // queued frames discarded to make room
+    uint32_t dropped_newest;    // incoming frames discarded
+    uint32_t dropped_intra;     // INTRA frames among the discarded ones
+    uint32_t blocked;           // times the producer had to wait for room
+    uint32_t alloc_failed;      // free slots refused for lack of a buffer of their own
+} cq_counters_t;
+
+/**
+ * Reference counted storage for a coded frame. The producer queues it
+ * together with a video_data_frame_t and any consumer that needs the data
+ * after removing that frame takes its own reference with coded_buffer_ref.
+ * The memory is released by the last coded_buffer_unref.
+ */
+typedef struct coded_buffer {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t size;
+    uint32_t refs;
+} coded_buffer_t;
+
+coded_buffer_t *coded_buffer_alloc(uint32_t size);
+coded_buffer_t *coded_buffer_ref(coded_buffer_t *coded);
+void coded_buffer_unref(coded_buffer_t *coded);
+
 typedef struct video_frame_data {
-    uint8_t *buffer;
+    uint8_t *buffer;            // coded->data when coded is set
+    coded_buffer_t *coded;
     uint32_t buffer_len;
     uint32_t curr_seqno;
     uint32_t width;
@@ -28,11 +70,20 @@ typedef struct video_frame_data {
     codec_t codec;
 } video_data_frame_t;
 
+/**
+ * Single producer, single consumer frame ring.
+ * rear and front are positions in [0, 2*max), so a full ring can be told
+ * apart from an empty one without a shared state field. rear is only written
+ * by the producer. front is written by the consumer and, through flush_frames,
+ * by the producer; its lowest bit marks the front frame as claimed by the
+ * consumer (curr_out_frame) so the producer never drops a frame in use.
+ */
 typedef struct video_frame_cq {
-    uint8_t rear;
-    uint8_t front;
+    uint32_t rear;
+    uint32_t front;
     uint8_t max;
-    int state;
+    cq_policy_t policy;
+    cq_counters_t counters;     // only written by the producer
     int in_process; //True false
     int out_process;
     uint32_t delay_sum;
@@ -42,16 +93,126 @@ typedef struct video_frame_cq {
     uint8_t put_counter;
     uint32_t fps_sum;
     uint32_t last_frame_time;
+    uint32_t waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*ready_cb)(void *);   // called by put_frame, see set_video_frame_cq_ready_cb
+    void *ready_arg;
 	video_data_frame_t **frames;
 } video_frame_cq_t;
 
-video_frame_cq_t *init_video_frame_cq(uint8_t max);
+video_frame_cq_t *init_video_frame_cq(uint8_t max, cq_policy_t policy);
 int destroy_video_frame_cq(video_frame_cq_t *frame_cq);
+
+/**
+ * Changes the number of frames of an idle queue, keeping the frame format
+ * configured with set_video_frame_cq. Queued frames are discarded.
+ * Must not be called while a producer or consumer thread uses the queue.
+ * @param frame_cq Target video_frame_cq_t.
+ * @param max New number of frames, at least 2.
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int resize_video_frame_cq(video_frame_cq_t *frame_cq, uint8_t max);
+
+/**
+ * Sets the overflow policy applied by get_in_frame.
+ * @param frame_cq Target video_frame_cq_t.
+ * @param policy New cq_policy_t.
+ */
+void set_video_frame_cq_policy(video_frame_cq_t *frame_cq, cq_policy_t policy);
+
+/**
+ * Registers a callback run by the producer after every put_frame, so a
+ * consumer serving many queues can learn which ones have frames instead of
+ * polling them. It must be cheap and must not block.
+ * @param frame_cq Target video_frame_cq_t.
+ * @param ready_cb Callback, NULL to unregister.
+ * @param ready_arg Argument passed to ready_cb.
+ */
+void set_video_frame_cq_ready_cb(video_frame_cq_t *frame_cq, void (*ready_cb)(void *), void *ready_arg);
+
 int set_video_frame_cq(video_frame_cq_t *frame_cq, codec_t codec, uint32_t width, uint32_t height);
+
+/**
+ * Stores len bytes of coded data in a producer frame. The frame keeps its
+ * coded_buffer_t when nobody else references it and it is big enough,
+ * otherwise a new one is attached.
+ * @param frame Frame obtained with curr_in_frame or get_in_frame.
+ * @param data Coded data to copy.
+ * @param len Length of data.
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int set_coded_frame_data(video_data_frame_t *frame, uint8_t *data, uint32_t len);
+
+/**
+ * Gives a producer frame a coded_buffer_t of its own with room for size
+ * bytes, to be written in place. The caller sets buffer_len and coded->len
+ * once the data is there.
+ * @param frame Frame obtained with curr_in_frame or get_in_frame.
+ * @param size Bytes the caller may write.
+ * @return Start of the buffer, NULL on error.
+ */
+uint8_t *reserve_coded_frame_data(video_data_frame_t *frame, uint32_t size);
+
+/**
+ * Makes dst reference the buffer and metadata of src without copying. The
+ * buffer is recycled when every frame referencing it has been released,
+ * and a producer writing to either frame gets a buffer of its own first.
+ * @param dst Frame obtained with curr_in_frame or get_in_frame.
+ * @param src Frame obtained with curr_out_frame.
+ * @return TRUE if succeeded, FALSE otherwise.
+ */
+int share_video_data_frame(video_data_frame_t *dst, video_data_frame_t *src);
+
+/**
+ * Returns a frame to fill, or NULL if the queue is full or the frame could
+ * not get a buffer of its own (counted in alloc_failed).
+ * @param frame_cq Target video_frame_cq_t.
+ */
 video_data_frame_t* curr_in_frame(video_frame_cq_t *frame_cq);
+
+/**
+ * Producer entry point: returns a frame to fill, making room in a full queue
+ * according to its cq_policy_t.
+ * @param frame_cq Target video_frame_cq_t.
+ * @param type Type of the frame about to be queued, OTHER if still unknown.
+ * @param timeout_us Maximum time to wait when the policy needs to wait.
+ * @return video_data_frame_t * to fill, NULL if the incoming frame must be discarded.
+ */
+video_data_frame_t* get_in_frame(video_frame_cq_t *frame_cq, frame_type_t type, uint32_t timeout_us);
+
+/**
+ * get_in_frame for a frame that is only filled by share_video_data_frame.
+ * The frame keeps whatever buffer it had, maybe still shared with another
+ * queue, so no buffer is acquired only to be released by the share.
+ * @return video_data_frame_t * to pass as dst, NULL if the incoming frame must be discarded.
+ */
+video_data_frame_t* get_in_frame_to_share(video_frame_cq_t *frame_cq, frame_type_t type, uint32_t timeout_us);
 video_data_frame_t* curr_out_frame(video_frame_cq_t *frame_cq);
 int remove_frame(video_frame_cq_t *frame_cq);
-int flush_frames(video_frame_cq_t *frame_cq);
 int put_frame(video_frame_cq_t *frame_cq);
 int increase_rear_frame(video_frame_cq_t *frame_cq);
+
+/**
+ * Drops the oldest frame of a full queue to make room for the producer.
+ * @param frame_cq Target video_frame_cq_t.
+ * @return TRUE if there is room for a new frame, FALSE if the oldest frame is
+ * being processed by the consumer and could not be dropped.
+ */
 int flush_frames(video_frame_cq_t *frame_cq);
+
+/**
+ * Blocking version of curr_in_frame.
+ * @param frame_cq Target video_frame_cq_t.
+ * @param timeout_us Maximum time to wait for a free slot, in microseconds.
+ * @return video_data_frame_t * to fill, NULL if the queue is still full.
+ */
+video_data_frame_t* wait_in_frame(video_frame_cq_t *frame_cq, uint32_t timeout_us);
+
+/**
+ * Blocking version of curr_out_frame.
+ * @param frame_cq Target video_frame_cq_t.
+ * @param timeout_us Maximum time to wait for a frame, in microseconds.
+ * @return video_data_frame_t * to consume, NULL if the queue is still empty.
+ */
+video_data_frame_t* wait_out_frame(video_frame_cq_t *frame_cq, uint32_t timeout_us);
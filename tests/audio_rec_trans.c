@@ -192,7 +192,8 @@ int main()
     receiver = init_receiver(init_stream_list(),
             init_stream_list(),
             RECEIVER_VIDEO_PORT,
-            RECEIVER_AUDIO_PORT);
+            RECEIVER_AUDIO_PORT,
+            1);
     start_receiver(receiver);
     add_receiver_entity();
 
@@ -200,7 +201,7 @@ int main()
     fprintf(stderr, " ·Configuring transmitter\n");
     transmitter = init_transmitter(init_stream_list(),
             init_stream_list(),
-            25.0);
+            25.0, 0);
     start_transmitter(transmitter);
     add_transmitter_entity(TRANSMITTER_IP_1, TRANSMITTER_PORT_1);
 
@@ -42,7 +42,7 @@ static void print_cq_status(circular_queue_t *cq, char *msg) {
         m = msg;
     }
     char l;
-    switch(cq->level) {
+    switch(cq_get_level(cq)) {
         case CIRCULAR_QUEUE_MID:
             l = 'M';
             break;
@@ -84,7 +84,7 @@ int main() {
     // Receiver configuration
     stream_list_t *video_stream_list = init_stream_list(); // Not used
     stream_list_t *audio_stream_list = init_stream_list();
-    receiver_t *receiver = init_receiver(video_stream_list, audio_stream_list, 5004, 5006);
+    receiver_t *receiver = init_receiver(video_stream_list, audio_stream_list, 5004, 5006, 1);
 
     // First stream and participant configuration
     participant_data_t *p1 = init_participant(1, INPUT, NULL, 0);
@@ -110,7 +110,7 @@ int main() {
 #ifdef STREAM1
         // STREAM1 recording block
         fprintf(stderr, "  ·Waiting for audio_frame2 data\n");
-        while (stream1->audio->decoded_cq->level == CIRCULAR_QUEUE_EMPTY) {
+        while (cq_get_level(stream1->audio->decoded_cq) == CIRCULAR_QUEUE_EMPTY) {
 #ifdef QUEUE_PRINT
             print_cq_status(stream1->audio->decoded_cq, "wait stream1");
 #endif
@@ -135,7 +135,7 @@ int main() {
 #ifdef STREAM2
         // STREAM2 recording block
         fprintf(stderr, "  ·Waiting for audio_frame2 data\n");
-        while (stream2->audio->decoded_cq->level == CIRCULAR_QUEUE_EMPTY) {
+        while (cq_get_level(stream2->audio->decoded_cq) == CIRCULAR_QUEUE_EMPTY) {
 #ifdef QUEUE_PRINT
             print_cq_status(stream2->audio->decoded_cq, "wait stream2");
 #endif
@@ -15,6 +15,7 @@
 
 #define INPUT_VIDEO_PORT 5004
 #define INPUT_AUDIO_PORT 5006
+#define INPUT_VIDEO_SHARDS 2
 
 #define INPUT_VIDEO_FORMAT_FPS 25.0
 
@@ -46,27 +47,10 @@ transmitter_t *transmitter;
 static void audio_frame_forward(stream_data_t *src, stream_data_t *dst);
 static void finish_handler(int signal);
 
-// Copy one video_data_frame_t between the decoded queues of two streams.
+// Pass one video_data_frame_t between the decoded queues of two streams.
 static void video_frame_forward(stream_data_t *src, stream_data_t *dst)
 {
-    video_data_frame_t *in_frame, *out_frame;
-    in_frame = curr_out_frame(src->video->decoded_frames);
-    if (in_frame != NULL) {
-        out_frame = curr_in_frame(dst->video->decoded_frames);
-        if (out_frame != NULL) {
-            out_frame->curr_seqno = in_frame->curr_seqno;
-            out_frame->width = in_frame->width;
-            out_frame->height = in_frame->height;
-            out_frame->media_time = in_frame->media_time;
-            out_frame->seqno = in_frame->seqno;
-            out_frame->frame_type = in_frame->frame_type;
-            out_frame->codec = in_frame->codec;
-            out_frame->buffer_len = in_frame->buffer_len;
-            memcpy(out_frame->buffer, in_frame->buffer, in_frame->buffer_len);
-            put_frame(dst->video->decoded_frames);
-            remove_frame(src->video->decoded_frames);
-        }
-    }
+    fanout_video_frame(src->video, &dst->video, 1);
 }
 
 // Copy one audio_frame2 between the decoded queues of two streams.
@@ -120,7 +104,8 @@ int main()
     receiver = init_receiver(init_stream_list(),
             init_stream_list(),
             INPUT_VIDEO_PORT,
-            INPUT_AUDIO_PORT);
+            INPUT_AUDIO_PORT,
+            INPUT_VIDEO_SHARDS);
     start_receiver(receiver);
     // Video stream with a participant
     stream = init_stream(VIDEO, INPUT, rand(), I_AWAIT,
@@ -145,7 +130,7 @@ int main()
     fprintf(stderr, " ·Configuring transmitter\n");
     transmitter = init_transmitter(init_stream_list(),
             init_stream_list(),
-            OUTPUT_VIDEO_FORMAT_FPS);
+            OUTPUT_VIDEO_FORMAT_FPS, 0);
     start_transmitter(transmitter);
     // Video stream with a participant
     stream = init_stream(VIDEO, OUTPUT, 0, ACTIVE,
@@ -21,7 +21,6 @@ int main(){
     
     //video_frames structures
     video_data_frame_t *in_frame;
-    video_data_frame_t *out_frame;
     
     //Receiver structures
     stream_list_t *in_str_list;
@@ -57,9 +56,9 @@ int main(){
     out_str1        = init_stream(VIDEO, OUTPUT, 1, ACTIVE, 24.0, "i2cat_rocks");
     out_str2        = init_stream(VIDEO, OUTPUT, 2, ACTIVE, 24.0, "i2cat_rocks_2nd");
     in_str          = init_stream(VIDEO, INPUT, rand(), I_AWAIT, 24.0, NULL);
-    transmitter     = init_transmitter(out_str_list, dummy_audio_str_list1, 20.0);
+    transmitter     = init_transmitter(out_str_list, dummy_audio_str_list1, 20.0, 0);
     server          = init_rtsp_server(8554, transmitter);
-    receiver        = init_receiver(in_str_list, dummy_audio_str_list2, 5004, 5006);
+    receiver        = init_receiver(in_str_list, dummy_audio_str_list2, 5004, 5006, 1);
     in_p1           = init_participant(1, INPUT, NULL, 0);
     in_p2           = init_participant(2, INPUT, NULL, 0);
     
@@ -111,22 +110,10 @@ int main(){
                     continue;
                 }
                 
-                in_frame = curr_out_frame(in_str->video->decoded_frames);
-                out_frame = curr_in_frame(out_str->video->decoded_frames);
-                              
-                if (in_frame == NULL || out_frame == NULL){
+                if (fanout_video_frame(in_str->video, &out_str->video, 1) < 0){
                     continue;
                 }
                 
-                memcpy(out_frame->buffer, 
-                       in_frame->buffer, 
-                       in_frame->buffer_len);
-                out_frame->buffer_len 
-                    = out_frame->buffer_len;
-                    
-                remove_frame(in_str->video->decoded_frames);
-                put_frame(out_str->video->decoded_frames);
-                
                 in_str = in_str->next;
                 out_str = out_str->next;
             }